@@ -0,0 +1,102 @@
+// Submit overhead of thread_pool::add vs abstract_executor_ref::add vs abstract_executor::add,
+// and the cost of passing an abstract_executor by value.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+#include <executor.h>
+#include <thread_pool.h>
+
+#include "bench.h"
+
+namespace {
+std::atomic<size_t> g_allocations{0};
+}
+
+// Kept out of line: GCC otherwise pairs the inlined free() with the new-expression and warns
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+void* operator new(size_t size) {
+    ++g_allocations;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+// C++14 and later deallocate through the sized form, which must match the replaced new too
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+const int task_count = 1000000;
+const int copy_count = 10000000;
+
+struct sample {
+    double ns_per_op;
+    double allocations_per_op;
+};
+
+void report(const char* name, sample s) {
+    bench_result("abstract", name, 0, { bench_value("ns_per_op", s.ns_per_op), bench_value("allocs_per_op", s.allocations_per_op) });
+}
+
+// Time to submit task_count no-op tasks and have the pool run them all
+template <class Submit>
+sample submit_tasks(Submit submit) {
+    std::atomic<int> completed{0};
+    size_t allocations_before = g_allocations;
+    auto start = bench_clock::now();
+    for (int i = 0; i < task_count; ++i) {
+        submit([&] { completed.fetch_add(1, std::memory_order_relaxed); });
+    }
+    while (completed.load() != task_count) {
+        std::this_thread::yield();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+    sample s = { double(elapsed) / task_count, double(g_allocations - allocations_before) / task_count };
+    return s;
+}
+
+template <class Executor>
+sample copy_executor(Executor const& executor) {
+    size_t allocations_before = g_allocations;
+    auto start = bench_clock::now();
+    for (int i = 0; i < copy_count; ++i) {
+        abstract_executor copy(executor);
+        abstract_executor moved(std::move(copy));
+        (void)moved;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+    sample s = { double(elapsed) / copy_count, double(g_allocations - allocations_before) / copy_count };
+    return s;
+}
+
+}
+
+void abstract_executor_bench(bench_options const&) {
+    thread_pool tp;
+    abstract_executor_ref ref = &tp;
+    abstract_executor ae(tp);
+
+    report("thread_pool::add", submit_tasks([&](unique_task f) { tp.add(std::move(f)); }));
+    report("abstract_executor_ref::add", submit_tasks([&](unique_task f) { ref.add(std::move(f)); }));
+    report("abstract_executor::add", submit_tasks([&](unique_task f) { ae.add(std::move(f)); }));
+
+    report("copy+move abstract_executor(pool)", copy_executor(ae));
+    report("abstract_executor(ref)+move", copy_executor(ref));
+}
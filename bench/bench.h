@@ -0,0 +1,30 @@
+#pragma once
+
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+struct bench_options {
+    int max_threads;    // Scaling runs use 1, 2, 4 .. max_threads workers
+    bool json;          // Collect results into one JSON document instead of text lines
+};
+
+typedef std::pair<const char*, double> bench_value;
+
+void bench_start(bench_options const& options);
+
+// Prints one result, or keeps it for the JSON document written by bench_finish;
+// threads is the worker count, 0 for a default-sized pool
+void bench_result(const char* group, const char* name, int threads, std::initializer_list<bench_value> values);
+
+void bench_finish(bench_options const& options);
+
+// Worker counts the scaling benchmarks run with
+std::vector<int> bench_thread_counts(bench_options const& options);
+
+// Entry points of the individual benchmarks run by extr_bench
+void abstract_executor_bench(bench_options const& options);
+void timer_bench(bench_options const& options);
+void submit_bench(bench_options const& options);
+void latency_bench(bench_options const& options);
+void thread_per_task_bench(bench_options const& options);
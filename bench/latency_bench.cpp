@@ -0,0 +1,91 @@
+// Round-trip latency: how long a task submitted to an idle or busy pool takes to start,
+// and the cost of bouncing a task between two serial_executors.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <serial_executor.h>
+#include <thread_pool.h>
+
+#include "bench.h"
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+const int sample_count = 2000;
+const int ping_pong_count = 200000;
+
+void report(const char* name, int threads, std::vector<long long>& samples_ns) {
+    std::sort(samples_ns.begin(), samples_ns.end());
+    auto percentile = [&](double p) {
+        return samples_ns[static_cast<size_t>(p * (samples_ns.size() - 1))] / 1000.0;
+    };
+    bench_result("latency", name, threads, {
+        bench_value("p50_us", percentile(0.5)),
+        bench_value("p99_us", percentile(0.99)),
+        bench_value("max_us", samples_ns.back() / 1000.0) });
+}
+
+// Submit, then spin until the task has run; 'pause' lets the workers go to sleep first
+std::vector<long long> round_trip(thread_pool& tp, std::chrono::microseconds pause) {
+    std::vector<long long> samples_ns;
+    samples_ns.reserve(sample_count);
+    std::atomic<bool> ran{false};
+    for (int i = 0; i < sample_count; ++i) {
+        if (pause.count()) {
+            std::this_thread::sleep_for(pause);
+        }
+        ran.store(false, std::memory_order_relaxed);
+        auto start = bench_clock::now();
+        tp.add([&] { ran.store(true, std::memory_order_release); });
+        while (!ran.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        samples_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+    }
+    return samples_ns;
+}
+
+// Each closure re-posts itself to the other strand until 'remaining' runs out
+struct ping_pong {
+    serial_executor* here;
+    serial_executor* there;
+    std::atomic<int>* remaining;
+
+    void operator()() {
+        if (remaining->fetch_sub(1, std::memory_order_acq_rel) > 1) {
+            ping_pong next = { there, here, remaining };
+            there->add(next);
+        }
+    }
+};
+
+double ping_pong_ns(thread_pool& tp) {
+    serial_executor a(&tp);
+    serial_executor b(&tp);
+    std::atomic<int> remaining{ping_pong_count};
+    auto start = bench_clock::now();
+    ping_pong first = { &a, &b, &remaining };
+    a.add(first);
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count()) / ping_pong_count;
+}
+
+}
+
+void latency_bench(bench_options const& options) {
+    for (int threads : bench_thread_counts(options)) {
+        thread_pool tp(threads);
+        auto idle = round_trip(tp, std::chrono::microseconds(500));
+        report("wake_round_trip", threads, idle);
+        auto hot = round_trip(tp, std::chrono::microseconds(0));
+        report("hot_round_trip", threads, hot);
+        bench_result("latency", "serial_ping_pong", threads, { bench_value("ns_per_hop", ping_pong_ns(tp)) });
+    }
+}
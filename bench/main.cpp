@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+
+namespace {
+
+struct bench_entry {
+    const char* name;
+    void (*run)(bench_options const&);
+};
+
+const bench_entry benches[] = {
+    { "submit", &submit_bench },
+    { "latency", &latency_bench },
+    { "abstract", &abstract_executor_bench },
+    { "thread_per_task", &thread_per_task_bench },
+    { "timer", &timer_bench },
+};
+
+void usage() {
+    printf("usage: extr_bench [--json] [--threads=N] [bench ...]\nbenches:");
+    for (auto& b : benches) {
+        printf(" %s", b.name);
+    }
+    printf("\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+    bench_options options;
+    options.max_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    options.json = false;
+
+    std::vector<const char*> selected;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            options.json = true;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            options.max_threads = std::max(1, atoi(argv[i] + 10));
+        } else if (argv[i][0] == '-') {
+            usage();
+            return strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        } else {
+            selected.push_back(argv[i]);
+        }
+    }
+
+    for (const char* name : selected) {
+        bool known = false;
+        for (auto& b : benches) {
+            known = known || strcmp(name, b.name) == 0;
+        }
+        if (!known) {
+            usage();
+            return 1;
+        }
+    }
+
+    bench_start(options);
+    for (auto& b : benches) {
+        bool run = selected.empty();
+        for (const char* name : selected) {
+            run = run || strcmp(name, b.name) == 0;
+        }
+        if (run) {
+            b.run(options);
+        }
+    }
+    bench_finish(options);
+    return 0;
+}
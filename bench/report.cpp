@@ -0,0 +1,71 @@
+// Result collection for extr_bench: human-readable lines by default, one JSON document with --json.
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+
+namespace {
+
+struct result {
+    std::string group;
+    std::string name;
+    int threads;
+    std::vector<std::pair<std::string, double>> values;
+};
+
+std::vector<result> g_results;
+bool g_json = false;
+
+}
+
+void bench_start(bench_options const& options) {
+    g_json = options.json;
+}
+
+void bench_result(const char* group, const char* name, int threads, std::initializer_list<bench_value> values) {
+    result r;
+    r.group = group;
+    r.name = name;
+    r.threads = threads;
+    for (auto& v : values) {
+        r.values.emplace_back(v.first, v.second);
+    }
+    if (g_json) {
+        g_results.push_back(r);
+        return;
+    }
+    printf("%-10s %-36s %3d thr ", group, name, threads);
+    for (auto& v : r.values) {
+        printf(" %s %.1f", v.first.c_str(), v.second);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+void bench_finish(bench_options const& options) {
+    if (!options.json) {
+        return;
+    }
+    printf("{\n  \"hardware_concurrency\": %u,\n  \"results\": [", std::thread::hardware_concurrency());
+    for (size_t i = 0; i < g_results.size(); ++i) {
+        result const& r = g_results[i];
+        printf("%s\n    {\"group\": \"%s\", \"name\": \"%s\", \"threads\": %d", i ? "," : "", r.group.c_str(), r.name.c_str(), r.threads);
+        for (auto& v : r.values) {
+            printf(", \"%s\": %.3f", v.first.c_str(), v.second);
+        }
+        printf("}");
+    }
+    printf("\n  ]\n}\n");
+}
+
+std::vector<int> bench_thread_counts(bench_options const& options) {
+    std::vector<int> counts;
+    for (int n = 1; n < options.max_threads; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(options.max_threads);
+    return counts;
+}
@@ -0,0 +1,109 @@
+// Submit throughput of thread_pool with one and with many producers, across worker counts.
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <thread_pool.h>
+#include <unique_task.h>
+
+#include "bench.h"
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+const int task_count = 500000;
+const int batch_size = 256;
+
+double elapsed_ns(bench_clock::time_point start) {
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+}
+
+void wait_for(std::atomic<int>& completed, int count) {
+    while (completed.load(std::memory_order_acquire) != count) {
+        std::this_thread::yield();
+    }
+}
+
+void report(const char* name, int threads, double ns) {
+    bench_result("submit", name, threads, {
+        bench_value("ns_per_task", ns / task_count),
+        bench_value("mtasks_per_s", task_count / ns * 1000.0) });
+}
+
+// One thread submits every task, the pool runs them
+double single_producer(thread_pool& tp) {
+    std::atomic<int> completed{0};
+    auto start = bench_clock::now();
+    for (int i = 0; i < task_count; ++i) {
+        tp.add([&] { completed.fetch_add(1, std::memory_order_release); });
+    }
+    wait_for(completed, task_count);
+    return elapsed_ns(start);
+}
+
+// 'producers' threads submit task_count tasks between them
+double multi_producer(thread_pool& tp, int producers) {
+    std::atomic<int> completed{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    int per_producer = task_count / producers;
+    int total = per_producer * producers;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&] {
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            for (int i = 0; i < per_producer; ++i) {
+                tp.add([&] { completed.fetch_add(1, std::memory_order_release); });
+            }
+        });
+    }
+    auto start = bench_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& t : threads) {
+        t.join();
+    }
+    wait_for(completed, total);
+    return elapsed_ns(start) * task_count / total;
+}
+
+// One thread submits batch_size tasks per add_bulk call
+double bulk_producer(thread_pool& tp) {
+    std::atomic<int> completed{0};
+    std::vector<unique_task> batch;
+    batch.reserve(batch_size);
+    auto start = bench_clock::now();
+    for (int i = 0; i < task_count; i += batch_size) {
+        for (int j = i; j < i + batch_size && j < task_count; ++j) {
+            batch.emplace_back([&] { completed.fetch_add(1, std::memory_order_release); });
+        }
+        tp.add_bulk(std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+        batch.clear();
+    }
+    wait_for(completed, task_count);
+    return elapsed_ns(start);
+}
+
+// add_n hands out indices from shared runners instead of one task per index
+double apply(thread_pool& tp) {
+    std::atomic<int> completed{0};
+    auto start = bench_clock::now();
+    tp.add_n(task_count, [&](size_t) { completed.fetch_add(1, std::memory_order_release); });
+    wait_for(completed, task_count);
+    return elapsed_ns(start);
+}
+
+}
+
+void submit_bench(bench_options const& options) {
+    for (int threads : bench_thread_counts(options)) {
+        thread_pool tp(threads);
+        report("single_producer", threads, single_producer(tp));
+        report("multi_producer", threads, multi_producer(tp, threads));
+        report("add_bulk", threads, bulk_producer(tp));
+        report("add_n", threads, apply(tp));
+    }
+}
@@ -0,0 +1,38 @@
+// Cost of thread_per_task_executor::add, with a new thread per task and with cached threads.
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <thread_per_task_executor.h>
+
+#include "bench.h"
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+const int task_count = 2000;
+
+// Adds one task at a time and waits for it, so a cached thread is idle for every add
+double ns_per_task(thread_per_task_options const& options) {
+    thread_per_task_executor executor(options);
+    std::atomic<int> completed{0};
+    auto start = bench_clock::now();
+    for (int i = 0; i < task_count; ++i) {
+        executor.add([&] { completed.fetch_add(1, std::memory_order_release); });
+        while (completed.load(std::memory_order_acquire) != i + 1) {
+            std::this_thread::yield();
+        }
+    }
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count()) / task_count;
+}
+
+}
+
+void thread_per_task_bench(bench_options const&) {
+    thread_per_task_options spawn;
+    spawn.keep_alive = std::chrono::nanoseconds(0);
+    bench_result("spawn", "thread_per_task_executor::add(new)", 0, { bench_value("ns_per_task", ns_per_task(spawn)) });
+    bench_result("spawn", "thread_per_task_executor::add(cached)", 0, { bench_value("ns_per_task", ns_per_task(thread_per_task_options())) });
+}
@@ -0,0 +1,67 @@
+// Lateness of add_at/add_after: how long after its deadline each timed task starts running.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <thread_pool.h>
+
+#include "bench.h"
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+const int timer_count = 20000;
+const int max_delay_us = 200000;
+
+void report(const char* name, std::vector<long long>& lateness_ns) {
+    std::sort(lateness_ns.begin(), lateness_ns.end());
+    auto percentile = [&](double p) {
+        size_t index = static_cast<size_t>(p * (lateness_ns.size() - 1));
+        return lateness_ns[index] / 1000.0;
+    };
+    bench_result("timer", name, 0, {
+        bench_value("lateness_p50_us", percentile(0.5)),
+        bench_value("lateness_p90_us", percentile(0.9)),
+        bench_value("lateness_p99_us", percentile(0.99)),
+        bench_value("lateness_p999_us", percentile(0.999)),
+        bench_value("lateness_max_us", lateness_ns.back() / 1000.0) });
+}
+
+// Spreads timer_count timers over [0, max_delay_us) and records how late each one ran
+template <class Schedule>
+std::vector<long long> measure(Schedule schedule) {
+    std::vector<long long> lateness_ns(timer_count);
+    std::atomic<int> completed{0};
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> delay_us(0, max_delay_us - 1);
+    {
+        thread_pool tp;
+        for (int i = 0; i < timer_count; ++i) {
+            auto delay = std::chrono::microseconds(delay_us(random));
+            auto deadline = bench_clock::now() + delay;
+            schedule(tp, delay, deadline, [&lateness_ns, &completed, i, deadline] {
+                lateness_ns[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - deadline).count();
+                ++completed;
+            });
+        }
+    }
+    return lateness_ns;
+}
+
+}
+
+void timer_bench(bench_options const&) {
+    auto at = measure([](thread_pool& tp, std::chrono::microseconds, bench_clock::time_point deadline, unique_task f) {
+        tp.add_at(deadline, std::move(f));
+    });
+    report("add_at(steady_clock)", at);
+
+    auto after = measure([](thread_pool& tp, std::chrono::microseconds delay, bench_clock::time_point, unique_task f) {
+        tp.add_after(delay, std::move(f));
+    });
+    report("add_after", after);
+}
@@ -0,0 +1,136 @@
+#ifndef CAPACITY_GATE
+#define CAPACITY_GATE
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+using namespace std;
+
+// What add() does with a closure that finds a bounded executor's queue full
+enum class overflow_policy {
+    reject,             // Destroy the new closure
+    run_in_caller,      // Run it on the calling thread before add() returns
+    drop_oldest         // Destroy the oldest queued task instead, where the queue allows it
+};
+
+namespace details {
+
+/* Queue capacity of one executor. Tasks admitted while a capacity is set hold a slot until
+   they start; the count is a single atomic, claimed with a CAS and given back with one add,
+   so admission takes no lock. Only producers waiting for space in acquire_until sleep on the
+   mutex, and releases look at it only while such a waiter exists. The capacity can change at
+   any time: tasks queued while unbounded hold no slot, so the queue may exceed a capacity
+   set later until they have started. */
+class capacity_gate {
+    atomic<size_t> m_capacity;      // 0: unbounded
+    atomic<int> m_policy;
+    atomic<size_t> m_used;
+    atomic<size_t> m_waiters;
+    atomic<uint64_t> m_rejected;
+    mutex m_lock;
+    condition_variable m_space;
+
+    capacity_gate(capacity_gate const &);
+    capacity_gate & operator=(capacity_gate const &);
+
+    // True when a slot was taken; 'bounded' tells whether a capacity was set at all
+    bool claim(bool& bounded) {
+        size_t capacity = m_capacity.load(memory_order_relaxed);
+        bounded = capacity != 0;
+        if (!bounded) {
+            return true;
+        }
+        size_t used = m_used.load(memory_order_seq_cst);
+        do {
+            if (used >= capacity) {
+                return false;
+            }
+        } while (!m_used.compare_exchange_weak(used, used + 1, memory_order_seq_cst, memory_order_relaxed));
+        return true;
+    }
+
+    void wake_waiters() {
+        if (m_waiters.load(memory_order_seq_cst) != 0) {
+            lock_guard<mutex> lk(m_lock);
+            m_space.notify_all();
+        }
+    }
+
+public:
+    explicit capacity_gate(size_t capacity = 0, overflow_policy policy = overflow_policy::reject) :
+        m_capacity(capacity), m_policy(static_cast<int>(policy)), m_used(0), m_waiters(0), m_rejected(0) {}
+
+    void set(size_t capacity, overflow_policy policy) {
+        m_policy.store(static_cast<int>(policy), memory_order_relaxed);
+        m_capacity.store(capacity, memory_order_seq_cst);
+        wake_waiters();
+    }
+
+    size_t capacity() const {
+        return m_capacity.load(memory_order_relaxed);
+    }
+
+    overflow_policy policy() const {
+        return static_cast<overflow_policy>(m_policy.load(memory_order_relaxed));
+    }
+
+    /* False when the queue is full; otherwise 'slot' tells whether the task holds a slot and
+       must give it back with release() once it starts */
+    bool try_acquire(bool& slot) {
+        return claim(slot);
+    }
+
+    // Waits for space until 'deadline'
+    bool acquire_until(const chrono::steady_clock::time_point& deadline, bool& slot) {
+        if (claim(slot)) {
+            return true;
+        }
+        unique_lock<mutex> lk(m_lock);
+        // Announced before the next claim; pairs with the seq_cst release in release()
+        m_waiters.fetch_add(1, memory_order_seq_cst);
+        bool admitted;
+        while (!(admitted = claim(slot))) {
+            if (m_space.wait_until(lk, deadline) == cv_status::timeout) {
+                admitted = claim(slot);
+                break;
+            }
+        }
+        m_waiters.fetch_sub(1, memory_order_relaxed);
+        return admitted;
+    }
+
+    // Waits for space as long as it takes
+    void acquire(bool& slot) {
+        if (claim(slot)) {
+            return;
+        }
+        unique_lock<mutex> lk(m_lock);
+        m_waiters.fetch_add(1, memory_order_seq_cst);
+        while (!claim(slot)) {
+            m_space.wait(lk);
+        }
+        m_waiters.fetch_sub(1, memory_order_relaxed);
+    }
+
+    void release(size_t count = 1) {
+        m_used.fetch_sub(count, memory_order_seq_cst);
+        wake_waiters();
+    }
+
+    // Closures refused or dropped because the queue was full
+    void rejected() {
+        m_rejected.fetch_add(1, memory_order_relaxed);
+    }
+
+    uint64_t rejected_count() const {
+        return m_rejected.load(memory_order_relaxed);
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,362 @@
+#ifndef COROUTINES
+#define COROUTINES
+
+// Coroutine support needs a C++20 compiler; see EXTR_CXX20 in CMakeLists.txt
+#ifndef EXTR_COROUTINES
+#if defined(__cpp_impl_coroutine)
+#define EXTR_COROUTINES 1
+#else
+#define EXTR_COROUTINES 0
+#endif
+#endif
+
+// Set to 0 to allocate every coroutine frame from the global heap
+#ifndef EXTR_COROUTINE_FRAME_POOL
+#define EXTR_COROUTINE_FRAME_POOL 1
+#endif
+
+#if EXTR_COROUTINES
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "task_node.h"
+#include "timer_wheel.h"
+#include "unique_task.h"
+
+using namespace std;
+
+namespace details {
+
+// Resumes a suspended coroutine; trivially copyable, so unique_task keeps it inline
+struct resume_task {
+    coroutine_handle<> handle;
+
+    void operator()() const {
+        handle.resume();
+    }
+};
+
+/* Per-thread free lists of coroutine frames in 64-byte size classes. A frame goes back to the list
+   of the thread that destroys it, and workers are the threads resuming and finishing tasks, so a
+   steady stream of tasks on a pool stops touching the global heap after warm-up. */
+class frame_pool {
+    enum : size_t { granule = 64, class_count = 16, max_cached = 64 };
+
+    struct block {
+        block* next;
+    };
+
+    block* m_free[class_count];
+    size_t m_cached[class_count];
+
+    frame_pool() {
+        for (size_t c = 0; c < class_count; ++c) {
+            m_free[c] = nullptr;
+            m_cached[c] = 0;
+        }
+    }
+
+    ~frame_pool() {
+        for (size_t c = 0; c < class_count; ++c) {
+            while (block* b = m_free[c]) {
+                m_free[c] = b->next;
+                ::operator delete(b);
+            }
+        }
+    }
+
+    frame_pool(frame_pool const &);
+    frame_pool & operator=(frame_pool const &);
+
+    static frame_pool& local() {
+        static thread_local frame_pool pool;
+        return pool;
+    }
+
+    // 1-based size class, or 0 for frames too big to cache
+    static size_t class_of(size_t size) {
+        size_t c = (size + granule - 1) / granule;
+        return c <= class_count ? c : 0;
+    }
+
+public:
+    static void* allocate(size_t size) {
+        size_t c = EXTR_COROUTINE_FRAME_POOL ? class_of(size) : 0;
+        if (c == 0) {
+            return ::operator new(size);
+        }
+        frame_pool& pool = local();
+        if (block* b = pool.m_free[c - 1]) {
+            pool.m_free[c - 1] = b->next;
+            --pool.m_cached[c - 1];
+            return b;
+        }
+        return ::operator new(c * granule);
+    }
+
+    static void deallocate(void* frame, size_t size) {
+        size_t c = EXTR_COROUTINE_FRAME_POOL ? class_of(size) : 0;
+        if (c == 0) {
+            ::operator delete(frame);
+            return;
+        }
+        frame_pool& pool = local();
+        if (pool.m_cached[c - 1] == max_cached) {
+            ::operator delete(frame);
+            return;
+        }
+        block* b = static_cast<block*>(frame);
+        b->next = pool.m_free[c - 1];
+        pool.m_free[c - 1] = b;
+        ++pool.m_cached[c - 1];
+    }
+};
+
+// Promise base that puts the coroutine frame in the frame_pool
+struct pooled_frame {
+    static void* operator new(size_t size) {
+        return frame_pool::allocate(size);
+    }
+
+    static void operator delete(void* frame, size_t size) {
+        frame_pool::deallocate(frame, size);
+    }
+};
+
+}
+
+/* co_await schedule_on(executor) continues the coroutine as a task on 'executor'. The closure
+   handed to add() is the bare coroutine handle. */
+template<class Executor>
+class schedule_awaitable {
+    Executor* m_executor;
+
+public:
+    explicit schedule_awaitable(Executor& executor) : m_executor(&executor) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    // The coroutine may resume on a worker before add() returns, so nothing here runs after it
+    void await_suspend(coroutine_handle<> handle) {
+        m_executor->add(details::resume_task{ handle });
+    }
+
+    void await_resume() const noexcept {}
+};
+
+template<class Executor>
+schedule_awaitable<Executor> schedule_on(Executor& executor) {
+    return schedule_awaitable<Executor>(executor);
+}
+
+/* Awaitable behind executor.after(d) and executor.at(t): continues the coroutine on the executor
+   once the deadline has passed. Executors with add_at keep it as one of their own timers; others
+   wait in the shared timer_service, with this awaitable (in the coroutine frame) as target. */
+template<class Executor>
+class timed_awaitable : details::timer_target {
+    Executor* m_executor;
+    chrono::steady_clock::time_point m_deadline;
+
+    virtual void submit_timers(details::task_node* first, size_t) override {
+        // The only timer is our own resumption; once it is added this frame may be gone
+        Executor* executor = m_executor;
+        unique_task resume = std::move(first->fnc);
+        delete first;
+        executor->add(std::move(resume));
+    }
+
+public:
+    timed_awaitable(Executor& executor, chrono::steady_clock::time_point deadline) :
+        m_executor(&executor), m_deadline(deadline) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(coroutine_handle<> handle) {
+        details::resume_task resume = { handle };
+        if constexpr (requires(Executor& e) { e.add_at(m_deadline, resume); }) {
+            m_executor->add_at(m_deadline, resume);
+        } else {
+            details::timer_service::instance().schedule(this, m_deadline, new details::task_node(resume))->release();
+        }
+    }
+
+    void await_resume() const noexcept {}
+};
+
+template<class Executor, class Rep, class Period>
+timed_awaitable<Executor> after(Executor& executor, const chrono::duration<Rep, Period>& rel_time) {
+    return timed_awaitable<Executor>(executor, chrono::steady_clock::now() + details::to_steady_duration(rel_time));
+}
+
+template<class Executor, class Clock, class Duration>
+timed_awaitable<Executor> at(Executor& executor, const chrono::time_point<Clock, Duration>& abs_time) {
+    return timed_awaitable<Executor>(executor, details::to_steady_time(abs_time));
+}
+
+template<class T = void>
+class task;
+
+namespace details {
+
+class task_promise_base : public pooled_frame {
+    // Resumes whoever awaited the task; a task nobody awaits just stops at its end
+    struct final_awaiter {
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template<class Promise>
+        coroutine_handle<> await_suspend(coroutine_handle<Promise> handle) noexcept {
+            coroutine_handle<> continuation = handle.promise().m_continuation;
+            return continuation ? continuation : noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+protected:
+    exception_ptr m_error;
+
+public:
+    coroutine_handle<> m_continuation;
+
+    suspend_always initial_suspend() const noexcept {
+        return {};
+    }
+
+    final_awaiter final_suspend() const noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        m_error = current_exception();
+    }
+};
+
+template<class T>
+class task_promise : public task_promise_base {
+    optional<T> m_value;
+
+public:
+    task<T> get_return_object();
+
+    template<class U>
+    void return_value(U&& value) {
+        m_value.emplace(std::forward<U>(value));
+    }
+
+    T result() {
+        if (m_error) {
+            rethrow_exception(m_error);
+        }
+        return std::move(*m_value);
+    }
+};
+
+template<>
+class task_promise<void> : public task_promise_base {
+public:
+    task<void> get_return_object();
+
+    void return_void() {}
+
+    void result() {
+        if (m_error) {
+            rethrow_exception(m_error);
+        }
+    }
+};
+
+}
+
+/* Lazy coroutine: nothing runs until the task is awaited, and then it runs on the awaiting
+   thread until it suspends itself (e.g. on schedule_on). Completion resumes the awaiter by
+   symmetric transfer, so chains of tasks need neither a queue hop nor stack growth. */
+template<class T>
+class task {
+public:
+    typedef details::task_promise<T> promise_type;
+
+private:
+    coroutine_handle<promise_type> m_handle;
+
+    struct awaiter {
+        coroutine_handle<promise_type> handle;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        coroutine_handle<> await_suspend(coroutine_handle<> continuation) noexcept {
+            handle.promise().m_continuation = continuation;
+            return handle;
+        }
+
+        T await_resume() {
+            return handle.promise().result();
+        }
+    };
+
+public:
+    explicit task(coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+    task(task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+
+    task& operator=(task&& other) noexcept {
+        if (this != &other) {
+            if (m_handle) {
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    task(task const &) = delete;
+    task & operator=(task const &) = delete;
+
+    ~task() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    bool valid() const {
+        return static_cast<bool>(m_handle);
+    }
+
+    awaiter operator co_await() const & noexcept {
+        return awaiter{ m_handle };
+    }
+
+    awaiter operator co_await() const && noexcept {
+        return awaiter{ m_handle };
+    }
+};
+
+namespace details {
+
+template<class T>
+task<T> task_promise<T>::get_return_object() {
+    return task<T>(coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() {
+    return task<void>(coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+}
+
+#endif
+
+#endif
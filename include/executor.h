@@ -1,13 +1,21 @@
 #ifndef EXECUTOR
 #define EXECUTOR
 
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <new>
+#include <vector>
 
-#if EXTR_DEFINE_MISSING_STD_TYPES
+#include "coroutines.h"
+#include "executor_metrics.h"
+#include "unique_task.h"
+
+// Only C++11 lacks these; later standards ship their own
+#if EXTR_DEFINE_MISSING_STD_TYPES && __cplusplus < 201402L
 namespace std {
 
 template<class T, class... AN>
@@ -23,69 +31,734 @@ using aligned_storage_t = typename aligned_storage<Size>::type;
 
 using namespace std;
 
+// Scheduling classes for add(priority, f), most urgent first
+enum class task_priority { high, normal, low, background };
+
+enum : size_t { task_priority_levels = 4 };
+
+// Outcome of thread_pool::shutdown
+struct shutdown_result
+{
+    shutdown_result() : discarded(0), drained(true) {}
+
+    size_t discarded;   // Queued, timed and late tasks destroyed without running
+    bool drained;       // Nothing was queued or running any more when the drain time was up
+};
+
+// Called with each task a shutdown discards, before it is destroyed; it may move the task away
+typedef function<void(unique_task&)> discard_handler;
+
+template <typename T>
+class task_future;
+
 namespace detail
 {
-    class base_type
+    // What add_with_result(f) returns; task_future.h has the definitions
+    template <typename Func>
+    struct future_of
+    {
+        typedef task_future<typename result_of<typename decay<Func>::type()>::type> type;
+    };
+
+    template <typename Executor, typename Func>
+    typename future_of<Func>::type add_with_result(Executor& executor, Func&& f);
+
+    /* Marks the calling thread as running work for 'owner' while the frame is alive. Strands and
+       pools that do not own a dedicated thread link one around each task run, so the chain lists
+       every executor whose guarantees the thread currently satisfies, innermost first. */
+    class executor_frame
     {
     public:
 
-        virtual void add(std::function<void(void)>) = 0;
-        virtual std::unique_ptr<base_type> copy() const = 0;
-        virtual ~base_type() { }
+        explicit executor_frame(void const* owner)
+            : _owner(owner), _outer(top())
+        {
+            top() = this;
+        }
+
+        ~executor_frame()
+        {
+            top() = _outer;
+        }
+
+        // Hides the calling thread's frames while it runs something unrelated, e.g. a task it helps with
+        class suspend
+        {
+        public:
+
+            suspend()
+                : _saved(top())
+            {
+                top() = nullptr;
+            }
+
+            ~suspend()
+            {
+                top() = _saved;
+            }
+
+        private:
+
+            suspend(suspend const&);
+            suspend& operator=(suspend const&);
+
+            executor_frame* _saved;
+        };
+
+        static bool running_in(void const* owner)
+        {
+            for (executor_frame const* frame = top(); frame; frame = frame->_outer)
+            {
+                if (frame->_owner == owner)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+
+        executor_frame(executor_frame const&);
+        executor_frame& operator=(executor_frame const&);
+
+        static executor_frame*& top()
+        {
+            static thread_local executor_frame* frame = nullptr;
+            return frame;
+        }
+
+        void const*     _owner;
+        executor_frame* _outer;
     };
 
-    template <typename Executor>
-    class implementation_type : public base_type
+    /* Counts the closures dispatch() is running inline on the calling thread. Past the limit
+       dispatch() queues instead, so long continuation chains cannot exhaust the stack. */
+    class inline_dispatch
     {
     public:
 
-        implementation_type(Executor executor)
-            : _executor(std::move(executor))
+        enum : size_t { max_depth = 16 };
+
+        inline_dispatch()
         {
+            ++depth();
         }
 
-        virtual void add(std::function<void(void)> f) override
+        ~inline_dispatch()
         {
-            return _executor.add(std::move(f));
+            --depth();
         }
 
-        virtual std::unique_ptr<base_type> copy() const override
+        static bool allowed()
         {
-            return std::make_unique<implementation_type<Executor>>(*this);
+            return depth() < max_depth;
         }
 
     private:
 
-        Executor _executor;
+        inline_dispatch(inline_dispatch const&);
+        inline_dispatch& operator=(inline_dispatch const&);
+
+        static size_t& depth()
+        {
+            static thread_local size_t nested = 0;
+            return nested;
+        }
     };
 
-    class ref_base_type
+    /* Implemented by pools that can put another thread to work while one of theirs blocks. The
+       pool installs itself on each of its threads; blocking_region calls it there. */
+    class blocking_handler
+    {
+    public:
+
+        virtual void enter_blocking() = 0;
+        virtual void leave_blocking() = 0;
+
+        static blocking_handler*& current()
+        {
+            static thread_local blocking_handler* handler = nullptr;
+            return handler;
+        }
+
+    protected:
+
+        ~blocking_handler() {}
+    };
+
+    // dispatch() for executors that only promise which threads run their tasks
+    template <typename Executor, typename Func>
+    void dispatch_or_add(Executor& executor, Func&& f)
+    {
+        if (inline_dispatch::allowed() && executor.running_in_this_thread())
+        {
+            inline_dispatch scope;
+            f();
+            return;
+        }
+        executor.add(std::forward<Func>(f));
+    }
+
+    /* Shared state of an add_n: each of 'runners' tasks claims indices from 'next' until all
+       'count' are taken, so the batch needs one allocation however large it is. The last runner
+       to finish, or to be destroyed unrun, frees the block. */
+    template <typename Func>
+    class apply_block
     {
     public:
 
-        virtual void add(std::function<void(void)>) = 0;
-        virtual std::unique_ptr<base_type> copy_target() const = 0;
-        virtual ~ref_base_type() { }
+        template <typename F>
+        apply_block(size_t count, size_t runners, F&& f)
+            : _f(std::forward<F>(f)), _count(count), _next(0), _active(runners)
+        {
+        }
+
+        void run()
+        {
+            for (size_t i = _next.fetch_add(1, memory_order_relaxed); i < _count; i = _next.fetch_add(1, memory_order_relaxed))
+            {
+                _f(i);
+            }
+            release();
+        }
+
+        void release()
+        {
+            if (_active.fetch_sub(1, memory_order_acq_rel) == 1)
+            {
+                delete this;
+            }
+        }
+
+    private:
+
+        Func           _f;
+        size_t         _count;
+        atomic<size_t> _next;
+        atomic<size_t> _active;
+    };
+
+    // One runner task of an apply_block; small enough for unique_task's buffer
+    template <typename Func>
+    class apply_runner
+    {
+    public:
+
+        explicit apply_runner(apply_block<Func>* block)
+            : _block(block)
+        {
+        }
+
+        apply_runner(apply_runner&& other) noexcept
+            : _block(other._block)
+        {
+            other._block = nullptr;
+        }
+
+        // A runner discarded by a shutdown still counts out of the block
+        ~apply_runner()
+        {
+            if (_block)
+            {
+                _block->release();
+            }
+        }
+
+        void operator()()
+        {
+            apply_block<Func>* block = _block;
+            _block = nullptr;
+            block->run();
+        }
+
+    private:
+
+        apply_runner(apply_runner const&);
+        apply_runner& operator=(apply_runner const&);
+
+        apply_block<Func>* _block;
+    };
+
+    // f(0) .. f(count - 1) through 'runners' tasks added to any executor
+    template <typename Executor, typename Func>
+    void add_apply(Executor& executor, size_t count, size_t runners, Func&& f)
+    {
+        typedef typename decay<Func>::type function_type;
+        if (count == 0)
+        {
+            return;
+        }
+        runners = runners < count ? runners : count;
+        apply_block<function_type>* block = new apply_block<function_type>(count, runners, std::forward<Func>(f));
+        for (size_t i = 0; i < runners; ++i)
+        {
+            executor.add(apply_runner<function_type>(block));
+        }
+    }
+
+    /* Hand-rolled vtable for the executor owned by an abstract_executor. All entries take the
+       address of the abstract_executor's inline buffer; construct takes an Executor const*. */
+    struct executor_vtable
+    {
+        void (*add)(void* storage, unique_task&& f);
+        void (*add_unbounded)(void* storage, unique_task&& f);
+        void (*add_priority)(void* storage, task_priority priority, unique_task&& f);
+        void (*add_bulk)(void* storage, unique_task* first, size_t count);
+        void (*add_n)(void* storage, size_t count, function<void(size_t)>&& f);
+        void (*dispatch)(void* storage, unique_task&& f);
+        bool (*running_in_this_thread)(void const* storage);
+        executor_metrics (*metrics)(void const* storage);
+        void (*copy)(void* dst, void const* src);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+        void (*construct)(void* dst, void const* executor);
+    };
+
+    /* abstract_executor_ref only needs to forward add; owner describes how an
+       abstract_executor would hold a copy of the same executor */
+    struct executor_ref_vtable
+    {
+        void (*add)(void* executor, unique_task&& f);
+        void (*add_unbounded)(void* executor, unique_task&& f);
+        void (*add_priority)(void* executor, task_priority priority, unique_task&& f);
+        void (*add_bulk)(void* executor, unique_task* first, size_t count);
+        void (*add_n)(void* executor, size_t count, function<void(size_t)>&& f);
+        void (*dispatch)(void* executor, unique_task&& f);
+        bool (*running_in_this_thread)(void const* executor);
+        executor_metrics (*metrics)(void const* executor);
+        executor_vtable const* owner;
+    };
+
+    // Executors with their own add_bulk/add_n get batches in one call, others one add per task
+    template <typename Executor>
+    struct has_bulk_add
+    {
+        template <typename E>
+        static auto test(int) -> decltype(
+            declval<E&>().add_bulk(declval<move_iterator<unique_task*>>(), declval<move_iterator<unique_task*>>()),
+            declval<E&>().add_n(size_t(), declval<function<void(size_t)>>()),
+            true_type());
+
+        template <typename E>
+        static false_type test(...);
+
+        typedef decltype(test<Executor>(0)) type;
+    };
+
+    template <typename Executor>
+    void bulk_add(Executor& executor, unique_task* first, size_t count, true_type)
+    {
+        executor.add_bulk(make_move_iterator(first), make_move_iterator(first + count));
+    }
+
+    template <typename Executor>
+    void bulk_add(Executor& executor, unique_task* first, size_t count, false_type)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            executor.add(std::move(first[i]));
+        }
+    }
+
+    template <typename Executor>
+    void bulk_add_n(Executor& executor, size_t count, function<void(size_t)>&& f, true_type)
+    {
+        executor.add_n(count, std::move(f));
+    }
+
+    template <typename Executor>
+    void bulk_add_n(Executor& executor, size_t count, function<void(size_t)>&& f, false_type)
+    {
+        // Concurrency unknown: one runner per index, indices are still claimed dynamically
+        add_apply(executor, count, count, std::move(f));
+    }
+
+    template <typename Executor>
+    struct has_priority_add
+    {
+        template <typename E>
+        static auto test(int) -> decltype(declval<E&>().add(task_priority::normal, declval<unique_task>()), true_type());
+
+        template <typename E>
+        static false_type test(...);
+
+        typedef decltype(test<Executor>(0)) type;
+    };
+
+    template <typename Executor>
+    void priority_add(Executor& executor, task_priority priority, unique_task&& f, true_type)
+    {
+        executor.add(priority, std::move(f));
+    }
+
+    // Executors without priorities (e.g. a strand) run everything in their own order
+    template <typename Executor>
+    void priority_add(Executor& executor, task_priority, unique_task&& f, false_type)
+    {
+        executor.add(std::move(f));
+    }
+
+    template <typename Executor>
+    struct has_unbounded_add
+    {
+        template <typename E>
+        static auto test(int) -> decltype(declval<E&>().add_unbounded(declval<unique_task>()), true_type());
+
+        template <typename E>
+        static false_type test(...);
+
+        typedef decltype(test<Executor>(0)) type;
+    };
+
+    template <typename Executor>
+    void unbounded_add(Executor& executor, unique_task&& f, true_type)
+    {
+        executor.add_unbounded(std::move(f));
+    }
+
+    // An executor without a capacity has nothing to bypass
+    template <typename Executor>
+    void unbounded_add(Executor& executor, unique_task&& f, false_type)
+    {
+        executor.add(std::move(f));
+    }
+
+    template <typename Executor>
+    struct has_dispatch
+    {
+        template <typename E>
+        static auto test(int) -> decltype(
+            declval<E&>().dispatch(declval<unique_task>()),
+            declval<E const&>().running_in_this_thread(),
+            true_type());
+
+        template <typename E>
+        static false_type test(...);
+
+        typedef decltype(test<Executor>(0)) type;
+    };
+
+    template <typename Executor>
+    void dispatch_to(Executor& executor, unique_task&& f, true_type)
+    {
+        executor.dispatch(std::move(f));
+    }
+
+    // Nothing is known about where such an executor runs its tasks, so dispatch always queues
+    template <typename Executor>
+    void dispatch_to(Executor& executor, unique_task&& f, false_type)
+    {
+        executor.add(std::move(f));
+    }
+
+    template <typename Executor>
+    bool running_in(Executor const& executor, true_type)
+    {
+        return executor.running_in_this_thread();
+    }
+
+    template <typename Executor>
+    bool running_in(Executor const&, false_type)
+    {
+        return false;
+    }
+
+    template <typename Executor>
+    struct has_metrics
+    {
+        template <typename E>
+        static auto test(int) -> decltype(declval<E const&>().metrics(), true_type());
+
+        template <typename E>
+        static false_type test(...);
+
+        typedef decltype(test<Executor>(0)) type;
+    };
+
+    template <typename Executor>
+    executor_metrics metrics_of(Executor const& executor, true_type)
+    {
+        return executor.metrics();
+    }
+
+    // Executors that keep no counters report an empty snapshot
+    template <typename Executor>
+    executor_metrics metrics_of(Executor const&, false_type)
+    {
+        return executor_metrics();
+    }
+
+    enum : size_t { executor_inline_size = sizeof(void*) * 4 };
+
+    typedef aligned_storage<executor_inline_size, alignof(void*)>::type executor_storage;
+
+    template <typename Executor>
+    struct fits_executor_storage : integral_constant<bool,
+        sizeof(Executor) <= executor_inline_size &&
+        alignof(void*) % alignof(Executor) == 0 &&
+        is_nothrow_move_constructible<Executor>::value> {};
+
+    // Executor lives in the buffer itself
+    template <typename Executor>
+    struct inline_executor
+    {
+        static Executor& get(void* storage) { return *static_cast<Executor*>(storage); }
+
+        static Executor const& get(void const* storage) { return *static_cast<Executor const*>(storage); }
+
+        static void add(void* storage, unique_task&& f)
+        {
+            get(storage).add(std::move(f));
+        }
+
+        static void add_unbounded(void* storage, unique_task&& f)
+        {
+            unbounded_add(get(storage), std::move(f), typename has_unbounded_add<Executor>::type());
+        }
+
+        static void add_priority(void* storage, task_priority priority, unique_task&& f)
+        {
+            priority_add(get(storage), priority, std::move(f), typename has_priority_add<Executor>::type());
+        }
+
+        static void add_bulk(void* storage, unique_task* first, size_t count)
+        {
+            bulk_add(get(storage), first, count, typename has_bulk_add<Executor>::type());
+        }
+
+        static void add_n(void* storage, size_t count, function<void(size_t)>&& f)
+        {
+            bulk_add_n(get(storage), count, std::move(f), typename has_bulk_add<Executor>::type());
+        }
+
+        static void dispatch(void* storage, unique_task&& f)
+        {
+            dispatch_to(get(storage), std::move(f), typename has_dispatch<Executor>::type());
+        }
+
+        static bool running_in_this_thread(void const* storage)
+        {
+            return running_in(get(storage), typename has_dispatch<Executor>::type());
+        }
+
+        static executor_metrics metrics(void const* storage)
+        {
+            return metrics_of(get(storage), typename has_metrics<Executor>::type());
+        }
+
+        static void copy(void* dst, void const* src)
+        {
+            new (dst) Executor(*static_cast<Executor const*>(src));
+        }
+
+        static void move(void* dst, void* src)
+        {
+            new (dst) Executor(std::move(get(src)));
+            get(src).~Executor();
+        }
+
+        static void destroy(void* storage)
+        {
+            get(storage).~Executor();
+        }
+
+        static void construct(void* dst, void const* executor)
+        {
+            copy(dst, executor);
+        }
+
+        static executor_vtable const vtable;
     };
 
     template <typename Executor>
-    class ref_implementation_type : public ref_base_type
+    executor_vtable const inline_executor<Executor>::vtable = {
+        &add, &add_unbounded, &add_priority, &add_bulk, &add_n, &dispatch, &running_in_this_thread, &metrics, &copy, &move, &destroy, &construct
+    };
+
+    // Executor too big (or unsafe to move) for the buffer; the buffer holds an owning pointer
+    template <typename Executor>
+    struct boxed_executor
+    {
+        static Executor*& get(void* storage) { return *static_cast<Executor**>(storage); }
+
+        static Executor const& get(void const* storage) { return **static_cast<Executor* const*>(storage); }
+
+        static void add(void* storage, unique_task&& f)
+        {
+            get(storage)->add(std::move(f));
+        }
+
+        static void add_unbounded(void* storage, unique_task&& f)
+        {
+            unbounded_add(*get(storage), std::move(f), typename has_unbounded_add<Executor>::type());
+        }
+
+        static void add_priority(void* storage, task_priority priority, unique_task&& f)
+        {
+            priority_add(*get(storage), priority, std::move(f), typename has_priority_add<Executor>::type());
+        }
+
+        static void add_bulk(void* storage, unique_task* first, size_t count)
+        {
+            bulk_add(*get(storage), first, count, typename has_bulk_add<Executor>::type());
+        }
+
+        static void add_n(void* storage, size_t count, function<void(size_t)>&& f)
+        {
+            bulk_add_n(*get(storage), count, std::move(f), typename has_bulk_add<Executor>::type());
+        }
+
+        static void dispatch(void* storage, unique_task&& f)
+        {
+            dispatch_to(*get(storage), std::move(f), typename has_dispatch<Executor>::type());
+        }
+
+        static bool running_in_this_thread(void const* storage)
+        {
+            return running_in(get(storage), typename has_dispatch<Executor>::type());
+        }
+
+        static executor_metrics metrics(void const* storage)
+        {
+            return metrics_of(get(storage), typename has_metrics<Executor>::type());
+        }
+
+        static void copy(void* dst, void const* src)
+        {
+            new (dst) Executor*(new Executor(**static_cast<Executor* const*>(src)));
+        }
+
+        static void move(void* dst, void* src)
+        {
+            new (dst) Executor*(get(src));
+        }
+
+        static void destroy(void* storage)
+        {
+            delete get(storage);
+        }
+
+        static void construct(void* dst, void const* executor)
+        {
+            new (dst) Executor*(new Executor(*static_cast<Executor const*>(executor)));
+        }
+
+        static executor_vtable const vtable;
+    };
+
+    template <typename Executor>
+    executor_vtable const boxed_executor<Executor>::vtable = {
+        &add, &add_unbounded, &add_priority, &add_bulk, &add_n, &dispatch, &running_in_this_thread, &metrics, &copy, &move, &destroy, &construct
+    };
+
+    template <typename Executor>
+    struct owned_executor : conditional<fits_executor_storage<Executor>::value,
+        inline_executor<Executor>,
+        boxed_executor<Executor>>::type {};
+
+    template <typename Executor>
+    struct referenced_executor
+    {
+        static void add(void* executor, unique_task&& f)
+        {
+            static_cast<Executor*>(executor)->add(std::move(f));
+        }
+
+        static void add_unbounded(void* executor, unique_task&& f)
+        {
+            unbounded_add(*static_cast<Executor*>(executor), std::move(f), typename has_unbounded_add<Executor>::type());
+        }
+
+        static void add_priority(void* executor, task_priority priority, unique_task&& f)
+        {
+            priority_add(*static_cast<Executor*>(executor), priority, std::move(f), typename has_priority_add<Executor>::type());
+        }
+
+        static void add_bulk(void* executor, unique_task* first, size_t count)
+        {
+            bulk_add(*static_cast<Executor*>(executor), first, count, typename has_bulk_add<Executor>::type());
+        }
+
+        static void add_n(void* executor, size_t count, function<void(size_t)>&& f)
+        {
+            bulk_add_n(*static_cast<Executor*>(executor), count, std::move(f), typename has_bulk_add<Executor>::type());
+        }
+
+        static void dispatch(void* executor, unique_task&& f)
+        {
+            dispatch_to(*static_cast<Executor*>(executor), std::move(f), typename has_dispatch<Executor>::type());
+        }
+
+        static bool running_in_this_thread(void const* executor)
+        {
+            return running_in(*static_cast<Executor const*>(executor), typename has_dispatch<Executor>::type());
+        }
+
+        static executor_metrics metrics(void const* executor)
+        {
+            return metrics_of(*static_cast<Executor const*>(executor), typename has_metrics<Executor>::type());
+        }
+
+        static executor_ref_vtable const vtable;
+    };
+
+    template <typename Executor>
+    executor_ref_vtable const referenced_executor<Executor>::vtable = {
+        &add, &add_unbounded, &add_priority, &add_bulk, &add_n, &dispatch, &running_in_this_thread, &metrics, &owned_executor<Executor>::vtable
+    };
+
+    // Lets abstract_executor hold an executor by reference, e.g. std::ref(system_executor::get_system_executor())
+    template <typename Executor>
+    class executor_reference
     {
     public:
 
-        ref_implementation_type(Executor* executor)
-            : _executor(executor)
+        explicit executor_reference(Executor& executor)
+            : _executor(&executor)
         {
         }
 
-        virtual void add(std::function<void(void)> f) override
+        void add(unique_task f)
         {
             _executor->add(std::move(f));
         }
 
-        virtual std::unique_ptr<base_type> copy_target() const override
+        void add_unbounded(unique_task f)
+        {
+            unbounded_add(*_executor, std::move(f), typename has_unbounded_add<Executor>::type());
+        }
+
+        void add(task_priority priority, unique_task f)
+        {
+            priority_add(*_executor, priority, std::move(f), typename has_priority_add<Executor>::type());
+        }
+
+        template <typename Iterator>
+        void add_bulk(Iterator first, Iterator last)
+        {
+            vector<unique_task> tasks(first, last);
+            bulk_add(*_executor, tasks.data(), tasks.size(), typename has_bulk_add<Executor>::type());
+        }
+
+        void add_n(size_t count, function<void(size_t)> f)
+        {
+            bulk_add_n(*_executor, count, std::move(f), typename has_bulk_add<Executor>::type());
+        }
+
+        void dispatch(unique_task f)
         {
-            return std::make_unique<implementation_type<Executor>>(*_executor);
+            dispatch_to(*_executor, std::move(f), typename has_dispatch<Executor>::type());
+        }
+
+        bool running_in_this_thread() const
+        {
+            return running_in(*_executor, typename has_dispatch<Executor>::type());
+        }
+
+        executor_metrics metrics() const
+        {
+            return metrics_of(*_executor, typename has_metrics<Executor>::type());
         }
 
     private:
@@ -94,35 +767,126 @@ namespace detail
     };
 }
 
+/* Tells the pool running the calling thread that it is about to block on I/O, a lock or another
+   task. A pool that supports it may start a stand-in worker until the region ends, so the rest of
+   its queue keeps moving; on other threads this does nothing. Nested regions count once. */
+class blocking_region
+{
+public:
+
+    blocking_region()
+        : _handler(detail::blocking_handler::current())
+    {
+        if (_handler)
+        {
+            detail::blocking_handler::current() = nullptr;
+            _handler->enter_blocking();
+        }
+    }
+
+    ~blocking_region()
+    {
+        if (_handler)
+        {
+            _handler->leave_blocking();
+            detail::blocking_handler::current() = _handler;
+        }
+    }
+
+private:
+
+    blocking_region(blocking_region const&);
+    blocking_region& operator=(blocking_region const&);
+
+    detail::blocking_handler* _handler;
+};
+
 class abstract_executor_ref
 {
 public:
 
     template <typename Executor>
     abstract_executor_ref(Executor* const executor)
+        : _executor(executor),
+          _vtable(&detail::referenced_executor<Executor>::vtable)
     {
-        static_assert(sizeof(detail::ref_implementation_type<Executor>) == implementation_size, "uh oh");
         assert(executor);
-        new (implementation()) detail::ref_implementation_type<Executor>(executor);
     }
 
-    void add(std::function<void(void)> f)
+    void add(unique_task f)
     {
-        return implementation()->add(std::move(f));
+        _vtable->add(_executor, std::move(f));
     }
 
-private:
+    /* add() past any capacity bound, for the drain jobs of executors layered on this one: a drain
+       job that is refused or dropped would leave its strand busy for good. Also for tasks handed
+       on from the shared timer thread, which must not block. */
+    void add_unbounded(unique_task f)
+    {
+        _vtable->add_unbounded(_executor, std::move(f));
+    }
 
-    friend class abstract_executor;
+    void add(task_priority priority, unique_task f)
+    {
+        _vtable->add_priority(_executor, priority, std::move(f));
+    }
+
+    template <typename Iterator>
+    void add_bulk(Iterator first, Iterator last)
+    {
+        vector<unique_task> tasks(first, last);
+        _vtable->add_bulk(_executor, tasks.data(), tasks.size());
+    }
+
+    void add_n(size_t count, function<void(size_t)> f)
+    {
+        _vtable->add_n(_executor, count, std::move(f));
+    }
 
-    enum : size_t { implementation_size = sizeof(void*)* 2 };
+    // Runs f before returning when the calling thread already satisfies the executor, else add(f)
+    void dispatch(unique_task f)
+    {
+        _vtable->dispatch(_executor, std::move(f));
+    }
+
+    bool running_in_this_thread() const
+    {
+        return _vtable->running_in_this_thread(_executor);
+    }
+
+    // Runs f like add(f); the returned future carries its result or exception
+    template <typename Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& f)
+    {
+        return detail::add_with_result(*this, std::forward<Func>(f));
+    }
+
+    executor_metrics metrics() const
+    {
+        return _vtable->metrics(_executor);
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on this executor
+    template <typename Rep, typename Period>
+    timed_awaitable<abstract_executor_ref> after(const chrono::duration<Rep, Period>& rel_time)
+    {
+        return ::after(*this, rel_time);
+    }
+
+    template <typename Clock, typename Duration>
+    timed_awaitable<abstract_executor_ref> at(const chrono::time_point<Clock, Duration>& abs_time)
+    {
+        return ::at(*this, abs_time);
+    }
+#endif
 
-    using base_type = detail::ref_base_type;
+private:
 
-    base_type*       implementation()       { return reinterpret_cast<base_type*>(&_implementation); }
-    base_type const* implementation() const { return reinterpret_cast<base_type const*>(&_implementation); }
+    friend class abstract_executor;
 
-    std::aligned_storage_t<implementation_size> _implementation;
+    void*                              _executor;
+    detail::executor_ref_vtable const* _vtable;
 };
 
 class abstract_executor
@@ -131,44 +895,154 @@ public:
 
     template <typename Executor>
     abstract_executor(Executor executor)
-        : _implementation(std::make_unique<implementation_type<Executor>>(std::move(executor)))
+        : _vtable(&detail::owned_executor<Executor>::vtable)
     {
+        _vtable->construct(&_storage, &executor);
+    }
+
+    template <typename Executor>
+    abstract_executor(reference_wrapper<Executor> executor)
+        : _vtable(&detail::owned_executor<detail::executor_reference<Executor>>::vtable)
+    {
+        detail::executor_reference<Executor> reference(executor.get());
+        _vtable->construct(&_storage, &reference);
     }
 
     abstract_executor(abstract_executor_ref const executor_ref)
-        : _implementation(executor_ref.implementation()->copy_target())
+        : _vtable(executor_ref._vtable->owner)
     {
+        _vtable->construct(&_storage, executor_ref._executor);
     }
 
     abstract_executor(abstract_executor const& other)
-        : _implementation(other._implementation->copy())
+        : _vtable(other._vtable)
     {
+        if (_vtable)
+        {
+            _vtable->copy(&_storage, &other._storage);
+        }
     }
 
     abstract_executor(abstract_executor&& other)
-        : _implementation(std::move(other._implementation))
+        : _vtable(other._vtable)
     {
+        if (_vtable)
+        {
+            _vtable->move(&_storage, &other._storage);
+            other._vtable = nullptr;
+        }
     }
 
     abstract_executor& operator=(abstract_executor other)
     {
-        _implementation = std::move(other._implementation);
+        reset();
+        _vtable = other._vtable;
+        if (_vtable)
+        {
+            _vtable->move(&_storage, &other._storage);
+            other._vtable = nullptr;
+        }
         return *this;
     }
 
-    void add(std::function<void(void)> f)
+    ~abstract_executor()
     {
-        _implementation->add(std::move(f));
+        reset();
     }
 
-private:
+    void add(unique_task f)
+    {
+        assert(_vtable);
+        _vtable->add(&_storage, std::move(f));
+    }
 
-    using base_type = detail::base_type;
+    // See abstract_executor_ref::add_unbounded
+    void add_unbounded(unique_task f)
+    {
+        assert(_vtable);
+        _vtable->add_unbounded(&_storage, std::move(f));
+    }
 
-    template <typename Executor>
-    using implementation_type = detail::implementation_type<Executor>;
+    // Executors without priorities treat every class alike
+    void add(task_priority priority, unique_task f)
+    {
+        assert(_vtable);
+        _vtable->add_priority(&_storage, priority, std::move(f));
+    }
+
+    // Moves from the range when given move iterators, copies otherwise
+    template <typename Iterator>
+    void add_bulk(Iterator first, Iterator last)
+    {
+        assert(_vtable);
+        vector<unique_task> tasks(first, last);
+        _vtable->add_bulk(&_storage, tasks.data(), tasks.size());
+    }
+
+    // Runs f(0) .. f(count - 1)
+    void add_n(size_t count, function<void(size_t)> f)
+    {
+        assert(_vtable);
+        _vtable->add_n(&_storage, count, std::move(f));
+    }
+
+    // Runs f before returning when the calling thread already satisfies the executor, else add(f)
+    void dispatch(unique_task f)
+    {
+        assert(_vtable);
+        _vtable->dispatch(&_storage, std::move(f));
+    }
+
+    bool running_in_this_thread() const
+    {
+        assert(_vtable);
+        return _vtable->running_in_this_thread(&_storage);
+    }
+
+    // Runs f like add(f); the returned future carries its result or exception
+    template <typename Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& f)
+    {
+        return detail::add_with_result(*this, std::forward<Func>(f));
+    }
+
+    executor_metrics metrics() const
+    {
+        assert(_vtable);
+        return _vtable->metrics(&_storage);
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on this executor
+    template <typename Rep, typename Period>
+    timed_awaitable<abstract_executor> after(const chrono::duration<Rep, Period>& rel_time)
+    {
+        return ::after(*this, rel_time);
+    }
 
-    std::unique_ptr<base_type> _implementation;
+    template <typename Clock, typename Duration>
+    timed_awaitable<abstract_executor> at(const chrono::time_point<Clock, Duration>& abs_time)
+    {
+        return ::at(*this, abs_time);
+    }
+#endif
+
+private:
+
+    void reset()
+    {
+        if (_vtable)
+        {
+            _vtable->destroy(&_storage);
+            _vtable = nullptr;
+        }
+    }
+
+    detail::executor_vtable const* _vtable;
+    detail::executor_storage        _storage;
 };
 
-#endif
\ No newline at end of file
+// add_with_result above returns task_future, which builds on everything in this header
+#include "task_future.h"
+
+#endif
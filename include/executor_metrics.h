@@ -0,0 +1,193 @@
+#ifndef EXECUTOR_METRICS
+#define EXECUTOR_METRICS
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Set to 0 to drop the clock reads behind the queue-wait/run-time histograms and busy/idle time
+#ifndef EXTR_TASK_TIMING
+#define EXTR_TASK_TIMING 1
+#endif
+
+using namespace std;
+
+/* Log2 histogram of durations in nanoseconds: bucket i counts values in [2^i, 2^(i+1)),
+   bucket 0 also counts 0 and the last bucket everything above */
+struct latency_histogram {
+    enum : size_t { bucket_count = 40 };
+
+    uint64_t buckets[bucket_count];
+
+    latency_histogram() {
+        for (size_t i = 0; i < bucket_count; ++i) {
+            buckets[i] = 0;
+        }
+    }
+
+    static size_t bucket_of(uint64_t ns) {
+        if (ns == 0) {
+            return 0;
+        }
+#if defined(__GNUC__)
+        size_t bucket = 63 - static_cast<size_t>(__builtin_clzll(ns));
+#else
+        size_t bucket = 0;
+        while (ns >>= 1) {
+            ++bucket;
+        }
+#endif
+        return bucket < bucket_count ? bucket : bucket_count - 1;
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            total += buckets[i];
+        }
+        return total;
+    }
+
+    // Upper bound, in nanoseconds, of the bucket holding quantile q (0 <= q <= 1); 0 when empty
+    uint64_t quantile(double q) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return uint64_t(1) << (i + 1);
+            }
+        }
+        return uint64_t(1) << bucket_count;
+    }
+
+    latency_histogram& operator+=(latency_histogram const& other) {
+        for (size_t i = 0; i < bucket_count; ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        return *this;
+    }
+};
+
+struct worker_metrics {
+    worker_metrics() : completed(0), stolen(0), busy(0), idle(0) {}
+
+    uint64_t completed;
+    uint64_t stolen;            // Tasks this worker took from a sibling's deque
+    chrono::nanoseconds busy;   // Time spent running tasks
+    chrono::nanoseconds idle;   // Time spent waiting for work
+};
+
+/* Point-in-time view of an executor. Counters are kept per worker and only summed here, so the
+   fields are individually exact but not a consistent snapshot of one instant. */
+struct executor_metrics {
+    executor_metrics() : queued(0), running(0), completed(0), stolen(0), timers_pending(0), threads(0), rejected(0) {}
+
+    size_t queued;              // Submitted and due, not started yet
+    size_t running;
+    uint64_t completed;
+    uint64_t stolen;
+    size_t timers_pending;      // add_at/add_after tasks whose deadline has not passed
+    size_t threads;             // Worker threads alive now; 0 when the executor does not own its threads
+    uint64_t rejected;          // Closures refused or dropped because the queue was at its capacity
+    vector<worker_metrics> workers; // Empty when the executor does not own its threads
+    latency_histogram queue_wait;   // From submission (or deadline) to start
+    latency_histogram run_time;
+};
+
+namespace details {
+
+struct task_clock {
+    // Nanoseconds on steady_clock, or always 0 when task timing is compiled out
+    static uint64_t now() {
+#if EXTR_TASK_TIMING
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count());
+#else
+        return 0;
+#endif
+    }
+};
+
+/* Completion counters and histograms for the tasks run by one thread (Shared = false) or by
+   threads the executor does not own (Shared = true). A single writer bumps its counters with
+   plain relaxed stores; shared counters pay for an atomic add. A cache line of padding on either
+   side keeps neighbouring workers off each other's lines; alignas would need an over-aligned
+   operator new, which C++11 does not have. */
+template<bool Shared>
+struct basic_task_counters {
+    char pad_before[64];
+    atomic<uint64_t> completed;
+    atomic<uint64_t> stolen;
+    atomic<uint64_t> busy_ns;
+    atomic<uint64_t> idle_ns;
+    atomic<uint64_t> queue_wait[latency_histogram::bucket_count];
+    atomic<uint64_t> run_time[latency_histogram::bucket_count];
+    char pad_after[64];
+
+    basic_task_counters() : completed(0), stolen(0), busy_ns(0), idle_ns(0) {
+        for (size_t i = 0; i < latency_histogram::bucket_count; ++i) {
+            queue_wait[i].store(0, memory_order_relaxed);
+            run_time[i].store(0, memory_order_relaxed);
+        }
+    }
+
+    static void bump(atomic<uint64_t>& counter, uint64_t by) {
+        if (Shared) {
+            counter.fetch_add(by, memory_order_relaxed);
+        } else {
+            counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+        }
+    }
+
+    // 'enqueued', 'started' and 'finished' come from task_clock::now()
+    void task_done(uint64_t enqueued, uint64_t started, uint64_t finished) {
+        bump(completed, 1);
+#if EXTR_TASK_TIMING
+        bump(queue_wait[latency_histogram::bucket_of(started > enqueued ? started - enqueued : 0)], 1);
+        bump(run_time[latency_histogram::bucket_of(finished - started)], 1);
+        bump(busy_ns, finished - started);
+#else
+        (void)enqueued;
+        (void)started;
+        (void)finished;
+#endif
+    }
+
+    void task_stolen() {
+        bump(stolen, 1);
+    }
+
+    void idle_for(uint64_t ns) {
+        bump(idle_ns, ns);
+    }
+
+    // Adds these counters to 'into' and returns them as one worker's view
+    worker_metrics collect(executor_metrics& into) const {
+        worker_metrics w;
+        w.completed = completed.load(memory_order_relaxed);
+        w.stolen = stolen.load(memory_order_relaxed);
+        w.busy = chrono::nanoseconds(busy_ns.load(memory_order_relaxed));
+        w.idle = chrono::nanoseconds(idle_ns.load(memory_order_relaxed));
+        into.completed += w.completed;
+        into.stolen += w.stolen;
+        for (size_t i = 0; i < latency_histogram::bucket_count; ++i) {
+            into.queue_wait.buckets[i] += queue_wait[i].load(memory_order_relaxed);
+            into.run_time.buckets[i] += run_time[i].load(memory_order_relaxed);
+        }
+        return w;
+    }
+};
+
+typedef basic_task_counters<false> worker_counters;
+typedef basic_task_counters<true> shared_task_counters;
+
+}
+
+#endif
@@ -0,0 +1,4 @@
+#pragma once
+
+// Same pthread code on Linux and macOS
+#include <posix/platform_thread.h>
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <thread>
 #include <functional>
@@ -7,7 +8,10 @@
 #include <condition_variable>
 
 #include <executor.h>
+#include <task_node.h>
+#include <thread_pool_options.h>
 #include <thread_util.h>
+#include <timer_wheel.h>
 
 #include <dispatch/dispatch.h>
 
@@ -39,33 +43,7 @@ struct dispatch_group_traits
 };
 typedef unique_handle<dispatch_group_t, dispatch_group_traits> unique_dispatch_group;
 
-struct dispatch_source_traits
-{
-    static dispatch_source_t invalid() throw()
-    {
-        return dispatch_source_t{};
-    }
-
-    static void close(dispatch_source_t value) throw()
-    {
-        dispatch_release(value);
-    }
-};
-typedef unique_handle<dispatch_source_t, dispatch_source_traits> unique_dispatch_source;
-
-inline uint64_t absolute_to_relative_ns(const chrono::system_clock::time_point& abs_time) {
-    using namespace std::chrono;
-    return std::max(0LL, duration_cast<nanoseconds>(abs_time - system_clock::now()).count());
-}
-
-inline uint64_t relative_to_relative_ns(const chrono::system_clock::duration& rel_time) {
-    using namespace std::chrono;
-    typedef std::chrono::duration<uint64_t, std::ratio<1, NSEC_PER_SEC>> nanosec;
-
-    return duration_cast<nanosec>(rel_time).count();
-}
-
-/* For passing std::function as a void pointer */
+/* For passing a unique_task as a void pointer */
 template <class derived>
 class fnc_wrapper_interface {
     void run() {
@@ -74,53 +52,54 @@ class fnc_wrapper_interface {
 };
 
 template<class Pool>
-class fnc_wrapper : fnc_wrapper_interface<fnc_wrapper<Pool>> {
-    function<void()> m_ptr;
+class fnc_wrapper : fnc_wrapper_interface<fnc_wrapper<Pool>>, public details::slab_allocated {
+    unique_task m_ptr;
     Pool& m_pool;
+    uint64_t m_enqueued;
+    bool m_slot;                // Holds a slot of the pool's capacity_gate until it starts
+    details::task_trace m_trace;
 public:
     template<class Func>
-    fnc_wrapper(Func&& wrapped, Pool& pool) : m_ptr(std::forward<Func>(wrapped)), m_pool(pool) {}
-    void run() { m_ptr(); }
+    fnc_wrapper(Func&& wrapped, Pool& pool, bool slot, details::task_trace const& trace) : m_ptr(std::forward<Func>(wrapped)), m_pool(pool), m_enqueued(details::task_clock::now()), m_slot(slot), m_trace(trace) {}
+    void run() { m_pool.run(m_ptr, m_enqueued, m_slot, m_trace); }
     Pool& pool() { return m_pool; }
 };
 
-template<class Pool>
-class time_fnc_wrapper : fnc_wrapper_interface<time_fnc_wrapper<Pool>> {
-    function<void()> ptr;
-    Pool& thepool;
-public:
-    unique_dispatch_source dispatch_in_time;
-    ~time_fnc_wrapper(){
-        dispatch_source_cancel(dispatch_in_time.get());
-        dispatch_group_leave(thepool.dispatch_group.get());
-        dispatch_release(thepool.dispatch_group.get());
-    }
-    template<class Func>
-    time_fnc_wrapper(uint64_t duration_ns, Func&& wrapped, Pool& pool) : 
-        ptr(std::forward<Func>(wrapped)), 
-        thepool(pool),
-        dispatch_in_time(dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, thepool.dispatch_queue.get())) {
-        dispatch_retain(thepool.dispatch_group.get());
-        dispatch_group_enter(thepool.dispatch_group.get());
-        dispatch_source_set_timer(dispatch_in_time.get(), dispatch_walltime(nullptr, duration_ns), 0, 0);
-    }
-    void run() { ptr(); }
-    Pool& pool() { return thepool; }
-};
-
 class thread_pool {
 private:
 
-    struct pool_group {
+    struct pool_group : details::timer_target {
+        enum : int { phase_open, phase_draining, phase_discarding };
+
         unique_dispatch_queue dispatch_queue;
         unique_dispatch_group dispatch_group;
+        bool serial;
+        // GCD owns the threads, so every task reports into one set of shared counters
+        details::shared_task_counters counters;
+        atomic<size_t> queued;
+        atomic<size_t> running;
+        atomic<size_t> timers_pending;
+        atomic<int> phase;
+        atomic<size_t> submitting;      // submit and submit_at calls past their phase check
+        atomic<size_t> discarded;
+        discard_handler on_discard;     // Written before phase leaves phase_open
+        mutex shutdown_lock;
+        details::capacity_gate gate;
         ~pool_group() 
         {
             dispatch_group_wait(dispatch_group.get(), DISPATCH_TIME_FOREVER);
+            tracing::forget(this);
         }
         explicit pool_group(int N, dispatch_queue_t q) : 
             dispatch_queue(q),
-            dispatch_group(dispatch_group_create())
+            dispatch_group(dispatch_group_create()),
+            serial(N == 1),
+            queued(0),
+            running(0),
+            timers_pending(0),
+            phase(phase_open),
+            submitting(0),
+            discarded(0)
         {
             if(N == 1) {
                 dispatch_retain(dispatch_queue.get());
@@ -132,38 +111,210 @@ private:
             wrapper->run();
             delete wrapper;
         }
-        static void time_callback(void* context) {
-            auto wrapper = reinterpret_cast<time_fnc_wrapper<pool_group> *>(context);
-            wrapper->run();
-            delete wrapper;
+        void run(unique_task& fnc, uint64_t enqueued, bool slot, details::task_trace const& trace) {
+            queued--;
+            if (slot) {
+                gate.release();
+            }
+            // GCD queues cannot be emptied from outside, so a shutdown discards tasks as they come up
+            if (phase.load(memory_order_acquire) == phase_discarding) {
+                discard(fnc);
+                return;
+            }
+            running++;
+            uint64_t started = details::task_clock::now();
+            {
+                // GCD threads serve every queue, so the pool is only known per task
+                detail::executor_frame frame(this);
+                trace.started(this);
+                fnc();
+                trace.finished(this);
+            }
+            counters.task_done(enqueued, started, details::task_clock::now());
+            running--;
+        }
+
+        // A serial pool keeps its own queue's order; otherwise each priority has its global queue
+        dispatch_queue_t queue_for(task_priority priority) {
+            static const long priorities[task_priority_levels] = {
+                DISPATCH_QUEUE_PRIORITY_HIGH, DISPATCH_QUEUE_PRIORITY_DEFAULT, DISPATCH_QUEUE_PRIORITY_LOW, DISPATCH_QUEUE_PRIORITY_BACKGROUND
+            };
+            if (serial || priority == task_priority::normal) {
+                return dispatch_queue.get();
+            }
+            return dispatch_get_global_queue(priorities[static_cast<size_t>(priority)], 0);
         }
 
         template<class Func>
         void submit(Func&& closure) {
-            fnc_wrapper<pool_group> * wrapper = new fnc_wrapper<pool_group>(std::forward<Func>(closure), *this);
-            dispatch_group_async_f(dispatch_group.get(), dispatch_queue.get(), wrapper, callback);
+            submit(task_priority::normal, std::forward<Func>(closure));
         }
+
         template<class Func>
-        void submit_at(const chrono::system_clock::time_point& abs_time, Func&& closure) {
-            auto duration_ns = absolute_to_relative_ns(abs_time);
-            time_fnc_wrapper<pool_group> * wrapper = new time_fnc_wrapper<pool_group>(
-                duration_ns, 
-                std::forward<Func>(closure), 
-                *this);
-            dispatch_set_context(wrapper->dispatch_in_time.get(), wrapper);
-            dispatch_source_set_event_handler_f(wrapper->dispatch_in_time.get(), time_callback);
-            dispatch_resume(wrapper->dispatch_in_time.get());
+        void submit(task_priority priority, Func&& closure) {
+            bool slot;
+            if (gate.try_acquire(slot)) {
+                submit_admitted(priority, slot, std::forward<Func>(closure));
+            } else if (gate.policy() == overflow_policy::run_in_caller) {
+                typename decay<Func>::type f(std::forward<Func>(closure));
+                f();
+            } else {
+                // GCD queues cannot be taken from, so drop_oldest rejects the new closure too
+                gate.rejected();
+            }
         }
+
         template<class Func>
-        void submit_after(const chrono::system_clock::duration& rel_time, Func&& closure) {
-            auto duration_ns = relative_to_relative_ns(rel_time);
-            time_fnc_wrapper<pool_group> * wrapper = new time_fnc_wrapper<pool_group>(
-                duration_ns, 
-                std::forward<Func>(closure), 
-                *this);
-            dispatch_set_context(wrapper->dispatch_in_time.get(), wrapper);
-            dispatch_source_set_event_handler_f(wrapper->dispatch_in_time.get(), time_callback);
-            dispatch_resume(wrapper->dispatch_in_time.get());
+        bool try_submit(task_priority priority, Func&& closure) {
+            bool slot;
+            if (!gate.try_acquire(slot)) {
+                return false;
+            }
+            submit_admitted(priority, slot, std::forward<Func>(closure));
+            return true;
+        }
+
+        template<class Func>
+        bool submit_until(const chrono::steady_clock::time_point& deadline, task_priority priority, Func&& closure) {
+            bool slot;
+            if (!gate.try_acquire(slot)) {
+                // Waiting on one of our own threads lets the pool bring in a stand-in that drains the queue
+                blocking_region hint;
+                if (!gate.acquire_until(deadline, slot)) {
+                    return false;
+                }
+            }
+            submit_admitted(priority, slot, std::forward<Func>(closure));
+            return true;
+        }
+
+        // A timed task comes with the trace id it got from submit_at
+        template<class Func>
+        void submit_admitted(task_priority priority, bool slot, Func&& closure, details::task_trace trace = details::task_trace()) {
+            // Counted before the phase check, so a shutdown that missed this task waits for it
+            submitting.fetch_add(1, memory_order_seq_cst);
+            if (!accepting()) {
+                submitting.fetch_sub(1, memory_order_relaxed);
+                if (slot) {
+                    gate.release();
+                }
+                unique_task rejected(std::forward<Func>(closure));
+                discard(rejected);
+                return;
+            }
+            queued++;
+            trace.submitted(this);
+            fnc_wrapper<pool_group> * wrapper = new fnc_wrapper<pool_group>(std::forward<Func>(closure), *this, slot, trace);
+            dispatch_group_async_f(dispatch_group.get(), queue_for(priority), wrapper, callback);
+            submitting.fetch_sub(1, memory_order_seq_cst);
+        }
+        template<class Func>
+        timer_handle submit_at(const chrono::steady_clock::time_point& abs_time, Func&& closure) {
+            // Timers are cancelled as soon as a shutdown starts, so none are taken after that
+            submitting.fetch_add(1, memory_order_seq_cst);
+            if (phase.load(memory_order_seq_cst) != phase_open) {
+                submitting.fetch_sub(1, memory_order_relaxed);
+                unique_task rejected(std::forward<Func>(closure));
+                discard(rejected);
+                return timer_handle();
+            }
+            // Entered until the timer fires or is cancelled, so ~pool_group keeps waiting for pending timers
+            dispatch_group_enter(dispatch_group.get());
+            timers_pending++;
+            details::task_node* t = new details::task_node(std::forward<Func>(closure));
+            t->trace.submitted(this);
+            timer_handle handle(details::timer_service::instance().schedule(this, abs_time, t));
+            submitting.fetch_sub(1, memory_order_seq_cst);
+            return handle;
+        }
+
+        virtual void timer_cancelled(details::task_node* task) override {
+            delete task;
+            timers_pending--;
+            dispatch_group_leave(dispatch_group.get());
+        }
+
+        // While draining, the pool's own tasks may still add work, e.g. continuations of what is queued
+        bool accepting() const {
+            int current = phase.load(memory_order_seq_cst);
+            return current == phase_open || (current == phase_draining && running_in_this_thread());
+        }
+
+        void discard(unique_task& fnc) {
+            if (on_discard) {
+                on_discard(fnc);
+            }
+            discarded++;
+        }
+
+        // Timed tasks that never reach a queue; each still holds its entry in the group
+        void discard_timers(details::task_node* first) {
+            while (first) {
+                details::task_node* next = first->next;
+                discard(first->fnc);
+                delete first;
+                dispatch_group_leave(dispatch_group.get());
+                first = next;
+            }
+        }
+
+        shutdown_result shutdown(const chrono::steady_clock::time_point& deadline, discard_handler const& handler) {
+            shutdown_result result;
+            lock_guard<mutex> once(shutdown_lock);
+            if (phase.load(memory_order_relaxed) != phase_open) {
+                return result;
+            }
+            on_discard = handler;
+            phase.store(phase_draining, memory_order_seq_cst);
+            while (submitting.load(memory_order_seq_cst) != 0) {
+                this_thread::yield();
+            }
+            size_t count = 0;
+            details::task_node* cancelled = details::timer_service::instance().cancel_all(this, count);
+            timers_pending -= count;
+            discard_timers(cancelled);
+
+            dispatch_time_t until = DISPATCH_TIME_FOREVER;
+            if (deadline != chrono::steady_clock::time_point::max()) {
+                auto left = chrono::duration_cast<chrono::nanoseconds>(deadline - chrono::steady_clock::now()).count();
+                until = dispatch_time(DISPATCH_TIME_NOW, left > 0 ? left : 0);
+            }
+            result.drained = dispatch_group_wait(dispatch_group.get(), until) == 0;
+            phase.store(phase_discarding, memory_order_seq_cst);
+            dispatch_group_wait(dispatch_group.get(), DISPATCH_TIME_FOREVER);
+            result.discarded = discarded.load(memory_order_relaxed);
+            return result;
+        }
+
+        virtual void submit_timers(details::task_node* first, size_t count) override {
+            timers_pending -= count;
+            if (phase.load(memory_order_acquire) != phase_open) {
+                discard_timers(first);
+                return;
+            }
+            while (first) {
+                details::task_node* next = first->next;
+                first->trace.fired(this);
+                // Timed tasks take no place in a bounded queue
+                submit_admitted(task_priority::normal, false, std::move(first->fnc), first->trace);
+                delete first;
+                dispatch_group_leave(dispatch_group.get());
+                first = next;
+            }
+        }
+
+        bool running_in_this_thread() const {
+            return detail::executor_frame::running_in(this);
+        }
+
+        executor_metrics metrics() {
+            executor_metrics m;
+            m.queued = queued.load(memory_order_relaxed);
+            m.running = running.load(memory_order_relaxed);
+            m.timers_pending = timers_pending.load(memory_order_relaxed);
+            m.rejected = gate.rejected_count();
+            counters.collect(m);
+            return m;
         }
     };
     shared_ptr<pool_group> pool;
@@ -177,6 +328,10 @@ public:
         pool(std::make_shared<pool_group>(N, N == 1 ? dispatch_queue_create("serial executor pool", DISPATCH_QUEUE_SERIAL) :
             dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0))) {
     }
+    // GCD places its own threads; only the thread count and the capacity are honoured
+    explicit thread_pool(thread_pool_options const& options) : thread_pool(options.threads) {
+        pool->gate.set(options.capacity, options.overflow);
+    }
 
     template<class Func>
     void add(Func&& closure) {
@@ -184,16 +339,141 @@ public:
     }
 
     template<class Func>
-    void add_at(const chrono::system_clock::time_point& abs_time, Func&& closure) {
-        pool->submit_at(abs_time, std::forward<Func>(closure));
+    void add(task_priority priority, Func&& closure) {
+        pool->submit(priority, std::forward<Func>(closure));
+    }
+
+    // Queues closure however full the queue is; see abstract_executor_ref::add_unbounded
+    template<class Func>
+    void add_unbounded(Func&& closure) {
+        pool->submit_admitted(task_priority::normal, false, std::forward<Func>(closure));
+    }
+
+    // Queues closure unless the queue is at its capacity; closure is left alone when this returns false
+    template<class Func>
+    bool try_add(Func&& closure) {
+        return pool->try_submit(task_priority::normal, std::forward<Func>(closure));
+    }
+
+    // Like try_add, but waits up to rel_time for a queued task to start
+    template<class Rep, class Period, class Func>
+    bool add_for(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool->submit_until(chrono::steady_clock::now() + details::to_steady_duration(rel_time),
+            task_priority::normal, std::forward<Func>(closure));
+    }
+
+    /* Bounds the tasks add() and its variants may queue; 0 removes the bound. A task holds its
+       place until it starts; timed tasks and add_unbounded are not counted. drop_oldest acts like
+       reject, since GCD queues cannot be taken from. */
+    void set_capacity(size_t capacity, overflow_policy policy = overflow_policy::reject) {
+        pool->gate.set(capacity, policy);
+    }
+
+    size_t capacity() const {
+        return pool->gate.capacity();
+    }
+
+    // Runs closure like add(); the returned future carries its result or exception
+    template<class Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& closure) {
+        return detail::add_with_result(*this, std::forward<Func>(closure));
+    }
+
+    // Runs closure before returning when called from one of this pool's tasks, otherwise add(closure)
+    template<class Func>
+    void dispatch(Func&& closure) {
+        detail::dispatch_or_add(*this, std::forward<Func>(closure));
+    }
+
+    bool running_in_this_thread() const {
+        return pool->running_in_this_thread();
     }
 
+    // GCD queues cannot be run from outside, so a waiting task always blocks; GCD adds threads instead
+    bool try_run_one() {
+        return false;
+    }
+
+    // GCD has no batched async; each task is still a single dispatch_group_async_f
+    template<class Iterator>
+    void add_bulk(Iterator first, Iterator last) {
+        for (; first != last; ++first) {
+            pool->submit(*first);
+        }
+    }
+
+    // Calls closure(i) for every i in [0, count) from at most one runner per core
     template<class Func>
-    void add_after(const chrono::system_clock::duration& rel_time, Func&& closure) {
-        pool->submit_after(rel_time, std::forward<Func>(closure));
+    void add_n(size_t count, Func&& closure) {
+        detail::add_apply(*this, count, std::max(1u, thread::hardware_concurrency()), std::forward<Func>(closure));
+    }
+
+    /* Any clock; steady_clock deadlines are kept as is with nanosecond resolution. The handle can
+       cancel the task or move its deadline until it falls due. */
+    template<class Clock, class Duration, class Func>
+    timer_handle add_at(const chrono::time_point<Clock, Duration>& abs_time, Func&& closure) {
+        return pool->submit_at(details::to_steady_time(abs_time), std::forward<Func>(closure));
+    }
+
+    template<class Rep, class Period, class Func>
+    timer_handle add_after(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool->submit_at(chrono::steady_clock::now() + details::to_steady_duration(rel_time), std::forward<Func>(closure));
     }
 
     virtual size_t uninitiated_task_count() const {
-        return 0;
+        return pool->queued.load(memory_order_relaxed) + pool->timers_pending.load(memory_order_relaxed);
+    }
+
+    size_t node_count() const {
+        return 1;
+    }
+
+    /* GCD sizes its threads for the whole process and already adds threads while others block in
+       the kernel, so this has nothing to set; blocking_region is a no-op on GCD threads too */
+    void set_concurrency(int) {
+    }
+
+    size_t concurrency() const {
+        return pool->serial ? 1 : std::max(1u, thread::hardware_concurrency());
+    }
+
+    /* Stops taking tasks from other threads, gives the queued ones up to 'drain_for' to run and
+       then discards the rest as GCD hands them out; timed tasks are discarded at once. Returns
+       once nothing of this pool is queued or running. See the Linux thread_pool for details. */
+    template<class Rep, class Period>
+    shutdown_result shutdown(const chrono::duration<Rep, Period>& drain_for, discard_handler const& on_discard = discard_handler()) {
+        return pool->shutdown(chrono::steady_clock::now() + details::to_steady_duration(drain_for), on_discard);
+    }
+
+    // Runs everything queued, however long it takes; only timed tasks are discarded
+    shutdown_result shutdown() {
+        return pool->shutdown(chrono::steady_clock::time_point::max(), discard_handler());
+    }
+
+    // Discards everything that has not started
+    shutdown_result shutdown_now(discard_handler const& on_discard = discard_handler()) {
+        return pool->shutdown(chrono::steady_clock::now(), on_discard);
+    }
+
+    executor_metrics metrics() const {
+        return pool->metrics();
+    }
+
+    // Names the pool in tracing::write_chrome_json; shared by every copy
+    void set_trace_name(string const& name) {
+        tracing::name(pool.get(), name);
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on this executor
+    template<class Rep, class Period>
+    timed_awaitable<thread_pool> after(const chrono::duration<Rep, Period>& rel_time) {
+        return ::after(*this, rel_time);
+    }
+
+    template<class Clock, class Duration>
+    timed_awaitable<thread_pool> at(const chrono::time_point<Clock, Duration>& abs_time) {
+        return ::at(*this, abs_time);
     }
+#endif
 };
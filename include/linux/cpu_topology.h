@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+
+using namespace std;
+
+namespace details {
+
+/* CPUs grouped by NUMA node as listed in /sys/devices/system/node, limited to the CPUs this
+   process may run on. Without that directory everything is one node. */
+struct cpu_topology {
+    vector<vector<int>> nodes;
+
+    // Discovered once per process
+    static cpu_topology const& system() {
+        static cpu_topology const topology = discover();
+        return topology;
+    }
+
+    // "0-3,8,10-11" as used by cpulist files
+    static vector<int> parse_cpu_list(string const& list) {
+        vector<int> cpus;
+        size_t pos = 0;
+        while (pos < list.size()) {
+            char* end = nullptr;
+            long first = strtol(list.c_str() + pos, &end, 10);
+            size_t next = static_cast<size_t>(end - list.c_str());
+            if (next == pos) {
+                break;
+            }
+            long last = first;
+            if (next < list.size() && list[next] == '-') {
+                pos = next + 1;
+                last = strtol(list.c_str() + pos, &end, 10);
+                next = static_cast<size_t>(end - list.c_str());
+            }
+            for (long cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+            pos = next;
+            while (pos < list.size() && (list[pos] == ',' || list[pos] == '\n' || list[pos] == ' ')) {
+                ++pos;
+            }
+        }
+        return cpus;
+    }
+
+    static vector<int> allowed_cpus() {
+        vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        if (cpus.empty()) {
+            for (int cpu = 0; cpu < static_cast<int>(std::max(1u, thread::hardware_concurrency())); ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // Restricts the calling thread to 'cpus'; placement is a hint, so failures are ignored
+    static void pin_current_thread(vector<int> const& cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    static int current_cpu() {
+        return sched_getcpu();
+    }
+
+private:
+    static string read_file(string const& path) {
+        string contents;
+        if (FILE* f = fopen(path.c_str(), "r")) {
+            char buffer[256];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+                contents.append(buffer, n);
+            }
+            fclose(f);
+        }
+        return contents;
+    }
+
+    static cpu_topology discover() {
+        cpu_topology topology;
+        vector<int> allowed = allowed_cpus();
+        vector<int> online = parse_cpu_list(read_file("/sys/devices/system/node/online"));
+        for (int node : online) {
+            vector<int> cpus = parse_cpu_list(read_file("/sys/devices/system/node/node" + to_string(node) + "/cpulist"));
+            vector<int> usable;
+            for (int cpu : cpus) {
+                if (find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                    usable.push_back(cpu);
+                }
+            }
+            // Memory-only nodes and nodes outside our affinity get no workers
+            if (!usable.empty()) {
+                topology.nodes.push_back(usable);
+            }
+        }
+        if (topology.nodes.empty()) {
+            topology.nodes.push_back(allowed);
+        }
+        return topology;
+    }
+};
+
+}
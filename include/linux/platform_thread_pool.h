@@ -0,0 +1,1361 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <executor.h>
+#include <task_node.h>
+#include <thread_pool_options.h>
+#include <timer_wheel.h>
+
+#include "cpu_topology.h"
+#include "work_stealing_deque.h"
+
+using namespace std;
+
+namespace details {
+
+/* Work-stealing pool: every worker owns a Chase-Lev deque that receives the tasks submitted
+   from that worker, tasks submitted from other threads go to a shared FIFO injection queue,
+   and workers that run dry steal from their siblings before going to sleep.
+   Deques and injection queues come in one copy per task_priority. Workers take the most urgent
+   task they can find, except that a level passed over too often gets the next turn (aging).
+   With thread_pool_options::numa the workers are split into one group per NUMA node, each
+   with its own injection queue; a worker looks at its own node before touching another.
+   Timed tasks wait in the shared timer_service and come back through submit_timers.
+   The worker count is elastic: slots for up to max_threads workers exist from the start, but a
+   slot only gets a thread when the pool is short of its target (set_concurrency), counting a
+   stand-in for every worker inside a blocking_region. Idle workers above min_threads exit after
+   keep_alive, and surplus ones before they take another task. A worker coming back from a
+   blocking_region waits until fewer than the target run tasks, so the pool never runs more
+   tasks at once than its concurrency; thread_pool(1) stays serial.
+   shutdown() goes through three phases: open, draining (only the pool's own tasks may add more),
+   discarding (workers destroy what they find instead of running it). */
+class pool_group : public timer_target, public detail::blocking_handler {
+    struct task_list {
+        task_list() : head(nullptr), tail(nullptr) {}
+
+        task_node* head;
+        task_node* tail;
+    };
+
+    // Injection queues and sleeping workers of one group, both guarded by lock
+    struct node_queue {
+        node_queue() : injected(0), idle(0) {
+            for (size_t level = 0; level < task_priority_levels; ++level) {
+                pending[level].store(0, memory_order_relaxed);
+            }
+        }
+
+        mutex lock;
+        condition_variable wake;
+        task_list lists[task_priority_levels];
+        atomic<size_t> pending[task_priority_levels];
+        atomic<size_t> injected;    // All levels
+        atomic<int> idle;
+    };
+
+    struct worker {
+        worker(pool_group& owner, size_t idx, size_t group, int processor) :
+            pool(owner), index(idx), node(group), cpu(processor), live(false), tick(0) {
+            for (size_t level = 0; level < task_priority_levels; ++level) {
+                age[level] = 0;
+            }
+        }
+
+        pool_group& pool;
+        size_t index;
+        size_t node;
+        int cpu;                    // -1 when not pinned to a CPU
+        bool live;                  // Has a thread; guarded by m_spawn_lock
+        unsigned tick;
+        unsigned age[task_priority_levels]; // Tasks taken from more urgent levels since this one was served
+        work_stealing_deque<task_node*> deques[task_priority_levels];
+        thread thr;                 // Kept after the worker retires, joined before the slot is reused
+        worker_counters counters;
+    };
+
+    enum : unsigned { fairness_interval = 61, spin_count = 64, injection_batch = 32, aging_base = 16 };
+
+    enum : int { phase_open, phase_draining, phase_discarding };
+
+    unique_ptr<unique_ptr<worker>[]> m_workers; // m_max slots, filled in order on first use
+    atomic<size_t> m_created;       // Slots holding a worker; they stay until the pool dies
+    vector<size_t> m_slot_node;
+    vector<int> m_slot_cpu;
+    vector<unique_ptr<node_queue>> m_nodes;
+    vector<size_t> m_cpu_node;      // CPU number to node queue, for routing submissions by caller
+    vector<vector<int>> m_node_cpus;
+    atomic<size_t> m_next_node;
+    bool m_stopping;                // Written under every node lock
+
+    atomic<size_t> m_uninitiated;
+    atomic<size_t> m_unfinished;
+    atomic<size_t> m_timers_pending;
+    atomic<bool> m_draining;
+    mutex m_done_lock;
+    condition_variable m_done;
+
+    size_t m_min;
+    size_t m_max;
+    chrono::nanoseconds m_keep_alive;
+    atomic<size_t> m_target;        // Workers running tasks outside a blocking_region
+    atomic<size_t> m_live;          // Workers with a thread; written under m_spawn_lock
+    atomic<size_t> m_blocked;       // Workers inside a blocking_region
+    atomic<size_t> m_active;        // Workers running a task outside a blocking_region
+    atomic<size_t> m_returning;     // Workers waiting in leave_blocking for a turn
+    mutex m_turn_lock;
+    condition_variable m_turn;
+    mutex m_spawn_lock;
+    bool m_closed;                  // No more workers start; guarded by m_spawn_lock
+
+    atomic<int> m_phase;
+    atomic<size_t> m_scheduling;    // submit_at calls past their phase check
+    atomic<size_t> m_discarded;
+    discard_handler m_on_discard;   // Written before m_phase leaves phase_open
+    mutex m_shutdown_lock;
+
+    capacity_gate m_gate;
+
+    pool_group(pool_group const &);
+    pool_group & operator=(pool_group const &);
+
+    static worker*& current_worker() {
+        static thread_local worker* current = nullptr;
+        return current;
+    }
+
+    // Local deques pop LIFO, so a single worker keeps FIFO order by always using the injection queue
+    bool local_submission_allowed(worker* self) const {
+        return self && &self->pool == this && m_target.load(memory_order_relaxed) > 1;
+    }
+
+    // Node of the calling thread's CPU; 0 unless the pool is split by node
+    size_t caller_node() {
+        if (m_nodes.size() == 1) {
+            return 0;
+        }
+        int cpu = cpu_topology::current_cpu();
+        if (cpu >= 0 && static_cast<size_t>(cpu) < m_cpu_node.size()) {
+            return m_cpu_node[cpu];
+        }
+        return m_next_node.fetch_add(1, memory_order_relaxed) % m_nodes.size();
+    }
+
+    static task_node* pop_injected_locked(node_queue& q, size_t level) {
+        task_list& list = q.lists[level];
+        task_node* t = list.head;
+        if (t) {
+            list.head = t->next;
+            if (!list.head) {
+                list.tail = nullptr;
+            }
+            t->next = nullptr;
+            q.pending[level].fetch_sub(1, memory_order_relaxed);
+            q.injected.fetch_sub(1, memory_order_relaxed);
+        }
+        return t;
+    }
+
+    static task_node* pop_any_injected_locked(node_queue& q) {
+        for (size_t level = 0; level < task_priority_levels; ++level) {
+            if (task_node* t = pop_injected_locked(q, level)) {
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Takes the head of a node's injection queue and, when other workers exist, moves a fair share
+       of what follows into the caller's deque so a large batch costs one lock per worker, not per task */
+    task_node* pop_injected(worker& self, node_queue& q, size_t level) {
+        if (q.pending[level].load(memory_order_acquire) == 0) {
+            return nullptr;
+        }
+        task_node* grabbed[injection_batch];
+        size_t count = 0;
+        task_node* t;
+        {
+            lock_guard<mutex> lk(q.lock);
+            t = pop_injected_locked(q, level);
+            size_t live = m_live.load(memory_order_relaxed);
+            if (t && live > 1) {
+                size_t share = std::min<size_t>(q.pending[level].load(memory_order_relaxed) / live, injection_batch);
+                while (count < share) {
+                    grabbed[count++] = pop_injected_locked(q, level);
+                }
+            }
+        }
+        // Reverse order keeps the batch FIFO for the owner; thieves take from the other end
+        while (count > 0) {
+            self.deques[level].push(grabbed[--count]);
+        }
+        return t;
+    }
+
+    /* Visits the siblings from self.index + 1 on, either those on the worker's own node or those
+       on other nodes. Retired workers left their deques empty, so they cost a load each. */
+    task_node* steal(worker& self, bool own_node, size_t level) {
+        size_t created = m_created.load(memory_order_acquire);
+        size_t i = self.index;
+        for (size_t k = 1; k < created; ++k) {
+            if (++i == created) {
+                i = 0;
+            }
+            worker& sibling = *m_workers[i];
+            if ((sibling.node == self.node) != own_node) {
+                continue;
+            }
+            work_stealing_deque<task_node*>& victim = sibling.deques[level];
+            if (victim.empty()) {
+                continue;
+            }
+            if (task_node* t = victim.steal()) {
+                self.counters.task_stolen();
+                t->trace.stolen(this);
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    task_node* steal_any(worker& self) {
+        for (size_t level = 0; level < task_priority_levels; ++level) {
+            if (task_node* t = steal(self, true, level)) {
+                return t;
+            }
+            if (m_nodes.size() > 1) {
+                if (task_node* t = steal(self, false, level)) {
+                    return t;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Own deque, own node's injection queue, then siblings on the same node
+    task_node* find_local_task(worker& self, size_t level) {
+        work_stealing_deque<task_node*>& own = self.deques[level];
+        if (!own.empty()) {
+            if (task_node* t = own.pop()) {
+                return t;
+            }
+        }
+        if (task_node* t = pop_injected(self, *m_nodes[self.node], level)) {
+            return t;
+        }
+        return steal(self, true, level);
+    }
+
+    // Other nodes' injection queues and deques, only once the worker's own node has nothing
+    task_node* find_remote_task(worker& self) {
+        if (m_nodes.size() == 1) {
+            return nullptr;
+        }
+        for (size_t level = 0; level < task_priority_levels; ++level) {
+            for (size_t i = 1; i < m_nodes.size(); ++i) {
+                if (task_node* t = pop_injected(self, *m_nodes[(self.node + i) % m_nodes.size()], level)) {
+                    return t;
+                }
+            }
+            if (task_node* t = steal(self, false, level)) {
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    bool remote_work_pending(worker& self) const {
+        for (size_t i = 1; i < m_nodes.size(); ++i) {
+            if (m_nodes[(self.node + i) % m_nodes.size()]->injected.load(memory_order_relaxed) != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Level that has been passed over long enough to go first: 16, 64 and 256 more urgent tasks
+    static size_t starving_level(worker const& self) {
+        for (size_t level = task_priority_levels - 1; level > 0; --level) {
+            if (self.age[level] >= (aging_base << (2 * (level - 1)))) {
+                return level;
+            }
+        }
+        return 0;
+    }
+
+    static void served(worker& self, size_t level) {
+        self.age[level] = 0;
+        for (size_t lower = level + 1; lower < task_priority_levels; ++lower) {
+            ++self.age[lower];
+        }
+    }
+
+    task_node* find_task(worker& self) {
+        // Periodically look at the injection queue first so a worker feeding itself cannot starve it
+        if (++self.tick % fairness_interval == 0) {
+            for (size_t level = 0; level < task_priority_levels; ++level) {
+                if (task_node* t = pop_injected(self, *m_nodes[self.node], level)) {
+                    served(self, level);
+                    return t;
+                }
+            }
+        }
+        size_t aged = starving_level(self);
+        if (aged != 0) {
+            if (task_node* t = find_local_task(self, aged)) {
+                served(self, aged);
+                return t;
+            }
+            self.age[aged] = 0;
+        }
+        for (size_t level = 0; level < task_priority_levels; ++level) {
+            if (task_node* t = find_local_task(self, level)) {
+                served(self, level);
+                return t;
+            }
+        }
+        return find_remote_task(self);
+    }
+
+    task_node* wait_for_task(worker& self) {
+        for (unsigned spin = 0; spin < spin_count; ++spin) {
+            this_thread::yield();
+            if (retire_surplus(self)) {
+                return nullptr;
+            }
+            if (task_node* t = find_task(self)) {
+                return t;
+            }
+        }
+
+        // Records this worker freed for other threads go back before it sleeps
+        slab_heap::flush();
+        node_queue& own = *m_nodes[self.node];
+        unique_lock<mutex> lk(own.lock);
+        // Announce before the final scan; pairs with the fence in notify_workers
+        own.idle.fetch_add(1, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+        for (;;) {
+            // The scans above left our deques empty, so retiring hands nothing back under own.lock
+            if (retire_surplus(self)) {
+                own.idle.fetch_sub(1, memory_order_relaxed);
+                // The wake-up may have been meant for a task; pass it on to another sleeper
+                if (own.injected.load(memory_order_relaxed) > 0) {
+                    own.wake.notify_one();
+                }
+                return nullptr;
+            }
+            task_node* t = pop_any_injected_locked(own);
+            if (!t) {
+                t = steal_any(self);
+            }
+            if (t || m_stopping) {
+                own.idle.fetch_sub(1, memory_order_relaxed);
+                return t;
+            }
+            if (remote_work_pending(self)) {
+                // Other nodes' queues are only locked while not holding our own
+                own.idle.fetch_sub(1, memory_order_relaxed);
+                lk.unlock();
+                if (task_node* remote = find_remote_task(self)) {
+                    return remote;
+                }
+                lk.lock();
+                own.idle.fetch_add(1, memory_order_seq_cst);
+                atomic_thread_fence(memory_order_seq_cst);
+                continue;
+            }
+            // Nothing to do anywhere: a surplus worker leaves now, one above the minimum after keep_alive
+            size_t wanted = wanted_workers();
+            if (m_live.load(memory_order_relaxed) > wanted && retire(self, wanted)) {
+                own.idle.fetch_sub(1, memory_order_relaxed);
+                return nullptr;
+            }
+            if (m_live.load(memory_order_relaxed) <= m_min) {
+                own.wake.wait(lk);
+            } else if (own.wake.wait_for(lk, m_keep_alive) == cv_status::timeout && retire(self, m_min)) {
+                own.idle.fetch_sub(1, memory_order_relaxed);
+                return nullptr;
+            }
+        }
+    }
+
+    // Wakes min(count, sleepers) workers of one node and returns how many that was
+    static size_t wake_locked(node_queue& q, size_t count) {
+        size_t idle = static_cast<size_t>(q.idle.load(memory_order_relaxed));
+        if (count >= idle) {
+            if (idle > 0) {
+                q.wake.notify_all();
+            }
+            return idle;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            q.wake.notify_one();
+        }
+        return count;
+    }
+
+    /* Wakes up to 'count' sleepers starting with node 'first' and returns how many of 'count'
+       found nobody; called without any node lock held */
+    size_t notify_workers(size_t first, size_t count) {
+        atomic_thread_fence(memory_order_seq_cst);
+        for (size_t i = 0; i < m_nodes.size() && count > 0; ++i) {
+            node_queue& q = *m_nodes[(first + i) % m_nodes.size()];
+            if (q.idle.load(memory_order_relaxed) > 0) {
+                lock_guard<mutex> lk(q.lock);
+                count -= wake_locked(q, count);
+            }
+        }
+        return count;
+    }
+
+    // The target plus a stand-in for every worker inside a blocking_region
+    size_t wanted_workers() const {
+        return m_target.load(memory_order_relaxed) + m_blocked.load(memory_order_relaxed);
+    }
+
+    size_t queued() const {
+        size_t uninitiated = m_uninitiated.load(memory_order_relaxed);
+        size_t timers = m_timers_pending.load(memory_order_relaxed);
+        return uninitiated > timers ? uninitiated - timers : 0;
+    }
+
+    // Gives a thread to the first free slot, creating its worker on first use
+    void start_worker_locked() {
+        size_t created = m_created.load(memory_order_relaxed);
+        size_t slot = 0;
+        while (slot < created && m_workers[slot]->live) {
+            ++slot;
+        }
+        if (slot == created) {
+            m_workers[slot].reset(new worker(*this, slot, m_slot_node[slot], m_slot_cpu[slot]));
+            // Thieves only look at published slots
+            m_created.store(created + 1, memory_order_release);
+        }
+        worker& w = *m_workers[slot];
+        if (w.thr.joinable()) {
+            // The previous thread of this slot has retired and is on its way out
+            w.thr.join();
+        }
+        w.thr = thread([this, &w] { worker_loop(w); });
+        w.live = true;
+        m_live.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Starts workers for up to 'count' tasks that found no sleeper, while short of wanted_workers()
+    void grow(size_t count) {
+        if (m_live.load(memory_order_relaxed) >= wanted_workers()) {
+            return;
+        }
+        lock_guard<mutex> lk(m_spawn_lock);
+        for (; count > 0 && !m_closed; --count) {
+            size_t live = m_live.load(memory_order_relaxed);
+            if (live >= m_max || live >= wanted_workers()) {
+                break;
+            }
+            try {
+                start_worker_locked();
+            } catch (system_error const&) {
+                // Out of threads: the task is queued and the running workers will get to it
+                break;
+            }
+        }
+    }
+
+    // Lets 'self' exit while more than 'keep' workers are alive; it has just found its deques empty
+    bool retire(worker& self, size_t keep) {
+        lock_guard<mutex> lk(m_spawn_lock);
+        if (m_closed || m_live.load(memory_order_relaxed) <= keep) {
+            return false;
+        }
+        self.live = false;
+        m_live.fetch_sub(1, memory_order_relaxed);
+        return true;
+    }
+
+    /* Lets a worker above wanted_workers() leave before its next task. What it had taken into
+       its deques goes back to the front of its node's injection queue, oldest first. */
+    bool retire_surplus(worker& self) {
+        size_t wanted = wanted_workers();
+        if (m_live.load(memory_order_relaxed) <= wanted || !retire(self, wanted)) {
+            return false;
+        }
+        for (size_t level = 0; level < task_priority_levels; ++level) {
+            hand_back(self, level);
+        }
+        return true;
+    }
+
+    void hand_back(worker& self, size_t level) {
+        work_stealing_deque<task_node*>& own = self.deques[level];
+        task_node* first = nullptr;
+        task_node* last = nullptr;
+        size_t count = 0;
+        while (!own.empty()) {
+            // The owner takes from the thieves' end too, to keep the oldest first
+            task_node* t = own.steal();
+            if (!t) {
+                continue;
+            }
+            if (last) {
+                last->next = t;
+            } else {
+                first = t;
+            }
+            last = t;
+            ++count;
+        }
+        if (count == 0) {
+            return;
+        }
+        node_queue& q = *m_nodes[self.node];
+        {
+            lock_guard<mutex> lk(q.lock);
+            task_list& list = q.lists[level];
+            last->next = list.head;
+            list.head = first;
+            if (!list.tail) {
+                list.tail = last;
+            }
+            q.pending[level].fetch_add(count, memory_order_release);
+            q.injected.fetch_add(count, memory_order_release);
+            count -= wake_locked(q, count);
+        }
+        if (count > 0) {
+            grow(count);
+        }
+    }
+
+    // A worker stops counting as running a task; one waiting in leave_blocking may take its turn
+    void give_up_turn() {
+        m_active.fetch_sub(1, memory_order_seq_cst);
+        if (m_returning.load(memory_order_seq_cst) > 0) {
+            lock_guard<mutex> lk(m_turn_lock);
+            m_turn.notify_all();
+        }
+    }
+
+    // Gives back the capacity slot of a task that has left the queue
+    void leave_queue(task_node* t) {
+        if (t->holds_slot) {
+            t->holds_slot = false;
+            m_gate.release();
+        }
+    }
+
+    void run(worker& self, task_node* t) {
+        leave_queue(t);
+        if (m_phase.load(memory_order_acquire) == phase_discarding) {
+            discard_started(t);
+            return;
+        }
+        m_uninitiated.fetch_sub(1, memory_order_relaxed);
+        uint64_t started = task_clock::now();
+        t->trace.started(this);
+        t->fnc();
+        t->trace.finished(this);
+        self.counters.task_done(t->enqueued, started, task_clock::now());
+        delete t;
+        finish_task();
+    }
+
+    void finish_task() {
+        if (m_unfinished.fetch_sub(1, memory_order_seq_cst) == 1 && m_draining.load(memory_order_seq_cst)) {
+            lock_guard<mutex> lk(m_done_lock);
+            m_done.notify_all();
+        }
+    }
+
+    // Destroys a counted task that will never run, after showing it to the shutdown's handler
+    void discard_started(task_node* t) {
+        leave_queue(t);
+        m_uninitiated.fetch_sub(1, memory_order_relaxed);
+        if (m_on_discard) {
+            m_on_discard(t->fnc);
+        }
+        delete t;
+        m_discarded.fetch_add(1, memory_order_relaxed);
+        finish_task();
+    }
+
+    void discard_chain(task_node* first) {
+        while (first) {
+            task_node* next = first->next;
+            discard_started(first);
+            first = next;
+        }
+    }
+
+    // While draining, the pool's own tasks may still add work, e.g. continuations of what is queued
+    bool accepting() const {
+        int phase = m_phase.load(memory_order_seq_cst);
+        return phase == phase_open || (phase == phase_draining && running_in_this_thread());
+    }
+
+    // Timers 'this' still has in the timer_service are discarded, those already due are rejected in submit_timers
+    void cancel_timers() {
+        size_t count = 0;
+        task_node* first = timer_service::instance().cancel_all(this, count);
+        m_timers_pending.fetch_sub(count, memory_order_relaxed);
+        discard_chain(first);
+    }
+
+    void wait_unfinished() {
+        unique_lock<mutex> lk(m_done_lock);
+        m_done.wait(lk, [this] { return m_unfinished.load(memory_order_seq_cst) == 0; });
+    }
+
+    void stop_workers() {
+        {
+            lock_guard<mutex> lk(m_spawn_lock);
+            m_closed = true;
+        }
+        for (auto& q : m_nodes) {
+            q->lock.lock();
+        }
+        m_stopping = true;
+        for (auto& q : m_nodes) {
+            q->wake.notify_all();
+            q->lock.unlock();
+        }
+        // Retired workers' threads are joined here too
+        for (size_t i = 0; i < m_created.load(memory_order_acquire); ++i) {
+            if (m_workers[i]->thr.joinable()) {
+                m_workers[i]->thr.join();
+            }
+        }
+    }
+
+    void worker_loop(worker& self) {
+        if (self.cpu >= 0) {
+            cpu_topology::pin_current_thread(vector<int>(1, self.cpu));
+        } else if (m_nodes.size() > 1) {
+            cpu_topology::pin_current_thread(m_node_cpus[self.node]);
+        }
+        current_worker() = &self;
+        detail::blocking_handler::current() = this;
+        for (;;) {
+            if (retire_surplus(self)) {
+                break;
+            }
+            task_node* t = find_task(self);
+            if (!t) {
+                uint64_t idle_since = task_clock::now();
+                t = wait_for_task(self);
+                self.counters.idle_for(task_clock::now() - idle_since);
+            }
+            if (!t) {
+                break;
+            }
+            m_active.fetch_add(1, memory_order_seq_cst);
+            run(self, t);
+            give_up_turn();
+        }
+        detail::blocking_handler::current() = nullptr;
+        current_worker() = nullptr;
+    }
+
+    // A worker keeps a batch in its own deque for its siblings to steal, anyone else injects it
+    void enqueue(task_node* first, task_node* last, size_t count, size_t level) {
+        worker* self = current_worker();
+        if (local_submission_allowed(self)) {
+            for (task_node* t = first; t; ) {
+                task_node* next = t->next;
+                t->next = nullptr;
+                self->deques[level].push(t);
+                t = next;
+            }
+            grow(notify_workers(self->node, count));
+            return;
+        }
+        inject(caller_node(), first, last, count, level);
+    }
+
+    void submit_chain(task_node* first, task_node* last, size_t count, size_t level) {
+        if (count == 0) {
+            return;
+        }
+        // Counted before the phase check, so a shutdown that missed this task waits for it
+        m_unfinished.fetch_add(count, memory_order_seq_cst);
+        m_uninitiated.fetch_add(count, memory_order_relaxed);
+        if (!accepting()) {
+            discard_chain(first);
+            return;
+        }
+        enqueue(first, last, count, level);
+    }
+
+    // Appends a chain of 'count' tasks to a node's injection queue and wakes up to 'count' sleepers
+    void inject(size_t node, task_node* first, task_node* last, size_t count, size_t level) {
+        node_queue& q = *m_nodes[node];
+        {
+            lock_guard<mutex> lk(q.lock);
+            task_list& list = q.lists[level];
+            if (list.tail) {
+                list.tail->next = first;
+            } else {
+                list.head = first;
+            }
+            list.tail = last;
+            q.pending[level].fetch_add(count, memory_order_release);
+            q.injected.fetch_add(count, memory_order_release);
+            count -= wake_locked(q, count);
+        }
+        if (count > 0 && m_nodes.size() > 1) {
+            // Not enough sleepers on this node; idle workers elsewhere may take the rest
+            count = notify_workers(node + 1, count);
+        }
+        if (count > 0) {
+            grow(count);
+        }
+    }
+
+    /* Spreads the workers over the allowed CPUs in node order, in proportion to each node's
+       CPU count, and builds one group per node that got workers (or a single group). Slots past
+       'threads' only hold stand-ins and workers added by set_concurrency; slot i takes the place
+       of slot i % threads. */
+    void place_workers(thread_pool_options const& options) {
+        cpu_topology const& topology = cpu_topology::system();
+        vector<int> cpus;
+        vector<size_t> cpu_node;
+        for (size_t n = 0; n < topology.nodes.size(); ++n) {
+            for (int cpu : topology.nodes[n]) {
+                if (options.cpus.empty() || find(options.cpus.begin(), options.cpus.end(), cpu) != options.cpus.end()) {
+                    cpus.push_back(cpu);
+                    cpu_node.push_back(n);
+                }
+            }
+        }
+
+        size_t count = options.threads > 0 ? static_cast<size_t>(options.threads) :
+            std::max<size_t>(2, options.cpus.empty() ? static_cast<size_t>(default_concurrency()) : cpus.size());
+        m_target.store(count, memory_order_relaxed);
+        m_min = options.min_threads > 0 ? std::min(static_cast<size_t>(options.min_threads), count) : count;
+        m_max = options.max_threads > 0 ? std::max(static_cast<size_t>(options.max_threads), count) : 4 * count;
+        m_keep_alive = options.keep_alive;
+
+        vector<size_t> worker_slot(count, 0);
+        vector<bool> used(topology.nodes.size(), false);
+        for (size_t i = 0; i < count && !cpus.empty(); ++i) {
+            worker_slot[i] = count <= cpus.size() ? i * cpus.size() / count : i % cpus.size();
+            used[cpu_node[worker_slot[i]]] = true;
+        }
+
+        // Topology node numbers map onto the groups of the nodes that actually got workers
+        vector<size_t> group_of(topology.nodes.size(), 0);
+        if (options.numa) {
+            for (size_t n = 0; n < used.size(); ++n) {
+                if (used[n]) {
+                    group_of[n] = m_node_cpus.size();
+                    m_node_cpus.push_back(topology.nodes[n]);
+                }
+            }
+        }
+        if (m_node_cpus.size() <= 1) {
+            m_node_cpus.assign(1, cpus);
+            group_of.assign(topology.nodes.size(), 0);
+        } else {
+            for (size_t i = 0; i < cpus.size(); ++i) {
+                if (static_cast<size_t>(cpus[i]) >= m_cpu_node.size()) {
+                    m_cpu_node.resize(cpus[i] + 1, 0);
+                }
+                m_cpu_node[cpus[i]] = group_of[cpu_node[i]];
+            }
+        }
+        for (size_t g = 0; g < m_node_cpus.size(); ++g) {
+            m_nodes.emplace_back(new node_queue());
+        }
+
+        m_workers.reset(new unique_ptr<worker>[m_max]);
+        for (size_t i = 0; i < m_max; ++i) {
+            size_t base = worker_slot[i % count];
+            m_slot_node.push_back(cpus.empty() ? 0 : group_of[cpu_node[base]]);
+            m_slot_cpu.push_back(options.pin && !cpus.empty() ? cpus[base] : -1);
+        }
+    }
+
+public:
+    static int default_concurrency() {
+        // Tasks are allowed to block on each other, so never default to a single worker
+        return std::max(2, static_cast<int>(thread::hardware_concurrency()));
+    }
+
+    explicit pool_group(thread_pool_options const& options) :
+        m_created(0),
+        m_next_node(0),
+        m_stopping(false),
+        m_uninitiated(0),
+        m_unfinished(0),
+        m_timers_pending(0),
+        m_draining(false),
+        m_target(0),
+        m_live(0),
+        m_blocked(0),
+        m_active(0),
+        m_returning(0),
+        m_closed(false),
+        m_phase(phase_open),
+        m_scheduling(0),
+        m_discarded(0),
+        m_gate(options.capacity, options.overflow)
+    {
+        place_workers(options);
+        lock_guard<mutex> lk(m_spawn_lock);
+        for (size_t i = m_target.load(memory_order_relaxed); i > 0; --i) {
+            start_worker_locked();
+        }
+    }
+
+    ~pool_group() {
+        m_draining.store(true, memory_order_seq_cst);
+        wait_unfinished();
+        stop_workers();
+        tracing::forget(this);
+    }
+
+    /* Stops taking tasks from outside, lets the queued ones run until 'deadline', discards what
+       is left and joins the workers; timed tasks are discarded right away. Tasks that are running
+       are always waited for. Only the first call does anything. */
+    shutdown_result shutdown(const chrono::steady_clock::time_point& deadline, discard_handler const& on_discard) {
+        assert(!running_in_this_thread());
+        shutdown_result result;
+        lock_guard<mutex> once(m_shutdown_lock);
+        if (m_phase.load(memory_order_relaxed) != phase_open) {
+            return result;
+        }
+        m_on_discard = on_discard;
+        m_draining.store(true, memory_order_seq_cst);
+        m_phase.store(phase_draining, memory_order_seq_cst);
+        // A submit_at that saw the pool open is about to reach the timer_service
+        while (m_scheduling.load(memory_order_seq_cst) != 0) {
+            this_thread::yield();
+        }
+        cancel_timers();
+        {
+            unique_lock<mutex> lk(m_done_lock);
+            auto drained = [this] { return m_unfinished.load(memory_order_seq_cst) == 0; };
+            if (deadline == chrono::steady_clock::time_point::max()) {
+                m_done.wait(lk, drained);
+            } else {
+                result.drained = m_done.wait_until(lk, deadline, drained);
+            }
+        }
+        // Whatever is still queued is found by a worker, which discards it
+        m_phase.store(phase_discarding, memory_order_seq_cst);
+        wait_unfinished();
+        stop_workers();
+        result.discarded = m_discarded.load(memory_order_relaxed);
+        return result;
+    }
+
+    template<class Func>
+    void submit_admitted(task_priority priority, bool slot, Func&& closure) {
+        task_node* t = new task_node(std::forward<Func>(closure));
+        t->holds_slot = slot;
+        t->trace.submitted(this);
+        submit_chain(t, t, 1, static_cast<size_t>(priority));
+    }
+
+    // Unlinks the oldest task of 'level' that holds a capacity slot; the others stay where they are
+    static task_node* pop_slot_holder_locked(node_queue& q, size_t level) {
+        task_list& list = q.lists[level];
+        task_node* prev = nullptr;
+        for (task_node* t = list.head; t; prev = t, t = t->next) {
+            if (!t->holds_slot) {
+                continue;
+            }
+            if (prev) {
+                prev->next = t->next;
+            } else {
+                list.head = t->next;
+            }
+            if (list.tail == t) {
+                list.tail = prev;
+            }
+            t->next = nullptr;
+            q.pending[level].fetch_sub(1, memory_order_relaxed);
+            q.injected.fetch_sub(1, memory_order_relaxed);
+            return t;
+        }
+        return nullptr;
+    }
+
+    /* Destroys the oldest queued task of the least urgent level to make room: first from the
+       caller's injection queue, then from the far end of the workers' deques. Only tasks that
+       hold a slot are taken; drain jobs of layered executors, add_n runners and timed tasks
+       never counted against the capacity, and a stolen one goes back to the injection queue.
+       False when no task holding a slot was in reach. */
+    bool drop_oldest() {
+        task_node* victim = nullptr;
+        size_t node = caller_node();
+        node_queue& q = *m_nodes[node];
+        {
+            lock_guard<mutex> lk(q.lock);
+            for (size_t level = task_priority_levels; level-- > 0 && !victim; ) {
+                victim = pop_slot_holder_locked(q, level);
+            }
+        }
+        size_t created = m_created.load(memory_order_acquire);
+        for (size_t level = task_priority_levels; level-- > 0 && !victim; ) {
+            for (size_t i = 0; i < created && !victim; ++i) {
+                victim = m_workers[i]->deques[level].steal();
+                if (victim && !victim->holds_slot) {
+                    inject(node, victim, victim, 1, level);
+                    victim = nullptr;
+                }
+            }
+        }
+        if (!victim) {
+            return false;
+        }
+        leave_queue(victim);
+        m_uninitiated.fetch_sub(1, memory_order_relaxed);
+        delete victim;
+        m_gate.rejected();
+        finish_task();
+        return true;
+    }
+
+    template<class Func>
+    void overflow(task_priority priority, Func&& closure) {
+        overflow_policy policy = m_gate.policy();
+        if (policy == overflow_policy::run_in_caller) {
+            typename decay<Func>::type f(std::forward<Func>(closure));
+            f();
+            return;
+        }
+        bool slot;
+        if (policy == overflow_policy::drop_oldest && drop_oldest() && m_gate.try_acquire(slot)) {
+            submit_admitted(priority, slot, std::forward<Func>(closure));
+            return;
+        }
+        m_gate.rejected();
+    }
+
+    template<class Func>
+    void submit(task_priority priority, Func&& closure) {
+        bool slot;
+        if (!m_gate.try_acquire(slot)) {
+            overflow(priority, std::forward<Func>(closure));
+            return;
+        }
+        submit_admitted(priority, slot, std::forward<Func>(closure));
+    }
+
+    // Leaves closure alone and returns false when the queue is full
+    template<class Func>
+    bool try_submit(task_priority priority, Func&& closure) {
+        bool slot;
+        if (!m_gate.try_acquire(slot)) {
+            return false;
+        }
+        submit_admitted(priority, slot, std::forward<Func>(closure));
+        return true;
+    }
+
+    template<class Func>
+    bool submit_until(const chrono::steady_clock::time_point& deadline, task_priority priority, Func&& closure) {
+        bool slot;
+        if (!m_gate.try_acquire(slot)) {
+            // Waiting on one of our own threads lets the pool bring in a stand-in that drains the queue
+            blocking_region hint;
+            if (!m_gate.acquire_until(deadline, slot)) {
+                return false;
+            }
+        }
+        submit_admitted(priority, slot, std::forward<Func>(closure));
+        return true;
+    }
+
+    void set_capacity(size_t capacity, overflow_policy policy) {
+        m_gate.set(capacity, policy);
+    }
+
+    size_t capacity() const {
+        return m_gate.capacity();
+    }
+
+    // One task per element of [first, last), queued with a single synchronization
+    template<class Iterator>
+    void submit_bulk(Iterator first, Iterator last) {
+        if (m_gate.capacity() != 0) {
+            // A bounded queue admits each task on its own
+            for (; first != last; ++first) {
+                submit(task_priority::normal, *first);
+            }
+            return;
+        }
+        task_node* head = nullptr;
+        task_node* tail = nullptr;
+        size_t count = 0;
+        for (; first != last; ++first, ++count) {
+            task_node* t = new task_node(*first);
+            t->trace.submitted(this);
+            if (tail) {
+                tail->next = t;
+            } else {
+                head = t;
+            }
+            tail = t;
+        }
+        submit_chain(head, tail, count, static_cast<size_t>(task_priority::normal));
+    }
+
+    // closure(0) .. closure(count - 1) through at most one runner task per worker
+    template<class Func>
+    void submit_n(size_t count, Func&& closure) {
+        typedef typename decay<Func>::type function_type;
+        if (count == 0) {
+            return;
+        }
+        size_t runners = std::min(count, m_target.load(memory_order_relaxed));
+        detail::apply_block<function_type>* block = new detail::apply_block<function_type>(count, runners, std::forward<Func>(closure));
+        task_node* head = new task_node(detail::apply_runner<function_type>(block));
+        head->trace.submitted(this);
+        task_node* tail = head;
+        for (size_t i = 1; i < runners; ++i) {
+            tail->next = new task_node(detail::apply_runner<function_type>(block));
+            tail = tail->next;
+            tail->trace.submitted(this);
+        }
+        submit_chain(head, tail, runners, static_cast<size_t>(task_priority::normal));
+    }
+
+    template<class Func>
+    timer_handle submit_at(const chrono::steady_clock::time_point& abs_time, Func&& closure) {
+        m_unfinished.fetch_add(1, memory_order_relaxed);
+        m_uninitiated.fetch_add(1, memory_order_relaxed);
+        task_node* t = new task_node(std::forward<Func>(closure));
+        t->trace.submitted(this);
+        // Timers are cancelled as soon as a shutdown starts, so none are taken after that
+        m_scheduling.fetch_add(1, memory_order_seq_cst);
+        if (m_phase.load(memory_order_seq_cst) != phase_open) {
+            m_scheduling.fetch_sub(1, memory_order_relaxed);
+            discard_started(t);
+            return timer_handle();
+        }
+        m_timers_pending.fetch_add(1, memory_order_relaxed);
+        timer_handle handle(timer_service::instance().schedule(this, abs_time, t));
+        m_scheduling.fetch_sub(1, memory_order_seq_cst);
+        return handle;
+    }
+
+    virtual void timer_cancelled(task_node* t) override {
+        delete t;
+        m_timers_pending.fetch_sub(1, memory_order_relaxed);
+        m_uninitiated.fetch_sub(1, memory_order_relaxed);
+        finish_task();
+    }
+
+    virtual void submit_timers(task_node* first, size_t count) override {
+        /* The timer thread holds no reference to the pool. An unfinished count of its own keeps
+           the destructor waiting until the batch is handed over, not just until its tasks ran. */
+        m_unfinished.fetch_add(1, memory_order_relaxed);
+        // Queue wait of a timed task starts when it falls due
+        uint64_t due = task_clock::now();
+        task_node* last = first;
+        for (;;) {
+            last->enqueued = due;
+            last->trace.fired(this);
+            if (!last->next) {
+                break;
+            }
+            last = last->next;
+        }
+        m_timers_pending.fetch_sub(count, memory_order_relaxed);
+        if (m_phase.load(memory_order_acquire) != phase_open) {
+            discard_chain(first);
+        } else {
+            // The timer thread belongs to no node, so due batches take turns
+            inject(m_next_node.fetch_add(1, memory_order_relaxed) % m_nodes.size(), first, last, count,
+                static_cast<size_t>(task_priority::normal));
+        }
+        // Under the lock, so wait_unfinished cannot return before we are done with this
+        lock_guard<mutex> lk(m_done_lock);
+        if (m_unfinished.fetch_sub(1, memory_order_seq_cst) == 1) {
+            m_done.notify_all();
+        }
+    }
+
+    size_t uninitiated_task_count() const {
+        return m_uninitiated.load(memory_order_relaxed);
+    }
+
+    // True on this pool's own workers, including inside strands they are draining
+    bool running_in_this_thread() const {
+        worker* self = current_worker();
+        return self && &self->pool == this;
+    }
+
+    // Runs one task the calling worker would have picked next; false off the pool or when none was found
+    bool run_one() {
+        worker* self = current_worker();
+        if (!self || &self->pool != this) {
+            return false;
+        }
+        task_node* t = find_task(*self);
+        if (!t) {
+            return false;
+        }
+        // The task has nothing to do with the strands the caller may be running in
+        detail::executor_frame::suspend hidden;
+        run(*self, t);
+        return true;
+    }
+
+    size_t node_count() const {
+        return m_nodes.size();
+    }
+
+    virtual void enter_blocking() override {
+        m_blocked.fetch_add(1, memory_order_relaxed);
+        give_up_turn();
+        // A stand-in is only worth a thread when something is waiting; later tasks call grow() themselves
+        if (queued() > 0) {
+            grow(1);
+        }
+    }
+
+    /* Waits for a stand-in to finish the task it is running; the stand-in then leaves instead of
+       taking another one */
+    virtual void leave_blocking() override {
+        m_blocked.fetch_sub(1, memory_order_relaxed);
+        m_returning.fetch_add(1, memory_order_seq_cst);
+        {
+            unique_lock<mutex> lk(m_turn_lock);
+            m_turn.wait(lk, [this] {
+                size_t active = m_active.load(memory_order_seq_cst);
+                while (active < m_target.load(memory_order_relaxed)) {
+                    if (m_active.compare_exchange_weak(active, active + 1, memory_order_seq_cst)) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+        m_returning.fetch_sub(1, memory_order_relaxed);
+    }
+
+    // Clamped to [min_threads, max_threads]; extra workers start as work arrives, surplus ones
+    // leave when they next run out of work
+    void set_concurrency(size_t n) {
+        n = std::min(std::max(n, m_min), m_max);
+        if (n > m_target.exchange(n, memory_order_relaxed)) {
+            // Workers back from a blocking_region may now run alongside the rest
+            if (m_returning.load(memory_order_seq_cst) > 0) {
+                lock_guard<mutex> lk(m_turn_lock);
+                m_turn.notify_all();
+            }
+            grow(queued());
+            return;
+        }
+        // Sleepers look for surplus on their way back to sleep
+        for (auto& q : m_nodes) {
+            lock_guard<mutex> lk(q->lock);
+            q->wake.notify_all();
+        }
+    }
+
+    size_t concurrency() const {
+        return m_target.load(memory_order_relaxed);
+    }
+
+    executor_metrics metrics() const {
+        executor_metrics m;
+        // Tasks are counted unfinished before uninitiated and started before finished
+        size_t unfinished = m_unfinished.load(memory_order_relaxed);
+        size_t uninitiated = m_uninitiated.load(memory_order_relaxed);
+        size_t timers = m_timers_pending.load(memory_order_relaxed);
+        m.timers_pending = timers;
+        m.queued = uninitiated > timers ? uninitiated - timers : 0;
+        m.running = unfinished > uninitiated ? unfinished - uninitiated : 0;
+        m.threads = m_live.load(memory_order_relaxed);
+        m.rejected = m_gate.rejected_count();
+        // One entry per slot ever used, so retired workers' tasks stay counted
+        size_t created = m_created.load(memory_order_acquire);
+        m.workers.reserve(created);
+        for (size_t i = 0; i < created; ++i) {
+            m.workers.push_back(m_workers[i]->counters.collect(m));
+        }
+        return m;
+    }
+};
+
+}
+
+class thread_pool {
+private:
+    shared_ptr<details::pool_group> pool;
+
+    static thread_pool_options with_threads(int N) {
+        thread_pool_options options;
+        options.threads = N;
+        return options;
+    }
+
+public:
+    thread_pool() : pool(std::make_shared<details::pool_group>(with_threads(details::pool_group::default_concurrency()))) {
+    }
+    explicit thread_pool(int N) : pool(std::make_shared<details::pool_group>(with_threads(N))) {
+    }
+    explicit thread_pool(thread_pool_options const& options) : pool(std::make_shared<details::pool_group>(options)) {
+    }
+
+    template<class Func>
+    void add(Func&& closure) {
+        pool->submit(task_priority::normal, std::forward<Func>(closure));
+    }
+
+    template<class Func>
+    void add(task_priority priority, Func&& closure) {
+        pool->submit(priority, std::forward<Func>(closure));
+    }
+
+    // Queues closure however full the queue is; see abstract_executor_ref::add_unbounded
+    template<class Func>
+    void add_unbounded(Func&& closure) {
+        pool->submit_admitted(task_priority::normal, false, std::forward<Func>(closure));
+    }
+
+    // Queues closure unless the queue is at its capacity; closure is left alone when this returns false
+    template<class Func>
+    bool try_add(Func&& closure) {
+        return pool->try_submit(task_priority::normal, std::forward<Func>(closure));
+    }
+
+    // Like try_add, but waits up to rel_time for a queued task to start
+    template<class Rep, class Period, class Func>
+    bool add_for(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool->submit_until(chrono::steady_clock::now() + details::to_steady_duration(rel_time),
+            task_priority::normal, std::forward<Func>(closure));
+    }
+
+    /* Bounds the tasks add(), add_bulk, try_add and add_for may queue; 0 removes the bound. A task
+       holds its place from add() until it starts; timed tasks, add_n runners and the drain jobs of
+       strands and serial_executors on the pool are not counted.
+       'policy' decides what add() does when the queue is full. */
+    void set_capacity(size_t capacity, overflow_policy policy = overflow_policy::reject) {
+        pool->set_capacity(capacity, policy);
+    }
+
+    size_t capacity() const {
+        return pool->capacity();
+    }
+
+    // Runs closure like add(); the returned future carries its result or exception
+    template<class Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& closure) {
+        return detail::add_with_result(*this, std::forward<Func>(closure));
+    }
+
+    // Runs closure before returning when called from one of this pool's tasks, otherwise add(closure)
+    template<class Func>
+    void dispatch(Func&& closure) {
+        detail::dispatch_or_add(*this, std::forward<Func>(closure));
+    }
+
+    bool running_in_this_thread() const {
+        return pool->running_in_this_thread();
+    }
+
+    /* Called on one of the pool's workers, runs one queued task there and returns true; elsewhere,
+       or when nothing is queued, returns false. Lets a task wait for others without taking a
+       worker out of the pool, see task_group. The task runs outside any strand the caller is in. */
+    bool try_run_one() {
+        return pool->run_one();
+    }
+
+    // Tasks from move iterators are moved, otherwise copied
+    template<class Iterator>
+    void add_bulk(Iterator first, Iterator last) {
+        pool->submit_bulk(first, last);
+    }
+
+    // Calls closure(i) for every i in [0, count)
+    template<class Func>
+    void add_n(size_t count, Func&& closure) {
+        pool->submit_n(count, std::forward<Func>(closure));
+    }
+
+    /* Any clock; steady_clock deadlines are kept as is with nanosecond resolution. The handle can
+       cancel the task or move its deadline until it falls due. */
+    template<class Clock, class Duration, class Func>
+    timer_handle add_at(const chrono::time_point<Clock, Duration>& abs_time, Func&& closure) {
+        return pool->submit_at(details::to_steady_time(abs_time), std::forward<Func>(closure));
+    }
+
+    template<class Rep, class Period, class Func>
+    timer_handle add_after(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool->submit_at(chrono::steady_clock::now() + details::to_steady_duration(rel_time), std::forward<Func>(closure));
+    }
+
+    virtual size_t uninitiated_task_count() const {
+        return pool->uninitiated_task_count();
+    }
+
+    // Worker groups: one per NUMA node with thread_pool_options::numa, otherwise 1
+    size_t node_count() const {
+        return pool->node_count();
+    }
+
+    /* Workers running tasks at once, not counting those inside a blocking_region; clamped to
+       thread_pool_options::min_threads .. max_threads */
+    void set_concurrency(int n) {
+        pool->set_concurrency(n > 0 ? static_cast<size_t>(n) : 1);
+    }
+
+    size_t concurrency() const {
+        return pool->concurrency();
+    }
+
+    /* Stops taking tasks from other threads, gives the queued ones up to 'drain_for' to run, then
+       discards the rest, waits for running ones and joins the workers. Timed tasks are discarded
+       at once, and so is anything added later. on_discard sees each discarded task, possibly on
+       several threads at a time. Affects every copy of this pool; must not be called from one of
+       its tasks. A strand or serial_executor whose drain job is discarded drops what it has queued. */
+    template<class Rep, class Period>
+    shutdown_result shutdown(const chrono::duration<Rep, Period>& drain_for, discard_handler const& on_discard = discard_handler()) {
+        return pool->shutdown(chrono::steady_clock::now() + details::to_steady_duration(drain_for), on_discard);
+    }
+
+    // Runs everything queued, however long it takes; only timed tasks are discarded
+    shutdown_result shutdown() {
+        return pool->shutdown(chrono::steady_clock::time_point::max(), discard_handler());
+    }
+
+    // Discards everything that has not started
+    shutdown_result shutdown_now(discard_handler const& on_discard = discard_handler()) {
+        return pool->shutdown(chrono::steady_clock::now(), on_discard);
+    }
+
+    executor_metrics metrics() const {
+        return pool->metrics();
+    }
+
+    // Names the pool in tracing::write_chrome_json; shared by every copy
+    void set_trace_name(string const& name) {
+        tracing::name(pool.get(), name);
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on this executor
+    template<class Rep, class Period>
+    timed_awaitable<thread_pool> after(const chrono::duration<Rep, Period>& rel_time) {
+        return ::after(*this, rel_time);
+    }
+
+    template<class Clock, class Duration>
+    timed_awaitable<thread_pool> at(const chrono::time_point<Clock, Duration>& abs_time) {
+        return ::at(*this, abs_time);
+    }
+#endif
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+namespace details {
+
+/* Chase-Lev work-stealing deque (Le, Pop, Cohen, Nardelli - PPoPP'13).
+   The owning worker pushes and pops at the bottom, any other thread steals from the top.
+   T must be a pointer type; nullptr means "nothing". */
+template<class T>
+class work_stealing_deque {
+    struct ring {
+        explicit ring(size_t capacity) : m_mask(capacity - 1), m_slots(new atomic<T>[capacity]) {}
+
+        size_t capacity() const { return m_mask + 1; }
+        T get(int64_t i) const { return m_slots[i & m_mask].load(memory_order_relaxed); }
+        void put(int64_t i, T value) { m_slots[i & m_mask].store(value, memory_order_relaxed); }
+
+        ring* grow(int64_t bottom, int64_t top) const {
+            ring* bigger = new ring(capacity() * 2);
+            for (int64_t i = top; i != bottom; ++i) {
+                bigger->put(i, get(i));
+            }
+            return bigger;
+        }
+
+    private:
+        size_t m_mask;
+        unique_ptr<atomic<T>[]> m_slots;
+    };
+
+    // Padded rather than alignas(64): C++11 new would not honour the alignment of the worker holding us
+    char m_pad0[64];
+    atomic<int64_t> m_top;
+    char m_pad1[64 - sizeof(atomic<int64_t>)];
+    atomic<int64_t> m_bottom;
+    atomic<ring*> m_ring;
+    char m_pad2[64 - sizeof(atomic<int64_t>) - sizeof(atomic<ring*>)];
+
+    // Rings replaced by grow() may still be read by a concurrent thief, so they live until the deque dies
+    vector<unique_ptr<ring>> m_retired;
+
+    work_stealing_deque(work_stealing_deque const &);
+    work_stealing_deque & operator=(work_stealing_deque const &);
+
+public:
+    explicit work_stealing_deque(size_t capacity = 256) : m_top(0), m_bottom(0), m_ring(new ring(capacity)) {}
+
+    ~work_stealing_deque() {
+        delete m_ring.load(memory_order_relaxed);
+    }
+
+    // Owner only
+    void push(T value) {
+        int64_t b = m_bottom.load(memory_order_relaxed);
+        int64_t t = m_top.load(memory_order_acquire);
+        ring* r = m_ring.load(memory_order_relaxed);
+        if (b - t > static_cast<int64_t>(r->capacity()) - 1) {
+            ring* bigger = r->grow(b, t);
+            m_retired.emplace_back(r);
+            m_ring.store(bigger, memory_order_release);
+            r = bigger;
+        }
+        r->put(b, value);
+        // A release store rather than a fence, so race detectors also see the hand-off to thieves
+        m_bottom.store(b + 1, memory_order_release);
+    }
+
+    // Owner only
+    T pop() {
+        int64_t b = m_bottom.load(memory_order_relaxed) - 1;
+        ring* r = m_ring.load(memory_order_relaxed);
+        m_bottom.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = m_top.load(memory_order_relaxed);
+
+        if (t > b) {
+            m_bottom.store(b + 1, memory_order_relaxed);
+            return nullptr;
+        }
+
+        T value = r->get(b);
+        if (t == b) {
+            // Last element: race against thieves for it
+            if (!m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+                value = nullptr;
+            }
+            m_bottom.store(b + 1, memory_order_relaxed);
+        }
+        return value;
+    }
+
+    // Any thread
+    T steal() {
+        int64_t t = m_top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = m_bottom.load(memory_order_acquire);
+
+        if (t >= b) {
+            return nullptr;
+        }
+
+        ring* r = m_ring.load(memory_order_acquire);
+        T value = r->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            return nullptr;
+        }
+        return value;
+    }
+
+    // Any thread; only a hint while other threads are pushing or stealing
+    size_t size() const {
+        int64_t b = m_bottom.load(memory_order_relaxed);
+        int64_t t = m_top.load(memory_order_relaxed);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+};
+
+}
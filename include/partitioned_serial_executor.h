@@ -0,0 +1,200 @@
+#ifndef PARTITIONED_SERIAL_EXECUTOR
+#define PARTITIONED_SERIAL_EXECUTOR
+
+#include "executor.h"
+#include "executor_metrics.h"
+#include "strand.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace details {
+
+/* One slot of the table: a strand plus its depth. A cache line of padding after it keeps hot
+   shards off each other's lines; alignas(64) would need an over-aligned new[] C++11 lacks. */
+struct serial_shard {
+    serial_shard() : queued(0), running(0) {}
+
+    strand lane;
+    atomic<size_t> queued;      // Added and not finished, including the one running
+    atomic<size_t> running;     // Only the strand's current holder writes it
+    char pad[64];
+};
+
+/* Fixed table of strands shared by all copies of a partitioned_serial_executor. Keys are hashed
+   onto shards, so nothing is created per key; keys that share a shard are serialised together,
+   which keeps per-key order and only costs parallelism when hot keys collide. */
+class shard_table {
+    abstract_executor_ref m_executor;
+    unique_ptr<serial_shard[]> m_shards;
+    unsigned m_shift;
+
+    shard_table(shard_table const &);
+    shard_table & operator=(shard_table const &);
+
+    // Counts out of its shard when it has run, or when a shutdown destroys it unrun
+    template<class Func>
+    class shard_task {
+    public:
+        template<class F>
+        shard_task(serial_shard* shard, F&& closure) : m_shard(shard), m_fnc(std::forward<F>(closure)) {}
+
+        shard_task(shard_task&& other) noexcept(is_nothrow_move_constructible<Func>::value) : m_shard(other.m_shard), m_fnc(std::move(other.m_fnc)) {
+            other.m_shard = nullptr;
+        }
+
+        ~shard_task() {
+            if (m_shard) {
+                m_shard->queued.fetch_sub(1, memory_order_relaxed);
+            }
+        }
+
+        void operator()() {
+            serial_shard* shard = m_shard;
+            m_shard = nullptr;
+            shard->running.store(1, memory_order_relaxed);
+            m_fnc();
+            shard->running.store(0, memory_order_relaxed);
+            shard->queued.fetch_sub(1, memory_order_relaxed);
+        }
+
+    private:
+        shard_task(shard_task const&);
+        shard_task& operator=(shard_task const&);
+
+        serial_shard* m_shard;
+        Func m_fnc;
+    };
+
+    template<class Func>
+    shard_task<typename decay<Func>::type> wrap(serial_shard& shard, Func&& closure) {
+        shard.queued.fetch_add(1, memory_order_relaxed);
+        return shard_task<typename decay<Func>::type>(&shard, std::forward<Func>(closure));
+    }
+
+public:
+    enum : size_t { shards_per_core = 16 };
+
+    shard_table(abstract_executor_ref underlying_executor, size_t shards) :
+        m_executor(underlying_executor),
+        m_shift(64) {
+        size_t count = 1;
+        while (count < shards) {
+            count <<= 1;
+            --m_shift;
+        }
+        m_shards.reset(new serial_shard[count]);
+    }
+
+    static size_t default_shard_count() {
+        size_t cores = thread::hardware_concurrency();
+        return shards_per_core * (cores ? cores : 1);
+    }
+
+    size_t shard_count() const {
+        return size_t(1) << (64 - m_shift);
+    }
+
+    // Fibonacci hashing: std::hash is the identity for integers, the multiply spreads it
+    size_t shard_of(size_t hash) const {
+        return m_shift == 64 ? 0 : static_cast<size_t>((uint64_t(hash) * 0x9E3779B97F4A7C15ull) >> m_shift);
+    }
+
+    abstract_executor_ref underlying_executor() const {
+        return m_executor;
+    }
+
+    template<class Func>
+    void submit(size_t shard, Func&& closure) {
+        serial_shard& s = m_shards[shard];
+        s.lane.add(m_executor, wrap(s, std::forward<Func>(closure)));
+    }
+
+    template<class Func>
+    void dispatch(size_t shard, Func&& closure) {
+        serial_shard& s = m_shards[shard];
+        s.lane.dispatch(m_executor, wrap(s, std::forward<Func>(closure)));
+    }
+
+    size_t queue_depth(size_t shard) const {
+        return m_shards[shard].queued.load(memory_order_relaxed);
+    }
+
+    executor_metrics metrics() const {
+        executor_metrics m;
+        for (size_t i = 0; i < shard_count(); ++i) {
+            size_t queued = m_shards[i].queued.load(memory_order_relaxed);
+            size_t running = m_shards[i].running.load(memory_order_relaxed);
+            m.running += running;
+            m.queued += queued > running ? queued - running : 0;
+        }
+        return m;
+    }
+};
+
+}
+
+/* Per-key FIFO over a shared executor: closures added with equal keys run one at a time in
+   the order they were added, different keys run in parallel. Keys are hashed with std::hash
+   onto a fixed table of strands chosen at construction (rounded up to a power of two), so no
+   object is created or destroyed per key. Copies share the table. */
+class partitioned_serial_executor {
+private:
+    shared_ptr<details::shard_table> m_table;
+
+public:
+    explicit partitioned_serial_executor(abstract_executor_ref underlying_executor,
+                                         size_t shards = details::shard_table::default_shard_count()) :
+        m_table(std::make_shared<details::shard_table>(underlying_executor, shards)) {}
+
+    abstract_executor_ref underlying_executor() const {
+        return m_table->underlying_executor();
+    }
+
+    template<class Key, class Func>
+    void add(Key const& key, Func&& closure) {
+        m_table->submit(shard_of(key), std::forward<Func>(closure));
+    }
+
+    // Runs closure inline when the caller already holds, or can take, the key's shard
+    template<class Key, class Func>
+    void dispatch(Key const& key, Func&& closure) {
+        m_table->dispatch(shard_of(key), std::forward<Func>(closure));
+    }
+
+    size_t shard_count() const {
+        return m_table->shard_count();
+    }
+
+    template<class Key>
+    size_t shard_of(Key const& key) const {
+        return m_table->shard_of(hash<Key>()(key));
+    }
+
+    // Closures added to 'shard' and not finished yet, the running one included
+    size_t queue_depth(size_t shard) const {
+        return m_table->queue_depth(shard);
+    }
+
+    // Every shard's queue_depth(), for spotting hot keys
+    vector<size_t> queue_depths() const {
+        vector<size_t> depths(shard_count());
+        for (size_t i = 0; i < depths.size(); ++i) {
+            depths[i] = m_table->queue_depth(i);
+        }
+        return depths;
+    }
+
+    // Summed over all shards; the underlying executor reports separately
+    executor_metrics metrics() const {
+        return m_table->metrics();
+    }
+};
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <system_error>
+
+#include <pthread.h>
+
+namespace details {
+
+/* Starts a detached thread running entry(arg); stack_size 0 keeps the platform default.
+   Throws system_error like std::thread when the thread cannot be created. */
+inline void start_detached_thread(size_t stack_size, void (*entry)(void*), void* arg) {
+    struct trampoline {
+        void (*entry)(void*);
+        void* arg;
+
+        static void* run(void* context) {
+            trampoline t = *static_cast<trampoline*>(context);
+            delete static_cast<trampoline*>(context);
+            t.entry(t.arg);
+            return nullptr;
+        }
+    };
+
+    pthread_attr_t attr;
+    int error = pthread_attr_init(&attr);
+    if (error == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (stack_size) {
+            error = pthread_attr_setstacksize(&attr, stack_size);
+        }
+    }
+    if (error == 0) {
+        pthread_t handle;
+        trampoline* context = new trampoline{ entry, arg };
+        error = pthread_create(&handle, &attr, &trampoline::run, context);
+        if (error) {
+            delete context;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    if (error) {
+        throw std::system_error(error, std::system_category(), "start_detached_thread");
+    }
+}
+
+}
@@ -0,0 +1,184 @@
+#ifndef RATE_LIMITED_EXECUTOR
+#define RATE_LIMITED_EXECUTOR
+
+#include "executor.h"
+#include "executor_metrics.h"
+#include "task_node.h"
+#include "timer_wheel.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+namespace details {
+
+/* Token bucket shared by all copies of a rate_limited_executor, kept as the time the next task
+   may start with a full bucket (GCRA). Every add moves that time on by one interval with a CAS,
+   which also tells the task when it may start; a task that is not due yet waits in the shared
+   timer_service with this bucket as target, so no thread sleeps and a limiter costs no more
+   than this object. */
+class token_bucket : public timer_target {
+    typedef chrono::steady_clock clock;
+    typedef clock::rep ticks;
+
+    abstract_executor_ref m_executor;
+    atomic<ticks> m_interval;       // Between two releases at the sustained rate
+    atomic<ticks> m_tolerance;      // How far ahead of m_next a release may be; (burst - 1) intervals
+    atomic<ticks> m_next;
+    atomic<size_t> m_deferred;
+    mutex m_lock;
+    condition_variable m_idle;
+
+    token_bucket(token_bucket const &);
+    token_bucket & operator=(token_bucket const &);
+
+    static ticks now() {
+        return clock::now().time_since_epoch().count();
+    }
+
+    // Takes one token; returns when the task holding it may start
+    ticks take(ticks at) {
+        ticks interval = m_interval.load(memory_order_relaxed);
+        ticks tolerance = m_tolerance.load(memory_order_relaxed);
+        ticks next = m_next.load(memory_order_relaxed);
+        ticks release;
+        do {
+            release = next - tolerance > at ? next - tolerance : at;
+        } while (!m_next.compare_exchange_weak(next, (next > at ? next : at) + interval, memory_order_relaxed));
+        return release;
+    }
+
+    /* Runs on the shared timer thread, which must neither wait for room in a bounded executor
+       nor see it refuse a task, or every timer behind it would stall */
+    virtual void submit_timers(task_node* first, size_t count) override {
+        while (first) {
+            task_node* next = first->next;
+            m_executor.add_unbounded(std::move(first->fnc));
+            delete first;
+            first = next;
+        }
+        size_t n = m_deferred.load(memory_order_relaxed);
+        while (n > count) {
+            if (m_deferred.compare_exchange_weak(n, n - count, memory_order_acq_rel, memory_order_relaxed)) {
+                return;
+            }
+        }
+        // The last deferred task goes under the lock so the destructor cannot finish while we still touch this
+        lock_guard<mutex> lk(m_lock);
+        if (m_deferred.fetch_sub(count, memory_order_acq_rel) == count) {
+            m_idle.notify_all();
+        }
+    }
+
+public:
+    token_bucket(abstract_executor_ref underlying_executor, double rate, size_t burst) :
+        m_executor(underlying_executor),
+        m_interval(0),
+        m_tolerance(0),
+        m_next(0),
+        m_deferred(0) {
+        set_rate(rate, burst);
+    }
+
+    // Deferred tasks still go to the underlying executor when they fall due
+    ~token_bucket() {
+        unique_lock<mutex> lk(m_lock);
+        m_idle.wait(lk, [this] { return m_deferred.load(memory_order_acquire) == 0; });
+    }
+
+    abstract_executor_ref underlying_executor() const {
+        return m_executor;
+    }
+
+    void set_rate(double rate, size_t burst) {
+        assert(rate > 0 && burst > 0);
+        ticks interval = chrono::duration_cast<clock::duration>(chrono::duration<double>(1.0 / rate)).count();
+        interval = interval > 0 ? interval : 1;
+        m_interval.store(interval, memory_order_relaxed);
+        m_tolerance.store(interval * static_cast<ticks>(burst - 1), memory_order_relaxed);
+    }
+
+    template<class Func>
+    void submit(Func&& closure) {
+        ticks at = now();
+        ticks release = take(at);
+        if (release <= at) {
+            m_executor.add(std::forward<Func>(closure));
+            return;
+        }
+        m_deferred.fetch_add(1, memory_order_relaxed);
+        timer_service::instance().schedule(this, clock::time_point(clock::duration(release)),
+            new task_node(std::forward<Func>(closure)))->release();
+    }
+
+    size_t backlog() const {
+        return m_deferred.load(memory_order_relaxed);
+    }
+
+    // How long a task added now would wait for its token
+    clock::duration delay() const {
+        ticks at = now();
+        ticks release = m_next.load(memory_order_relaxed) - m_tolerance.load(memory_order_relaxed);
+        return clock::duration(release > at ? release - at : 0);
+    }
+};
+
+}
+
+/* Starts at most 'rate' closures per second on the underlying executor, after an initial burst
+   of up to 'burst'. Closures over the rate are not refused: each is handed on when its turn
+   comes, in the order they were added, and meanwhile waits as a timer rather than in a worker.
+   Copies share the bucket; the last copy to go waits until every deferred closure was handed on. */
+class rate_limited_executor {
+private:
+    shared_ptr<details::token_bucket> m_bucket;
+
+public:
+    rate_limited_executor(abstract_executor_ref underlying_executor, double rate, size_t burst = 1) :
+        m_bucket(std::make_shared<details::token_bucket>(underlying_executor, rate, burst)) {}
+
+    abstract_executor_ref underlying_executor() const {
+        return m_bucket->underlying_executor();
+    }
+
+    template<class Func>
+    void add(Func&& closure) {
+        m_bucket->submit(std::forward<Func>(closure));
+    }
+
+    // Runs closure like add(); the returned future carries its result or exception
+    template<class Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& closure) {
+        return detail::add_with_result(*this, std::forward<Func>(closure));
+    }
+
+    // Takes effect from the next add; closures already deferred keep their turn
+    void set_rate(double rate, size_t burst = 1) {
+        m_bucket->set_rate(rate, burst);
+    }
+
+    // Closures waiting for their turn, not yet handed to the underlying executor
+    size_t backlog() const {
+        return m_bucket->backlog();
+    }
+
+    // How long a closure added now would wait before it is handed on
+    chrono::steady_clock::duration delay() const {
+        return m_bucket->delay();
+    }
+
+    // backlog() as queued; the underlying executor reports separately
+    executor_metrics metrics() const {
+        executor_metrics m;
+        m.queued = m_bucket->backlog();
+        return m;
+    }
+};
+
+#endif
@@ -1,8 +1,452 @@
 #ifndef SERIAL_EXECUTOR
 #define SERIAL_EXECUTOR
 
+#include "capacity_gate.h"
 #include "executor.h"
+#include "executor_metrics.h"
+#include "slab_allocator.h"
+#include "task_trace.h"
+#include "timer_wheel.h"
 
-#include "platform_serial_executor.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 
-#endif
\ No newline at end of file
+using namespace std;
+
+namespace details {
+
+/* Strand state shared by all copies of a serial_executor. Closures are pushed onto an intrusive
+   lock-free MPSC queue (Vyukov); m_pending counts queued and running closures and its 0 -> 1
+   transition schedules the single drain job on the underlying executor. */
+class serial_queue {
+    struct node : slab_allocated {
+        node() : next(nullptr), enqueued(0), holds_slot(false) {}
+
+        template<class Func>
+        explicit node(Func&& closure) : next(nullptr), enqueued(task_clock::now()), holds_slot(false), fnc(std::forward<Func>(closure)) {}
+
+        atomic<node*> next;
+        uint64_t enqueued;
+        bool holds_slot;            // Gives back a slot of m_gate when it starts
+        task_trace trace;
+        unique_task fnc;
+    };
+
+    // Closures run per drain job before it goes back to the underlying executor's queue
+    enum : size_t { drain_batch = 64 };
+
+    abstract_executor_ref m_executor;
+    node m_stub;
+    node* m_head;
+    atomic<node*> m_tail;
+    atomic<size_t> m_pending;
+    // Only the strand's holder (a drain job or a dispatch that took it over) writes these
+    atomic<size_t> m_running;
+    worker_counters m_counters;
+    capacity_gate m_gate;
+    mutex m_lock;
+    condition_variable m_idle;
+    bool m_orphaned;                // The last serial_executor went while we ran; guarded by m_lock
+
+    serial_queue(serial_queue const &);
+    serial_queue & operator=(serial_queue const &);
+
+    void push(node* n) {
+        n->next.store(nullptr, memory_order_relaxed);
+        node* prev = m_tail.exchange(n, memory_order_acq_rel);
+        prev->next.store(n, memory_order_release);
+    }
+
+    // Drain job only; nullptr when empty or when a producer has not linked its node yet
+    node* pop() {
+        node* head = m_head;
+        node* next = head->next.load(memory_order_acquire);
+        if (head == &m_stub) {
+            if (!next) {
+                return nullptr;
+            }
+            m_head = next;
+            head = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next) {
+            m_head = next;
+            return head;
+        }
+        if (head != m_tail.load(memory_order_acquire)) {
+            return nullptr;
+        }
+        push(&m_stub);
+        next = head->next.load(memory_order_acquire);
+        if (next) {
+            m_head = next;
+            return head;
+        }
+        return nullptr;
+    }
+
+    // Gives up the strand taken by dispatch(); closures queued meanwhile go to a drain job
+    struct claim_release {
+        serial_queue* queue;
+
+        ~claim_release() {
+            queue->m_running.store(0, memory_order_relaxed);
+            if (queue->release_one()) {
+                queue->schedule();
+            }
+        }
+    };
+
+    // Caller owns the strand through m_pending; runs closure as if the drain job had picked it
+    template<class Func>
+    void run_claimed(Func& closure) {
+        claim_release release = { this };
+        detail::executor_frame frame(this);
+        detail::inline_dispatch scope;
+        m_running.store(1, memory_order_relaxed);
+        uint64_t started = task_clock::now();
+        closure();
+        m_counters.task_done(started, started, task_clock::now());
+    }
+
+    // Returns false once the last pending closure is released and the drain job must stop
+    bool release_one() {
+        size_t n = m_pending.load(memory_order_relaxed);
+        while (n > 1) {
+            if (m_pending.compare_exchange_weak(n, n - 1, memory_order_acq_rel, memory_order_relaxed)) {
+                return true;
+            }
+        }
+        // Going idle happens under the lock so the destructor cannot finish while we still touch this
+        bool orphaned;
+        {
+            lock_guard<mutex> lk(m_lock);
+            if (m_pending.fetch_sub(1, memory_order_acq_rel) != 1) {
+                return true;
+            }
+            m_idle.notify_all();
+            orphaned = m_orphaned;
+        }
+        if (orphaned) {
+            delete this;
+        }
+        return false;
+    }
+
+    // Runs the strand when the underlying executor calls it; one it destroys unrun drops the queue
+    class drain_job {
+    public:
+        explicit drain_job(serial_queue* queue) : m_queue(queue) {}
+
+        drain_job(drain_job&& other) noexcept : m_queue(other.m_queue) {
+            other.m_queue = nullptr;
+        }
+
+        ~drain_job() {
+            if (m_queue) {
+                m_queue->discard();
+            }
+        }
+
+        void operator()() {
+            serial_queue* queue = m_queue;
+            m_queue = nullptr;
+            queue->drain();
+        }
+
+    private:
+        drain_job(drain_job const&);
+        drain_job& operator=(drain_job const&);
+
+        serial_queue* m_queue;
+    };
+
+    void schedule() {
+        m_executor.add_unbounded(drain_job(this));
+    }
+
+    // What a shutdown of the underlying executor leaves: the closures are destroyed unrun
+    void discard() {
+        // A closure holding the last serial_executor may go here, as when it runs
+        detail::executor_frame frame(this);
+        for (;;) {
+            node* n = pop();
+            if (!n) {
+                this_thread::yield();
+                continue;
+            }
+            if (n->holds_slot) {
+                m_gate.release();
+            }
+            delete n;
+            if (!release_one()) {
+                return;
+            }
+        }
+    }
+
+    void drain() {
+        detail::executor_frame frame(this);
+        size_t ran = 0;
+        for (;;) {
+            node* n = pop();
+            if (!n) {
+                // m_pending says a closure is on its way; its producer is between exchange and link
+                this_thread::yield();
+                continue;
+            }
+            if (n->holds_slot) {
+                m_gate.release();
+            }
+            m_running.store(1, memory_order_relaxed);
+            uint64_t started = task_clock::now();
+            n->trace.started(this);
+            n->fnc();
+            n->trace.finished(this);
+            m_counters.task_done(n->enqueued, started, task_clock::now());
+            m_running.store(0, memory_order_relaxed);
+            delete n;
+            if (!release_one()) {
+                return;
+            }
+            if (++ran == drain_batch) {
+                schedule();
+                return;
+            }
+        }
+    }
+
+public:
+    serial_queue(abstract_executor_ref underlying_executor, size_t capacity, overflow_policy policy) :
+        m_executor(underlying_executor),
+        m_head(&m_stub),
+        m_tail(&m_stub),
+        m_pending(0),
+        m_running(0),
+        m_gate(capacity, policy),
+        m_orphaned(false) {}
+
+    ~serial_queue() {
+        unique_lock<mutex> lk(m_lock);
+        m_idle.wait(lk, [this] { return m_pending.load(memory_order_acquire) == 0; });
+        tracing::forget(this);
+    }
+
+    /* Deleter of the serial_executor copies' shared_ptr. The last copy may go inside one of our
+       own closures, e.g. with the closure that captured it; waiting there for the strand to go
+       idle would wait for ourselves, so the strand deletes itself when it goes idle instead. */
+    static void destroy(serial_queue* queue) {
+        if (queue->running_in_this_thread()) {
+            lock_guard<mutex> lk(queue->m_lock);
+            queue->m_orphaned = true;
+            return;
+        }
+        delete queue;
+    }
+
+    abstract_executor_ref underlying_executor() const {
+        return m_executor;
+    }
+
+    executor_metrics metrics() const {
+        executor_metrics m;
+        size_t running = m_running.load(memory_order_relaxed);
+        size_t pending = m_pending.load(memory_order_relaxed);
+        m.running = running;
+        m.queued = pending > running ? pending - running : 0;
+        m.rejected = m_gate.rejected_count();
+        m_counters.collect(m);
+        return m;
+    }
+
+    template<class Func>
+    void submit_admitted(bool slot, Func&& closure) {
+        node* n = new node(std::forward<Func>(closure));
+        n->holds_slot = slot;
+        n->trace.submitted(this);
+        push(n);
+        if (m_pending.fetch_add(1, memory_order_acq_rel) == 0) {
+            schedule();
+        }
+    }
+
+    /* A full strand cannot run closure out of turn or drop what it has queued, so run_in_caller
+       waits for space and drop_oldest rejects. The strand's own closures always get in, since
+       they would otherwise wait for themselves. */
+    template<class Func>
+    void submit(Func&& closure) {
+        bool slot;
+        if (m_gate.try_acquire(slot)) {
+            submit_admitted(slot, std::forward<Func>(closure));
+        } else if (running_in_this_thread()) {
+            submit_admitted(false, std::forward<Func>(closure));
+        } else if (m_gate.policy() == overflow_policy::run_in_caller) {
+            {
+                blocking_region hint;
+                m_gate.acquire(slot);
+            }
+            submit_admitted(slot, std::forward<Func>(closure));
+        } else {
+            m_gate.rejected();
+        }
+    }
+
+    template<class Func>
+    bool try_submit(Func&& closure) {
+        bool slot;
+        if (!m_gate.try_acquire(slot)) {
+            return false;
+        }
+        submit_admitted(slot, std::forward<Func>(closure));
+        return true;
+    }
+
+    template<class Func>
+    bool submit_until(const chrono::steady_clock::time_point& deadline, Func&& closure) {
+        bool slot;
+        bool admitted = m_gate.try_acquire(slot);
+        if (!admitted) {
+            blocking_region hint;
+            admitted = m_gate.acquire_until(deadline, slot);
+        }
+        if (admitted) {
+            submit_admitted(slot, std::forward<Func>(closure));
+        }
+        return admitted;
+    }
+
+    void set_capacity(size_t capacity, overflow_policy policy) {
+        m_gate.set(capacity, policy);
+    }
+
+    size_t capacity() const {
+        return m_gate.capacity();
+    }
+
+    bool running_in_this_thread() const {
+        return detail::executor_frame::running_in(this);
+    }
+
+    /* Inside one of this strand's closures the new one runs at once, ahead of those still queued.
+       An idle strand called from a thread of its underlying executor is taken over for the
+       duration of the closure; anything else is submitted. */
+    template<class Func>
+    void dispatch(Func&& closure) {
+        if (detail::inline_dispatch::allowed()) {
+            if (running_in_this_thread()) {
+                detail::inline_dispatch scope;
+                closure();
+                return;
+            }
+            size_t idle = 0;
+            if (m_pending.load(memory_order_relaxed) == 0 && m_executor.running_in_this_thread() &&
+                m_pending.compare_exchange_strong(idle, 1, memory_order_acq_rel, memory_order_relaxed)) {
+                run_claimed(closure);
+                return;
+            }
+        }
+        submit(std::forward<Func>(closure));
+    }
+};
+
+}
+
+class serial_executor {
+private:
+    shared_ptr<details::serial_queue> m_queue;
+
+public:
+    explicit serial_executor(abstract_executor_ref underlying_executor) :
+        m_queue(new details::serial_queue(underlying_executor, 0, overflow_policy::reject), &details::serial_queue::destroy) {}
+
+    // Queues at most 'capacity' closures; see set_capacity
+    serial_executor(abstract_executor_ref underlying_executor, size_t capacity, overflow_policy policy = overflow_policy::reject) :
+        m_queue(new details::serial_queue(underlying_executor, capacity, policy), &details::serial_queue::destroy) {}
+
+    abstract_executor_ref underlying_executor() {
+        return m_queue->underlying_executor();
+    }
+
+    virtual ~serial_executor() {
+    }
+
+    template<class Func>
+    void add(Func&& closure) {
+        m_queue->submit(std::forward<Func>(closure));
+    }
+
+    // Queues closure however full the strand is; see abstract_executor_ref::add_unbounded
+    template<class Func>
+    void add_unbounded(Func&& closure) {
+        m_queue->submit_admitted(false, std::forward<Func>(closure));
+    }
+
+    // Queues closure unless the strand is at its capacity; closure is left alone when this returns false
+    template<class Func>
+    bool try_add(Func&& closure) {
+        return m_queue->try_submit(std::forward<Func>(closure));
+    }
+
+    // Like try_add, but waits up to rel_time for a queued closure to start
+    template<class Rep, class Period, class Func>
+    bool add_for(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return m_queue->submit_until(chrono::steady_clock::now() + details::to_steady_duration(rel_time),
+            std::forward<Func>(closure));
+    }
+
+    /* Bounds the closures the strand may queue; 0 removes the bound. A closure holds its place
+       until it starts. Since the strand must keep its order, run_in_caller makes add() wait for
+       space and drop_oldest acts like reject. */
+    void set_capacity(size_t capacity, overflow_policy policy = overflow_policy::reject) {
+        m_queue->set_capacity(capacity, policy);
+    }
+
+    size_t capacity() const {
+        return m_queue->capacity();
+    }
+
+    // Runs closure like add(); the returned future carries its result or exception
+    template<class Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& closure) {
+        return detail::add_with_result(*this, std::forward<Func>(closure));
+    }
+
+    // Runs closure before returning when the strand is already held by, or free for, this thread
+    template<class Func>
+    void dispatch(Func&& closure) {
+        m_queue->dispatch(std::forward<Func>(closure));
+    }
+
+    // True inside this strand's closures
+    bool running_in_this_thread() const {
+        return m_queue->running_in_this_thread();
+    }
+
+    // The strand's own queue; the underlying executor reports separately
+    executor_metrics metrics() const {
+        return m_queue->metrics();
+    }
+
+    // Names the strand in tracing::write_chrome_json; shared by every copy
+    void set_trace_name(string const& name) {
+        tracing::name(m_queue.get(), name);
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on this executor
+    template<class Rep, class Period>
+    timed_awaitable<serial_executor> after(const chrono::duration<Rep, Period>& rel_time) {
+        return ::after(*this, rel_time);
+    }
+
+    template<class Clock, class Duration>
+    timed_awaitable<serial_executor> at(const chrono::time_point<Clock, Duration>& abs_time) {
+        return ::at(*this, abs_time);
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef SLAB_ALLOCATOR
+#define SLAB_ALLOCATOR
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Set to 0 to give task records plain operator new and delete, e.g. for heap checkers
+#ifndef EXTR_SLAB_ALLOCATOR
+#define EXTR_SLAB_ALLOCATOR 1
+#endif
+
+using namespace std;
+
+namespace details {
+
+/* Per-thread cache of the small records every task passes through: task nodes, queue nodes,
+   platform wrappers and timer records. Blocks come in size classes of 64 bytes up to 256, which
+   covers a unique_task with its default inline buffer plus links; bigger requests go straight to
+   operator new. Each block's header names the heap it came from.
+   A block freed on its owner's thread goes back on that heap's free list. One freed on another
+   thread is collected in a short batch per owner, and the whole batch is spliced onto the
+   owner's remote list with one CAS; the owner takes that list whole once its own runs dry, so
+   producer threads recycle what workers free without taking a lock.
+   A heap outlives its thread: at thread exit it is handed to the next thread that starts, so
+   blocks still in flight can be freed at any time. */
+class slab_heap {
+public:
+    enum : size_t {
+        class_size = 64,
+        class_count = 4,
+        cache_limit = 1024,     // Free blocks a heap keeps per class; the rest go back to operator delete
+        batch_limit = 32        // Remote frees collected before they are handed back
+    };
+
+private:
+    struct alignas(max_align_t) header {
+        slab_heap* owner;       // nullptr for blocks from operator new
+        size_t size_class;
+    };
+
+    // Threads that have exited wait here for the next thread that needs a heap
+    struct registry {
+        mutex lock;
+        vector<slab_heap*> idle;
+    };
+
+    header* m_local[class_count];
+    size_t m_cached[class_count];
+    atomic<header*> m_remote[class_count];
+    // The batch of remote frees being collected for one other heap
+    slab_heap* m_batch_owner;
+    size_t m_batch_class;
+    header* m_batch_head;
+    header* m_batch_tail;
+    size_t m_batch_count;
+
+    slab_heap(slab_heap const &);
+    slab_heap & operator=(slab_heap const &);
+
+    slab_heap() : m_batch_owner(nullptr), m_batch_class(0), m_batch_head(nullptr), m_batch_tail(nullptr), m_batch_count(0) {
+        for (size_t size_class = 0; size_class < class_count; ++size_class) {
+            m_local[size_class] = nullptr;
+            m_cached[size_class] = 0;
+            m_remote[size_class].store(nullptr, memory_order_relaxed);
+        }
+    }
+
+    // Free blocks are linked through their first payload word; the header stays intact
+    static header*& next_of(header* h) {
+        return *reinterpret_cast<header**>(h + 1);
+    }
+
+    // Never destroyed: blocks may be freed during static destruction
+    static registry& heaps() {
+        static registry* r = new registry();
+        return *r;
+    }
+
+    static slab_heap*& this_thread_heap() {
+        static thread_local slab_heap* heap = nullptr;
+        return heap;
+    }
+
+    static bool& thread_exited() {
+        static thread_local bool exited = false;
+        return exited;
+    }
+
+    struct thread_exit {
+        ~thread_exit() {
+            slab_heap* heap = this_thread_heap();
+            this_thread_heap() = nullptr;
+            thread_exited() = true;
+            if (heap) {
+                heap->detach();
+            }
+        }
+    };
+
+    // nullptr after the thread's own thread_local destructors ran
+    static slab_heap* current() {
+        slab_heap* heap = this_thread_heap();
+        if (heap || thread_exited()) {
+            return heap;
+        }
+        static thread_local thread_exit on_exit;
+        (void)on_exit;
+        registry& r = heaps();
+        {
+            lock_guard<mutex> lk(r.lock);
+            if (!r.idle.empty()) {
+                heap = r.idle.back();
+                r.idle.pop_back();
+            }
+        }
+        if (!heap) {
+            heap = new slab_heap();
+        }
+        this_thread_heap() = heap;
+        return heap;
+    }
+
+    static void release_list(header* h) {
+        while (h) {
+            header* next = next_of(h);
+            ::operator delete(h);
+            h = next;
+        }
+    }
+
+    void detach() {
+        flush_batch();
+        for (size_t size_class = 0; size_class < class_count; ++size_class) {
+            release_list(m_local[size_class]);
+            m_local[size_class] = nullptr;
+            m_cached[size_class] = 0;
+            release_list(m_remote[size_class].exchange(nullptr, memory_order_acquire));
+        }
+        registry& r = heaps();
+        lock_guard<mutex> lk(r.lock);
+        r.idle.push_back(this);
+    }
+
+    header* take(size_t size_class) {
+        header* h = m_local[size_class];
+        if (!h) {
+            h = m_remote[size_class].exchange(nullptr, memory_order_acquire);
+            if (!h) {
+                h = static_cast<header*>(::operator new((size_class + 1) * class_size));
+                h->owner = this;
+                h->size_class = size_class;
+                return h;
+            }
+        }
+        m_local[size_class] = next_of(h);
+        if (m_cached[size_class] > 0) {
+            --m_cached[size_class];
+        }
+        return h;
+    }
+
+    void put_local(header* h) {
+        size_t size_class = h->size_class;
+        if (m_cached[size_class] >= cache_limit) {
+            ::operator delete(h);
+            return;
+        }
+        next_of(h) = m_local[size_class];
+        m_local[size_class] = h;
+        ++m_cached[size_class];
+    }
+
+    void put_remote(header* h) {
+        if (m_batch_count && (h->owner != m_batch_owner || h->size_class != m_batch_class)) {
+            flush_batch();
+        }
+        if (!m_batch_count) {
+            m_batch_owner = h->owner;
+            m_batch_class = h->size_class;
+            m_batch_tail = h;
+        }
+        next_of(h) = m_batch_head;
+        m_batch_head = h;
+        if (++m_batch_count == batch_limit) {
+            flush_batch();
+        }
+    }
+
+    void flush_batch() {
+        if (m_batch_count) {
+            m_batch_owner->push_remote(m_batch_class, m_batch_head, m_batch_tail);
+            m_batch_head = nullptr;
+            m_batch_tail = nullptr;
+            m_batch_count = 0;
+        }
+    }
+
+    void push_remote(size_t size_class, header* first, header* last) {
+        header* head = m_remote[size_class].load(memory_order_relaxed);
+        do {
+            next_of(last) = head;
+        } while (!m_remote[size_class].compare_exchange_weak(head, first, memory_order_release, memory_order_relaxed));
+    }
+
+public:
+    static void* allocate(size_t size) {
+#if EXTR_SLAB_ALLOCATOR
+        size_t size_class = (size + sizeof(header) - 1) / class_size;
+        if (size_class < class_count) {
+            if (slab_heap* heap = current()) {
+                return heap->take(size_class) + 1;
+            }
+        }
+        header* h = static_cast<header*>(::operator new(size + sizeof(header)));
+        h->owner = nullptr;
+        return h + 1;
+#else
+        return ::operator new(size);
+#endif
+    }
+
+    static void deallocate(void* p) {
+#if EXTR_SLAB_ALLOCATOR
+        if (!p) {
+            return;
+        }
+        header* h = static_cast<header*>(p) - 1;
+        slab_heap* owner = h->owner;
+        if (!owner) {
+            ::operator delete(h);
+            return;
+        }
+        slab_heap* heap = current();
+        if (heap == owner) {
+            heap->put_local(h);
+        } else if (heap) {
+            heap->put_remote(h);
+        } else {
+            owner->push_remote(h->size_class, h, h);
+        }
+#else
+        ::operator delete(p);
+#endif
+    }
+
+    // Hands the calling thread's pending remote frees back to their heaps, e.g. before it sleeps
+    static void flush() {
+#if EXTR_SLAB_ALLOCATOR
+        if (slab_heap* heap = this_thread_heap()) {
+            heap->flush_batch();
+        }
+#endif
+    }
+};
+
+// Base of the records allocated and freed once per task; routes their new and delete to slab_heap
+struct slab_allocated {
+    static void* operator new(size_t size) {
+        return slab_heap::allocate(size);
+    }
+
+    static void operator delete(void* p) {
+        slab_heap::deallocate(p);
+    }
+};
+
+}
+
+#endif
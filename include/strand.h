@@ -0,0 +1,233 @@
+#ifndef STRAND
+#define STRAND
+
+#include "executor.h"
+#include "slab_allocator.h"
+
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+namespace details {
+
+struct strand_node : slab_allocated {
+    strand_node() : next(nullptr) {}
+
+    template<class Func>
+    explicit strand_node(Func&& closure) : next(nullptr), fnc(std::forward<Func>(closure)) {}
+
+    atomic<strand_node*> next;
+    unique_task fnc;
+};
+
+}
+
+/* Serial execution context that is one pointer while idle: the tail of its queue, or nullptr.
+   Unlike serial_executor it owns no executor and no shared state. The executor passed to add()
+   is only borrowed by the drain job, which exists while the strand has work, so millions of
+   mostly idle strands cost a word each. The producer that finds the strand idle starts the drain
+   job; every other producer links behind the tail (an MCS-style queue).
+   A strand must be idle when it is destroyed; the destructor waits for that. */
+class strand {
+    typedef details::strand_node node;
+
+    // Closures run per drain job before it goes back to the executor's queue
+    enum : size_t { drain_batch = 64 };
+
+    atomic<node*> m_tail;
+
+    strand(strand const &);
+    strand & operator=(strand const &);
+
+    /* Runs the queue from 'head' on; all a strand costs while it has work. One the executor
+       destroys unrun, e.g. in a shutdown, drops the queue so the strand still goes idle. */
+    class drain_job {
+    public:
+        drain_job(strand* owner, node* head, abstract_executor_ref executor) : m_owner(owner), m_head(head), m_executor(executor) {}
+
+        drain_job(drain_job&& other) noexcept : m_owner(other.m_owner), m_head(other.m_head), m_executor(other.m_executor) {
+            other.m_owner = nullptr;
+        }
+
+        ~drain_job() {
+            if (m_owner) {
+                m_owner->discard(m_head);
+            }
+        }
+
+        void operator()() {
+            strand* owner = m_owner;
+            m_owner = nullptr;
+            owner->drain(m_head, m_executor);
+        }
+
+    private:
+        drain_job(drain_job const&);
+        drain_job& operator=(drain_job const&);
+
+        strand* m_owner;
+        node* m_head;
+        abstract_executor_ref m_executor;
+    };
+
+    // Node queued after 'head', or nullptr once the strand has gone idle
+    node* next_after(node* head) {
+        node* next = head->next.load(memory_order_acquire);
+        if (next) {
+            return next;
+        }
+        node* expected = head;
+        if (m_tail.compare_exchange_strong(expected, nullptr, memory_order_acq_rel, memory_order_acquire)) {
+            // The strand may be destroyed from here on
+            return nullptr;
+        }
+        // A producer has swapped the tail but not linked its node yet
+        while (!(next = head->next.load(memory_order_acquire))) {
+            this_thread::yield();
+        }
+        return next;
+    }
+
+    void drain(node* head, abstract_executor_ref executor) {
+        detail::executor_frame frame(this);
+        for (size_t ran = 1; ; ++ran) {
+            head->fnc();
+            node* next = next_after(head);
+            delete head;
+            if (!next) {
+                return;
+            }
+            head = next;
+            if (ran == drain_batch) {
+                executor.add_unbounded(drain_job(this, head, executor));
+                return;
+            }
+        }
+    }
+
+    void discard(node* head) {
+        while (head) {
+            node* next = next_after(head);
+            delete head;
+            head = next;
+        }
+    }
+
+    // Gives up a strand taken by dispatch(); anything queued meanwhile goes to a drain job
+    struct claim_release {
+        strand* owner;
+        node* claim;
+        abstract_executor_ref executor;
+
+        ~claim_release() {
+            if (node* next = owner->next_after(claim)) {
+                executor.add_unbounded(drain_job(owner, next, executor));
+            }
+        }
+    };
+
+public:
+    strand() : m_tail(nullptr) {}
+
+    ~strand() {
+        while (m_tail.load(memory_order_acquire)) {
+            this_thread::yield();
+        }
+    }
+
+    bool idle() const {
+        return m_tail.load(memory_order_acquire) == nullptr;
+    }
+
+    // True inside this strand's closures
+    bool running_in_this_thread() const {
+        return detail::executor_frame::running_in(this);
+    }
+
+    // Queues closure behind everything added before; an idle strand starts draining on 'executor'
+    template<class Func>
+    void add(abstract_executor_ref executor, Func&& closure) {
+        node* n = new node(std::forward<Func>(closure));
+        node* prev = m_tail.exchange(n, memory_order_acq_rel);
+        if (prev) {
+            prev->next.store(n, memory_order_release);
+        } else {
+            executor.add_unbounded(drain_job(this, n, executor));
+        }
+    }
+
+    /* Inside one of this strand's closures the new one runs at once. An idle strand called from a
+       thread of 'executor' is taken over, with a node on the stack, for the duration of the
+       closure; anything else is queued. */
+    template<class Func>
+    void dispatch(abstract_executor_ref executor, Func&& closure) {
+        if (detail::inline_dispatch::allowed()) {
+            if (running_in_this_thread()) {
+                detail::inline_dispatch scope;
+                closure();
+                return;
+            }
+            if (idle() && executor.running_in_this_thread()) {
+                node claim;
+                node* expected = nullptr;
+                if (m_tail.compare_exchange_strong(expected, &claim, memory_order_acq_rel, memory_order_relaxed)) {
+                    claim_release release = { this, &claim, executor };
+                    detail::executor_frame frame(this);
+                    detail::inline_dispatch scope;
+                    closure();
+                    return;
+                }
+            }
+        }
+        add(executor, std::forward<Func>(closure));
+    }
+};
+
+// A strand with the executor it runs on, usable wherever an executor is; three words, no allocation
+class strand_executor {
+    strand* m_strand;
+    abstract_executor_ref m_executor;
+
+public:
+    strand_executor(strand& s, abstract_executor_ref executor) : m_strand(&s), m_executor(executor) {}
+
+    template<class Func>
+    void add(Func&& closure) {
+        m_strand->add(m_executor, std::forward<Func>(closure));
+    }
+
+    template<class Func>
+    void dispatch(Func&& closure) {
+        m_strand->dispatch(m_executor, std::forward<Func>(closure));
+    }
+
+    bool running_in_this_thread() const {
+        return m_strand->running_in_this_thread();
+    }
+
+    // Runs closure like add(); the returned future carries its result or exception
+    template<class Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& closure) {
+        return detail::add_with_result(*this, std::forward<Func>(closure));
+    }
+
+    abstract_executor_ref underlying_executor() const {
+        return m_executor;
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on the strand
+    template<class Rep, class Period>
+    timed_awaitable<strand_executor> after(const chrono::duration<Rep, Period>& rel_time) {
+        return ::after(*this, rel_time);
+    }
+
+    template<class Clock, class Duration>
+    timed_awaitable<strand_executor> at(const chrono::time_point<Clock, Duration>& abs_time) {
+        return ::at(*this, abs_time);
+    }
+#endif
+};
+
+#endif
@@ -10,8 +10,19 @@ class system_executor {
 private:
     thread_pool pool;
 
-    // Private default constructor: users must access system_executor by calling get_system_executor
-    system_executor() {}
+    // Private constructors: users must access system_executor by calling get_system_executor
+    system_executor() {
+        pool.set_trace_name("system_executor");
+    }
+    explicit system_executor(thread_pool_options const& options) : pool(options) {
+        pool.set_trace_name("numa_system_executor");
+    }
+
+    static thread_pool_options numa_options() {
+        thread_pool_options options;
+        options.numa = true;
+        return options;
+    }
 public:
 
     static system_executor& get_system_executor() {
@@ -19,24 +30,130 @@ public:
         return instance;
     }
 
+    // One worker group per NUMA node; add() queues on the caller's node
+    static system_executor& get_numa_system_executor() {
+        static system_executor instance(numa_options());
+        return instance;
+    }
+
     template<class Func>
     void add(Func&& closure) {
-        pool.add(std::move(closure));
+        pool.add(std::forward<Func>(closure));
+    }
+
+    template<class Func>
+    void add(task_priority priority, Func&& closure) {
+        pool.add(priority, std::forward<Func>(closure));
+    }
+
+    template<class Func>
+    void add_unbounded(Func&& closure) {
+        pool.add_unbounded(std::forward<Func>(closure));
     }
 
     template<class Func>
-    void add_at(const chrono::system_clock::time_point& abs_time, Func&& closure) {
-        pool.add_at(abs_time, std::move(closure));
+    bool try_add(Func&& closure) {
+        return pool.try_add(std::forward<Func>(closure));
     }
 
+    template<class Rep, class Period, class Func>
+    bool add_for(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool.add_for(rel_time, std::forward<Func>(closure));
+    }
+
+    // The system executor is shared by the whole process; a capacity bounds every user's add()
+    void set_capacity(size_t capacity, overflow_policy policy = overflow_policy::reject) {
+        pool.set_capacity(capacity, policy);
+    }
+
+    size_t capacity() const {
+        return pool.capacity();
+    }
+
+    // Runs closure like add(); the returned future carries its result or exception
     template<class Func>
-    void add_after(const chrono::system_clock::duration& rel_time, Func&& closure) {
-        pool.add_after(rel_time, std::move(closure));
+    typename detail::future_of<Func>::type add_with_result(Func&& closure) {
+        return detail::add_with_result(*this, std::forward<Func>(closure));
+    }
+
+    // Runs closure before returning when called from a system executor task, otherwise add(closure)
+    template<class Func>
+    void dispatch(Func&& closure) {
+        pool.dispatch(std::forward<Func>(closure));
+    }
+
+    bool running_in_this_thread() const {
+        return pool.running_in_this_thread();
+    }
+
+    template<class Iterator>
+    void add_bulk(Iterator first, Iterator last) {
+        pool.add_bulk(first, last);
+    }
+
+    template<class Func>
+    void add_n(size_t count, Func&& closure) {
+        pool.add_n(count, std::forward<Func>(closure));
+    }
+
+    template<class Clock, class Duration, class Func>
+    timer_handle add_at(const chrono::time_point<Clock, Duration>& abs_time, Func&& closure) {
+        return pool.add_at(abs_time, std::forward<Func>(closure));
+    }
+
+    template<class Rep, class Period, class Func>
+    timer_handle add_after(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool.add_after(rel_time, std::forward<Func>(closure));
     }
 
     virtual size_t uninitiated_task_count() const {
-        return 0;
+        return pool.uninitiated_task_count();
+    }
+
+    // Resizes the shared pool for the whole process; see thread_pool::set_concurrency
+    void set_concurrency(int n) {
+        pool.set_concurrency(n);
+    }
+
+    size_t concurrency() const {
+        return pool.concurrency();
+    }
+
+    // Shuts the process-wide pool down for good, typically on the way out; see thread_pool::shutdown
+    template<class Rep, class Period>
+    shutdown_result shutdown(const chrono::duration<Rep, Period>& drain_for, discard_handler const& on_discard = discard_handler()) {
+        return pool.shutdown(drain_for, on_discard);
+    }
+
+    shutdown_result shutdown() {
+        return pool.shutdown();
+    }
+
+    shutdown_result shutdown_now(discard_handler const& on_discard = discard_handler()) {
+        return pool.shutdown_now(on_discard);
+    }
+
+    executor_metrics metrics() const {
+        return pool.metrics();
+    }
+
+    // The system executors are named "system_executor" and "numa_system_executor" by default
+    void set_trace_name(string const& name) {
+        pool.set_trace_name(name);
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on this executor
+    template<class Rep, class Period>
+    timed_awaitable<system_executor> after(const chrono::duration<Rep, Period>& rel_time) {
+        return ::after(*this, rel_time);
+    }
+
+    template<class Clock, class Duration>
+    timed_awaitable<system_executor> at(const chrono::time_point<Clock, Duration>& abs_time) {
+        return ::at(*this, abs_time);
     }
+#endif
 };
 
 namespace details {
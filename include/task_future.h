@@ -0,0 +1,699 @@
+#ifndef TASK_FUTURE
+#define TASK_FUTURE
+
+#include "executor.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+template<class T>
+class task_future;
+
+// Value of a when_any future: which input finished first and what it produced
+template<class T>
+struct when_any_result {
+    size_t index;
+    T value;
+};
+
+template<>
+struct when_any_result<void> {
+    size_t index;
+};
+
+namespace detail {
+
+// Hooked onto a future_state; ready() runs exactly once, after the result is in
+class future_callback {
+public:
+    virtual void ready() = 0;
+
+protected:
+    ~future_callback() {}
+};
+
+/* Result slot shared by a task_future and whatever produces its result. m_callback is the whole
+   synchronisation: 0 while pending, 1 once the result is in, otherwise the single callback to run
+   when it arrives. Completing and attaching are one atomic each, so no lock is ever taken unless
+   get() has to block. */
+class future_state_base {
+    enum : uintptr_t { pending = 0, completed = 1 };
+
+    atomic<uintptr_t> m_callback;
+    atomic<size_t> m_refs;
+    exception_ptr m_error;
+
+    future_state_base(future_state_base const &);
+    future_state_base & operator=(future_state_base const &);
+
+    // Wakes a thread blocked in wait(); lives on that thread's stack
+    class blocking_waiter : public future_callback {
+        mutex m_lock;
+        condition_variable m_ready;
+        bool m_done;
+
+    public:
+        blocking_waiter() : m_done(false) {}
+
+        virtual void ready() override {
+            lock_guard<mutex> lk(m_lock);
+            m_done = true;
+            m_ready.notify_all();
+        }
+
+        void wait() {
+            unique_lock<mutex> lk(m_lock);
+            m_ready.wait(lk, [this] { return m_done; });
+        }
+    };
+
+protected:
+    // Publishes the value or error written just before and runs the attached callback, if any
+    void complete() {
+        uintptr_t callback = m_callback.exchange(completed, memory_order_acq_rel);
+        if (callback != pending) {
+            reinterpret_cast<future_callback*>(callback)->ready();
+        }
+    }
+
+public:
+    explicit future_state_base(size_t refs) : m_callback(pending), m_refs(refs) {}
+
+    virtual ~future_state_base() {}
+
+    // Runs the work that produces the result; only states scheduled on an executor have any
+    virtual void run() {
+        assert(false);
+    }
+
+    void release() {
+        if (m_refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    bool is_ready() const {
+        return m_callback.load(memory_order_acquire) == completed;
+    }
+
+    // False when the result is already in; the caller then runs the callback itself
+    bool set_callback(future_callback* callback) {
+        uintptr_t expected = pending;
+        return m_callback.compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(callback),
+            memory_order_acq_rel, memory_order_acquire);
+    }
+
+    void fail(exception_ptr error) {
+        m_error = error;
+        complete();
+    }
+
+    // Only after completion
+    exception_ptr error() const {
+        return m_error;
+    }
+
+    void rethrow_if_failed() const {
+        if (m_error) {
+            rethrow_exception(m_error);
+        }
+    }
+
+    void wait() {
+        if (is_ready()) {
+            return;
+        }
+        blocking_waiter waiter;
+        if (set_callback(&waiter)) {
+            blocking_region hint;
+            waiter.wait();
+        }
+    }
+};
+
+template<class T>
+class future_state : public future_state_base {
+    typename aligned_storage<sizeof(T), alignof(T)>::type m_value;
+    bool m_has_value;
+
+public:
+    explicit future_state(size_t refs) : future_state_base(refs), m_has_value(false) {}
+
+    ~future_state() {
+        if (m_has_value) {
+            reinterpret_cast<T*>(&m_value)->~T();
+        }
+    }
+
+    template<class U>
+    void set_value(U&& value) {
+        ::new (&m_value) T(std::forward<U>(value));
+        m_has_value = true;
+        complete();
+    }
+
+    // Only after a successful completion, and once
+    T take() {
+        return std::move(*reinterpret_cast<T*>(&m_value));
+    }
+};
+
+template<>
+class future_state<void> : public future_state_base {
+public:
+    explicit future_state(size_t refs) : future_state_base(refs) {}
+
+    void set_value() {
+        complete();
+    }
+
+    void take() {}
+};
+
+template<class R, class Work>
+void fulfil(future_state<R>& state, Work& work, false_type) {
+    state.set_value(work());
+}
+
+template<class R, class Work>
+void fulfil(future_state<R>& state, Work& work, true_type) {
+    work();
+    state.set_value();
+}
+
+/* A future_state together with the work that produces its result, so a submitted task needs one
+   allocation. The work is destroyed as soon as it has run, releasing whatever it captured. */
+template<class R, class Work>
+class task_state : public future_state<R> {
+    typename aligned_storage<sizeof(Work), alignof(Work)>::type m_work;
+    bool m_has_work;
+
+    Work& work() {
+        return *reinterpret_cast<Work*>(&m_work);
+    }
+
+    void destroy_work() {
+        if (m_has_work) {
+            m_has_work = false;
+            work().~Work();
+        }
+    }
+
+public:
+    template<class W>
+    task_state(size_t refs, W&& w) : future_state<R>(refs), m_has_work(true) {
+        ::new (&m_work) Work(std::forward<W>(w));
+    }
+
+    ~task_state() {
+        destroy_work();
+    }
+
+    virtual void run() override {
+        try {
+            fulfil(*this, work(), is_void<R>());
+        } catch (...) {
+            this->fail(current_exception());
+        }
+        destroy_work();
+    }
+};
+
+/* The closure an executor actually runs: one pointer, so it always fits unique_task's buffer.
+   Destroyed without running (the executor dropped it), it breaks the promise instead. */
+class state_runner {
+    future_state_base* m_state;
+
+public:
+    explicit state_runner(future_state_base* state) : m_state(state) {}
+
+    state_runner(state_runner&& other) noexcept : m_state(other.m_state) {
+        other.m_state = nullptr;
+    }
+
+    ~state_runner() {
+        if (m_state) {
+            m_state->fail(make_exception_ptr(future_error(future_errc::broken_promise)));
+            m_state->release();
+        }
+    }
+
+    void operator()() {
+        future_state_base* state = m_state;
+        m_state = nullptr;
+        state->run();
+        state->release();
+    }
+};
+
+template<class T, class G>
+struct continuation_result {
+    typedef typename result_of<G(T)>::type type;
+};
+
+template<class G>
+struct continuation_result<void, G> {
+    typedef typename result_of<G()>::type type;
+};
+
+// Work of a then() stage: g applied to the source's value, or the source's error passed along
+template<class T, class G>
+class continuation_work {
+    future_state<T>* m_source;
+    G m_g;
+
+    typename continuation_result<T, G>::type call(false_type) {
+        return m_g(m_source->take());
+    }
+
+    typename continuation_result<T, G>::type call(true_type) {
+        return m_g();
+    }
+
+public:
+    template<class F>
+    continuation_work(future_state<T>* source, F&& g) : m_source(source), m_g(std::forward<F>(g)) {}
+
+    continuation_work(continuation_work&& other) : m_source(other.m_source), m_g(std::move(other.m_g)) {
+        other.m_source = nullptr;
+    }
+
+    ~continuation_work() {
+        if (m_source) {
+            m_source->release();
+        }
+    }
+
+    typename continuation_result<T, G>::type operator()() {
+        m_source->rethrow_if_failed();
+        return call(is_void<T>());
+    }
+};
+
+/* A then() stage: waits on its source as that source's callback, then goes to the executor as a
+   state_runner. Dispatched, so a source finishing on the stage's own executor runs it inline. */
+template<class Executor, class T, class G>
+class continuation_state : public task_state<typename continuation_result<T, G>::type, continuation_work<T, G>>,
+                           public future_callback {
+    Executor* m_executor;
+
+public:
+    template<class F>
+    continuation_state(Executor& executor, future_state<T>* source, F&& g) :
+        task_state<typename continuation_result<T, G>::type, continuation_work<T, G>>(2,
+            continuation_work<T, G>(source, std::forward<F>(g))),
+        m_executor(&executor) {}
+
+    virtual void ready() override {
+        dispatch_to(*m_executor, unique_task(state_runner(this)), typename has_dispatch<Executor>::type());
+    }
+};
+
+template<class T>
+struct when_all_value {
+    typedef vector<T> type;
+};
+
+template<>
+struct when_all_value<void> {
+    typedef void type;
+};
+
+/* Callback slots for a fixed set of sources, one per source since each source holds a single
+   callback. Derived states get arrived(index) once per source, in completion order. */
+template<class T, class Derived>
+class fan_in {
+    struct slot : future_callback {
+        Derived* owner;
+        size_t index;
+
+        virtual void ready() override {
+            owner->arrived(index);
+        }
+    };
+
+    vector<slot> m_slots;
+
+protected:
+    vector<future_state<T>*> m_sources;
+
+    ~fan_in() {
+        for (future_state<T>* source : m_sources) {
+            source->release();
+        }
+    }
+
+    // Once the sources are in place; arrived() may run before this returns
+    void attach(Derived* owner) {
+        m_slots.resize(m_sources.size());
+        for (size_t i = 0; i < m_sources.size(); ++i) {
+            m_slots[i].owner = owner;
+            m_slots[i].index = i;
+            if (!m_sources[i]->set_callback(&m_slots[i])) {
+                owner->arrived(i);
+            }
+        }
+    }
+};
+
+// Completes when every source has; fails with the first error in input order
+template<class T>
+class when_all_state : public future_state<typename when_all_value<T>::type>,
+                       public fan_in<T, when_all_state<T>> {
+    friend class fan_in<T, when_all_state<T>>;
+
+    atomic<size_t> m_remaining;
+
+    void collect(false_type) {
+        vector<T> values;
+        values.reserve(this->m_sources.size());
+        for (future_state<T>* source : this->m_sources) {
+            values.push_back(source->take());
+        }
+        this->set_value(std::move(values));
+    }
+
+    void collect(true_type) {
+        this->set_value();
+    }
+
+    void arrived(size_t) {
+        if (m_remaining.fetch_sub(1, memory_order_acq_rel) != 1) {
+            return;
+        }
+        exception_ptr error;
+        for (future_state<T>* source : this->m_sources) {
+            if (!error) {
+                error = source->error();
+            }
+        }
+        if (error) {
+            this->fail(error);
+        } else {
+            collect(is_void<T>());
+        }
+        this->release();
+    }
+
+public:
+    // Holds one reference for the future and one until the last source arrives
+    explicit when_all_state(vector<future_state<T>*>&& sources) :
+        future_state<typename when_all_value<T>::type>(2),
+        m_remaining(sources.size() + 1) {
+        this->m_sources = std::move(sources);
+        this->attach(this);
+        arrived(0);
+    }
+};
+
+// Completes with the first source to finish, value or error; the rest only keep it alive
+template<class T>
+class when_any_state : public future_state<when_any_result<T>>,
+                       public fan_in<T, when_any_state<T>> {
+    friend class fan_in<T, when_any_state<T>>;
+
+    atomic<bool> m_decided;
+    atomic<size_t> m_remaining;
+
+    when_any_result<T> result(size_t index, false_type) {
+        when_any_result<T> r = { index, this->m_sources[index]->take() };
+        return r;
+    }
+
+    when_any_result<T> result(size_t index, true_type) {
+        when_any_result<T> r = { index };
+        return r;
+    }
+
+    void arrived(size_t index) {
+        if (!m_decided.exchange(true, memory_order_acq_rel)) {
+            if (exception_ptr error = this->m_sources[index]->error()) {
+                this->fail(error);
+            } else {
+                this->set_value(result(index, is_void<T>()));
+            }
+        }
+        if (m_remaining.fetch_sub(1, memory_order_acq_rel) == 1) {
+            this->release();
+        }
+    }
+
+public:
+    explicit when_any_state(vector<future_state<T>*>&& sources) :
+        future_state<when_any_result<T>>(2),
+        m_decided(false),
+        m_remaining(sources.size()) {
+        this->m_sources = std::move(sources);
+        this->attach(this);
+    }
+};
+
+#if EXTR_COROUTINES
+// co_await on a task_future: the coroutine resumes on the thread that completes the result
+template<class T>
+class future_awaiter : public future_callback {
+    future_state<T>* m_state;
+    coroutine_handle<> m_handle;
+
+public:
+    explicit future_awaiter(future_state<T>* state) : m_state(state) {}
+
+    future_awaiter(future_awaiter&& other) noexcept : m_state(std::exchange(other.m_state, nullptr)) {}
+
+    ~future_awaiter() {
+        if (m_state) {
+            m_state->release();
+        }
+    }
+
+    bool await_ready() const {
+        return m_state->is_ready();
+    }
+
+    // Once the callback is set the coroutine may resume elsewhere, so nothing runs after it
+    bool await_suspend(coroutine_handle<> handle) {
+        m_handle = handle;
+        return m_state->set_callback(this);
+    }
+
+    T await_resume() {
+        m_state->rethrow_if_failed();
+        return m_state->take();
+    }
+
+    virtual void ready() override {
+        m_handle.resume();
+    }
+};
+
+// Eagerly started frame that runs a spawned task to completion and then frees itself
+struct spawned_coroutine {
+    struct promise_type : details::pooled_frame {
+        spawned_coroutine get_return_object() const noexcept {
+            return {};
+        }
+
+        suspend_never initial_suspend() const noexcept {
+            return {};
+        }
+
+        suspend_never final_suspend() const noexcept {
+            return {};
+        }
+
+        void return_void() const noexcept {}
+
+        void unhandled_exception() const noexcept {
+            terminate();
+        }
+    };
+};
+
+template<class Executor, class T>
+spawned_coroutine run_spawned(Executor& executor, task<T> work, future_state<T>* state) {
+    co_await schedule_on(executor);
+    try {
+        if constexpr (is_void<T>::value) {
+            co_await work;
+            state->set_value();
+        } else {
+            state->set_value(co_await work);
+        }
+    } catch (...) {
+        state->fail(current_exception());
+    }
+    state->release();
+}
+#endif
+
+template<class Executor, class Func>
+typename future_of<Func>::type add_with_result(Executor& executor, Func&& f) {
+    typedef typename decay<Func>::type function_type;
+    typedef typename result_of<function_type()>::type result_type;
+    task_state<result_type, function_type>* state = new task_state<result_type, function_type>(2, std::forward<Func>(f));
+    task_future<result_type> future(state);
+    executor.add(state_runner(state));
+    return future;
+}
+
+}
+
+/* Result of add_with_result(f) or then(). Move-only, one consumer: get() and then() use the
+   result up. A whole chain is built without blocking; get() parks the caller only as a last
+   resort. Named to stay clear of std::future, which "using namespace std" brings in. */
+template<class T>
+class task_future {
+    template<class U>
+    friend class task_future;
+    template<class Executor, class Func>
+    friend typename detail::future_of<Func>::type detail::add_with_result(Executor&, Func&&);
+    template<class Iterator>
+    friend task_future<typename detail::when_all_value<typename iterator_traits<Iterator>::value_type::value_type>::type>
+        when_all(Iterator, Iterator);
+    template<class Iterator>
+    friend task_future<when_any_result<typename iterator_traits<Iterator>::value_type::value_type>>
+        when_any(Iterator, Iterator);
+
+#if EXTR_COROUTINES
+    template<class Executor, class U>
+    friend task_future<U> spawn(Executor&, task<U>);
+#endif
+
+    detail::future_state<T>* m_state;
+
+    explicit task_future(detail::future_state<T>* state) : m_state(state) {}
+
+    detail::future_state<T>* detach() {
+        assert(m_state);
+        detail::future_state<T>* state = m_state;
+        m_state = nullptr;
+        return state;
+    }
+
+public:
+    typedef T value_type;
+
+    task_future() : m_state(nullptr) {}
+
+    task_future(task_future&& other) noexcept : m_state(other.m_state) {
+        other.m_state = nullptr;
+    }
+
+    task_future& operator=(task_future&& other) noexcept {
+        if (this != &other) {
+            if (m_state) {
+                m_state->release();
+            }
+            m_state = other.m_state;
+            other.m_state = nullptr;
+        }
+        return *this;
+    }
+
+    ~task_future() {
+        if (m_state) {
+            m_state->release();
+        }
+    }
+
+    bool valid() const {
+        return m_state != nullptr;
+    }
+
+    bool is_ready() const {
+        assert(m_state);
+        return m_state->is_ready();
+    }
+
+    void wait() const {
+        assert(m_state);
+        m_state->wait();
+    }
+
+    // Blocks until the result is in, then returns it or rethrows the task's exception
+    T get() {
+        assert(m_state);
+        m_state->wait();
+        struct releaser {
+            detail::future_state<T>* state;
+            ~releaser() { state->release(); }
+        } release = { detach() };
+        release.state->rethrow_if_failed();
+        return release.state->take();
+    }
+
+    /* Runs g(value) (g() for void) on 'executor' once the result is in; an error skips g and
+       reaches the returned future. The executor must outlive the stage. */
+    template<class Executor, class G>
+    task_future<typename detail::continuation_result<T, typename decay<G>::type>::type> then(Executor& executor, G&& g) {
+        typedef typename decay<G>::type function_type;
+        // The source reference moves into the stage, which releases it once g has run
+        detail::future_state<T>* source = detach();
+        detail::continuation_state<Executor, T, function_type>* stage =
+            new detail::continuation_state<Executor, T, function_type>(executor, source, std::forward<G>(g));
+        task_future<typename detail::continuation_result<T, function_type>::type> next(stage);
+        if (!source->set_callback(stage)) {
+            stage->ready();
+        }
+        return next;
+    }
+
+#if EXTR_COROUTINES
+    // co_await std::move(f) suspends until the result is in; the future is used up
+    detail::future_awaiter<T> operator co_await() && {
+        return detail::future_awaiter<T>(detach());
+    }
+#endif
+};
+
+#if EXTR_COROUTINES
+// Starts 'work' as a task on 'executor'; the returned future gets its result
+template<class Executor, class T>
+task_future<T> spawn(Executor& executor, task<T> work) {
+    detail::future_state<T>* state = new detail::future_state<T>(2);
+    task_future<T> future(state);
+    detail::run_spawned(executor, std::move(work), state);
+    return future;
+}
+#endif
+
+// Future of every value in input order (nothing for void); takes the futures in [first, last)
+template<class Iterator>
+task_future<typename detail::when_all_value<typename iterator_traits<Iterator>::value_type::value_type>::type>
+when_all(Iterator first, Iterator last) {
+    typedef typename iterator_traits<Iterator>::value_type::value_type value_type;
+    vector<detail::future_state<value_type>*> sources;
+    for (; first != last; ++first) {
+        sources.push_back(first->detach());
+    }
+    return task_future<typename detail::when_all_value<value_type>::type>(
+        new detail::when_all_state<value_type>(std::move(sources)));
+}
+
+// Future of whichever input finishes first; takes the futures in [first, last), which must not be empty
+template<class Iterator>
+task_future<when_any_result<typename iterator_traits<Iterator>::value_type::value_type>>
+when_any(Iterator first, Iterator last) {
+    typedef typename iterator_traits<Iterator>::value_type::value_type value_type;
+    if (first == last) {
+        throw invalid_argument("when_any needs at least one future");
+    }
+    vector<detail::future_state<value_type>*> sources;
+    for (; first != last; ++first) {
+        sources.push_back(first->detach());
+    }
+    return task_future<when_any_result<value_type>>(new detail::when_any_state<value_type>(std::move(sources)));
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef TASK_GROUP
+#define TASK_GROUP
+
+#include "executor.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+/* Fork-join over a thread_pool: run() adds closures to the pool, wait() returns once all of them
+   have finished. Waiting on one of the pool's workers runs queued tasks of the pool there in the
+   meantime, its own deque first, so nested groups need no more workers than the pool has.
+   Completion is one atomic counter; only the last closure to finish takes the lock, to wake a
+   waiter that ran out of tasks to help with. A closure the pool destroys without running it,
+   e.g. in a shutdown, counts as failed with broken_promise, so waiting never hangs on it. */
+class task_group {
+private:
+    template<class Func>
+    class member {
+    public:
+        template<class F>
+        member(task_group* group, F&& closure) : m_group(group), m_fnc(std::forward<F>(closure)) {}
+
+        member(member&& other) noexcept(is_nothrow_move_constructible<Func>::value) :
+            m_group(other.m_group), m_fnc(std::move(other.m_fnc)) {
+            other.m_group = nullptr;
+        }
+
+        ~member() {
+            if (m_group) {
+                m_group->fail(make_exception_ptr(future_error(future_errc::broken_promise)));
+                m_group->finish();
+            }
+        }
+
+        void operator()() {
+            task_group* group = m_group;
+            m_group = nullptr;
+            try {
+                m_fnc();
+            } catch (...) {
+                group->fail(current_exception());
+            }
+            group->finish();
+        }
+
+    private:
+        member(member const&);
+        member& operator=(member const&);
+
+        task_group* m_group;
+        Func m_fnc;
+    };
+
+    // How often a waiter on the pool looks again for tasks queued after it ran out
+    enum : unsigned { help_interval_us = 500 };
+
+    thread_pool& m_pool;
+    atomic<size_t> m_pending;
+    atomic<bool> m_failed;
+    exception_ptr m_error;          // The first closure's exception; written by the one that set m_failed
+    mutex m_lock;
+    condition_variable m_done;
+
+    task_group(task_group const &);
+    task_group & operator=(task_group const &);
+
+    void fail(exception_ptr error) {
+        bool failed = false;
+        if (m_failed.compare_exchange_strong(failed, true, memory_order_relaxed)) {
+            m_error = error;
+        }
+    }
+
+    void finish() {
+        size_t n = m_pending.load(memory_order_relaxed);
+        while (n > 1) {
+            if (m_pending.compare_exchange_weak(n, n - 1, memory_order_acq_rel, memory_order_relaxed)) {
+                return;
+            }
+        }
+        // The last one goes under the lock so the group cannot be destroyed while we still touch it
+        lock_guard<mutex> lk(m_lock);
+        if (m_pending.fetch_sub(1, memory_order_acq_rel) == 1) {
+            m_done.notify_all();
+        }
+    }
+
+    void join() {
+        auto done = [this] { return m_pending.load(memory_order_acquire) == 0; };
+        if (!m_pool.running_in_this_thread()) {
+            unique_lock<mutex> lk(m_lock);
+            m_done.wait(lk, done);
+            return;
+        }
+        while (!done()) {
+            if (m_pool.try_run_one()) {
+                continue;
+            }
+            /* What is left runs on other threads, and may queue more for us to help with; the
+               pool may bring in a stand-in meanwhile */
+            blocking_region hint;
+            unique_lock<mutex> lk(m_lock);
+            m_done.wait_for(lk, chrono::microseconds(help_interval_us), done);
+        }
+        // The last closure may still be inside finish()
+        lock_guard<mutex> lk(m_lock);
+    }
+
+public:
+    explicit task_group(thread_pool& pool) : m_pool(pool), m_pending(0), m_failed(false) {}
+
+    ~task_group() {
+        join();
+    }
+
+    // Runs closure on the calling thread instead when the pool's queue is at its capacity
+    template<class Func>
+    void run(Func&& closure) {
+        m_pending.fetch_add(1, memory_order_relaxed);
+        member<typename decay<Func>::type> task(this, std::forward<Func>(closure));
+        if (!m_pool.try_add(std::move(task))) {
+            task();
+        }
+    }
+
+    // Waits for every closure run so far, then rethrows the first exception one of them threw
+    void wait() {
+        join();
+        if (m_failed.load(memory_order_relaxed)) {
+            exception_ptr error = m_error;
+            m_error = nullptr;
+            m_failed.store(false, memory_order_relaxed);
+            rethrow_exception(error);
+        }
+    }
+
+    // Closures run and not finished yet
+    size_t pending() const {
+        return m_pending.load(memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef TASK_NODE
+#define TASK_NODE
+
+#include "executor_metrics.h"
+#include "slab_allocator.h"
+#include "task_trace.h"
+#include "unique_task.h"
+
+namespace details {
+
+/* Heap record for one submitted closure; 'next' links it into intrusive queues and batches,
+   'enqueued' is the task_clock time it became runnable, 'holds_slot' says it took a slot of a
+   bounded queue that it gives back when it starts, 'trace' is its id in a task trace */
+struct task_node : slab_allocated {
+    task_node() : next(nullptr), enqueued(task_clock::now()), holds_slot(false) {}
+
+    template<class Func>
+    explicit task_node(Func&& closure) : next(nullptr), enqueued(task_clock::now()), holds_slot(false), fnc(std::forward<Func>(closure)) {}
+
+    task_node* next;
+    uint64_t enqueued;
+    bool holds_slot;
+    task_trace trace;
+    unique_task fnc;
+};
+
+}
+
+#endif
@@ -0,0 +1,490 @@
+#ifndef TASK_TRACE
+#define TASK_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Set to 1 to record task lifecycle events for tracing::write_chrome_json; 0 leaves no code behind
+#ifndef EXTR_TRACE
+#define EXTR_TRACE 0
+#endif
+
+// Events each thread keeps before it overwrites its oldest; a power of two
+#ifndef EXTR_TRACE_EVENTS
+#define EXTR_TRACE_EVENTS 8192
+#endif
+
+#if EXTR_TRACE
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define EXTR_TRACE_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define EXTR_TRACE_TSC 1
+#else
+#define EXTR_TRACE_TSC 0
+#endif
+#endif
+
+using namespace std;
+
+namespace details {
+
+enum class trace_kind : uint32_t { submit, start, finish, steal, timer };
+
+#if EXTR_TRACE
+
+/* Events of one thread. The thread is the only writer: it fills the next slot with relaxed
+   stores and publishes it by bumping 'written'. A reader copies the last 'capacity' slots and
+   then drops those the writer may have overwritten meanwhile, so neither side ever waits. */
+class trace_ring {
+public:
+    enum : uint64_t { capacity = EXTR_TRACE_EVENTS };
+
+    struct event {
+        atomic<uint64_t> ts;
+        atomic<uint64_t> id;
+        atomic<void const*> executor;
+        atomic<uint32_t> kind;
+    };
+
+    struct snapshot {
+        uint64_t ts;
+        uint64_t id;
+        void const* executor;
+        trace_kind kind;
+    };
+
+    explicit trace_ring(uint32_t thread_index) : index(thread_index), next_id(0), written(0), cleared(0) {}
+
+    uint32_t const index;
+    uint64_t next_id;           // Writer only; with 'index' makes task ids unique without sharing a counter
+    atomic<uint64_t> written;
+    atomic<uint64_t> cleared;   // Events before this one were thrown away by tracing::clear
+
+    void push(trace_kind kind, void const* executor, uint64_t id, uint64_t ts) {
+        uint64_t n = written.load(memory_order_relaxed);
+        event& e = events[n & (capacity - 1)];
+        e.ts.store(ts, memory_order_relaxed);
+        e.id.store(id, memory_order_relaxed);
+        e.executor.store(executor, memory_order_relaxed);
+        e.kind.store(static_cast<uint32_t>(kind), memory_order_relaxed);
+        written.store(n + 1, memory_order_release);
+    }
+
+    void read(vector<snapshot>& out) const {
+        uint64_t end = written.load(memory_order_acquire);
+        uint64_t begin = end > capacity ? end - capacity : 0;
+        uint64_t floor = cleared.load(memory_order_relaxed);
+        begin = begin > floor ? begin : floor;
+        size_t first = out.size();
+        for (uint64_t n = begin; n < end; ++n) {
+            event const& e = events[n & (capacity - 1)];
+            snapshot s = { e.ts.load(memory_order_relaxed), e.id.load(memory_order_relaxed),
+                e.executor.load(memory_order_relaxed), static_cast<trace_kind>(e.kind.load(memory_order_relaxed)) };
+            out.push_back(s);
+        }
+        // Slots the writer reached while we copied hold newer events than we think
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t now = written.load(memory_order_relaxed);
+        uint64_t overwritten = now > capacity ? now - capacity : 0;
+        if (overwritten > begin) {
+            size_t lost = static_cast<size_t>(overwritten - begin < end - begin ? overwritten - begin : end - begin);
+            out.erase(out.begin() + first, out.begin() + first + lost);
+        }
+    }
+
+private:
+    event events[capacity];
+};
+
+/* Rings of every thread that recorded an event, names given to executors and the clock base
+   of the trace. Rings are never freed: a thread that exits hands its ring to the next thread
+   that starts recording, so short-lived threads do not pile up rings and a dump still shows
+   what they did. */
+class trace_log {
+    mutex m_lock;
+    vector<trace_ring*> m_rings;
+    vector<trace_ring*> m_idle;
+    map<void const*, string> m_names;
+    atomic<bool> m_enabled;
+    uint64_t m_base_ticks;      // Timestamp and steady_clock at the first start(), for calibration
+    uint64_t m_base_ns;
+
+    trace_log() : m_enabled(false), m_base_ticks(0), m_base_ns(0) {}
+
+    static trace_ring*& this_thread_ring() {
+        static thread_local trace_ring* ring = nullptr;
+        return ring;
+    }
+
+    static bool& thread_exited() {
+        static thread_local bool exited = false;
+        return exited;
+    }
+
+    struct thread_exit {
+        ~thread_exit() {
+            trace_ring* ring = this_thread_ring();
+            this_thread_ring() = nullptr;
+            thread_exited() = true;
+            if (ring) {
+                trace_log& log = instance();
+                lock_guard<mutex> lk(log.m_lock);
+                log.m_idle.push_back(ring);
+            }
+        }
+    };
+
+public:
+    // Never destroyed: threads may record while statics are destroyed
+    static trace_log& instance() {
+        static trace_log* log = new trace_log();
+        return *log;
+    }
+
+    static uint64_t steady_ns() {
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // The TSC where there is one: a register read instead of a clock call
+    static uint64_t timestamp() {
+#if EXTR_TRACE_TSC
+        return __rdtsc();
+#else
+        return steady_ns();
+#endif
+    }
+
+    // nullptr once the thread's own thread_local destructors ran
+    static trace_ring* ring() {
+        trace_ring* r = this_thread_ring();
+        if (r || thread_exited()) {
+            return r;
+        }
+        static thread_local thread_exit on_exit;
+        (void)on_exit;
+        trace_log& log = instance();
+        {
+            lock_guard<mutex> lk(log.m_lock);
+            if (!log.m_idle.empty()) {
+                r = log.m_idle.back();
+                log.m_idle.pop_back();
+            } else {
+                r = new trace_ring(static_cast<uint32_t>(log.m_rings.size() + 1));
+                log.m_rings.push_back(r);
+            }
+        }
+        this_thread_ring() = r;
+        return r;
+    }
+
+    bool enabled() const {
+        return m_enabled.load(memory_order_relaxed);
+    }
+
+    void enable(bool on) {
+        if (on) {
+            lock_guard<mutex> lk(m_lock);
+            if (!m_base_ns) {
+                m_base_ticks = timestamp();
+                m_base_ns = steady_ns();
+            }
+        }
+        m_enabled.store(on, memory_order_relaxed);
+    }
+
+    void clear() {
+        lock_guard<mutex> lk(m_lock);
+        for (size_t i = 0; i < m_rings.size(); ++i) {
+            m_rings[i]->cleared.store(m_rings[i]->written.load(memory_order_acquire), memory_order_relaxed);
+        }
+    }
+
+    void name(void const* executor, string const& executor_name) {
+        lock_guard<mutex> lk(m_lock);
+        m_names[executor] = executor_name;
+    }
+
+    void forget(void const* executor) {
+        lock_guard<mutex> lk(m_lock);
+        m_names.erase(executor);
+    }
+
+    // A new task id, or 0 when nothing is recorded
+    static uint64_t submit(void const* executor) {
+        if (!instance().enabled()) {
+            return 0;
+        }
+        trace_ring* r = ring();
+        if (!r) {
+            return 0;
+        }
+        uint64_t id = (static_cast<uint64_t>(r->index) << 40) | ++r->next_id;
+        r->push(trace_kind::submit, executor, id, timestamp());
+        return id;
+    }
+
+    static void record(trace_kind kind, void const* executor, uint64_t id) {
+        if (!instance().enabled()) {
+            return;
+        }
+        if (trace_ring* r = ring()) {
+            r->push(kind, executor, id, timestamp());
+        }
+    }
+
+    void write_chrome_json(ostream& out);
+};
+
+#endif
+
+/* Trace id of one task record, given when it is submitted and reported with each event of its
+   life. An empty struct unless EXTR_TRACE, where every call compiles to nothing. */
+struct task_trace {
+#if EXTR_TRACE
+    task_trace() : id(0) {}
+
+    uint64_t id;
+#endif
+
+    // A record that already has an id, e.g. a timed task handed on once due, keeps it
+    void submitted(void const* executor) {
+#if EXTR_TRACE
+        if (!id) {
+            id = trace_log::submit(executor);
+        }
+#else
+        (void)executor;
+#endif
+    }
+
+    void started(void const* executor) const {
+        record(trace_kind::start, executor);
+    }
+
+    void finished(void const* executor) const {
+        record(trace_kind::finish, executor);
+    }
+
+    void stolen(void const* executor) const {
+        record(trace_kind::steal, executor);
+    }
+
+    void fired(void const* executor) const {
+        record(trace_kind::timer, executor);
+    }
+
+private:
+    void record(trace_kind kind, void const* executor) const {
+#if EXTR_TRACE
+        if (id) {
+            trace_log::record(kind, executor, id);
+        }
+#else
+        (void)executor;
+        (void)kind;
+#endif
+    }
+};
+
+#if EXTR_TRACE
+
+inline void write_json_string(ostream& out, string const& s) {
+    out << '"';
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+/* Every executor becomes a process of its own, named after it, and every recording thread a
+   thread within it, so a pool's workers and the strands they drain show as separate tracks.
+   A task's submit, the timer that made it due and its run are joined by a flow arrow. */
+inline void trace_log::write_chrome_json(ostream& out) {
+    vector<trace_ring::snapshot> events;
+    vector<uint32_t> threads;
+    map<void const*, string> names;
+    uint64_t base_ticks;
+    uint64_t base_ns;
+    {
+        lock_guard<mutex> lk(m_lock);
+        for (size_t i = 0; i < m_rings.size(); ++i) {
+            m_rings[i]->read(events);
+            threads.resize(events.size(), m_rings[i]->index);
+        }
+        names = m_names;
+        base_ticks = m_base_ticks;
+        base_ns = m_base_ns;
+    }
+
+    // Timestamp ticks per nanosecond, measured over the whole trace and at least a millisecond
+    double ticks_per_ns = 1.0;
+#if EXTR_TRACE_TSC
+    if (base_ns) {
+        uint64_t now_ns = steady_ns();
+        while (now_ns - base_ns < 1000000) {
+            now_ns = steady_ns();
+        }
+        ticks_per_ns = static_cast<double>(timestamp() - base_ticks) / static_cast<double>(now_ns - base_ns);
+    }
+#endif
+
+    // Executors are numbered in the order they first appear
+    map<void const*, size_t> pids;
+    map<pair<size_t, uint32_t>, bool> tracks;
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (pids.find(events[i].executor) == pids.end()) {
+            size_t pid = pids.size() + 1;
+            pids[events[i].executor] = pid;
+        }
+    }
+
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    char line[256];
+    for (map<void const*, size_t>::const_iterator p = pids.begin(); p != pids.end(); ++p) {
+        map<void const*, string>::const_iterator n = names.find(p->first);
+        char fallback[32];
+        snprintf(fallback, sizeof(fallback), "executor %u", static_cast<unsigned>(p->second));
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << p->second << ",\"args\":{\"name\":";
+        write_json_string(out, n != names.end() ? n->second : string(fallback));
+        out << "}}";
+    }
+    for (size_t i = 0; i < events.size(); ++i) {
+        trace_ring::snapshot const& e = events[i];
+        size_t pid = pids[e.executor];
+        uint32_t tid = threads[i];
+        if (!tracks[make_pair(pid, tid)]) {
+            tracks[make_pair(pid, tid)] = true;
+            snprintf(line, sizeof(line), ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                static_cast<unsigned>(pid), tid, tid);
+            out << (first ? line + 1 : line);
+            first = false;
+        }
+        double ts = e.ts > base_ticks ? static_cast<double>(e.ts - base_ticks) / ticks_per_ns / 1000.0 : 0.0;
+        unsigned long long id = static_cast<unsigned long long>(e.id);
+        const char* sep = first ? "\n" : ",\n";
+        first = false;
+        switch (e.kind) {
+        case trace_kind::submit:
+            snprintf(line, sizeof(line), "%s{\"ph\":\"X\",\"name\":\"submit\",\"cat\":\"task\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":0,\"args\":{\"id\":\"0x%llx\"}}",
+                sep, static_cast<unsigned>(pid), tid, ts, id);
+            out << line;
+            snprintf(line, sizeof(line), ",\n{\"ph\":\"s\",\"name\":\"task\",\"cat\":\"task\",\"id\":\"0x%llx\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                id, static_cast<unsigned>(pid), tid, ts);
+            break;
+        case trace_kind::timer:
+            snprintf(line, sizeof(line), "%s{\"ph\":\"X\",\"name\":\"timer\",\"cat\":\"task\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":0,\"args\":{\"id\":\"0x%llx\"}}",
+                sep, static_cast<unsigned>(pid), tid, ts, id);
+            out << line;
+            snprintf(line, sizeof(line), ",\n{\"ph\":\"t\",\"name\":\"task\",\"cat\":\"task\",\"id\":\"0x%llx\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                id, static_cast<unsigned>(pid), tid, ts);
+            break;
+        case trace_kind::start:
+            snprintf(line, sizeof(line), "%s{\"ph\":\"B\",\"name\":\"run\",\"cat\":\"task\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"args\":{\"id\":\"0x%llx\"}}",
+                sep, static_cast<unsigned>(pid), tid, ts, id);
+            out << line;
+            snprintf(line, sizeof(line), ",\n{\"ph\":\"f\",\"bp\":\"e\",\"name\":\"task\",\"cat\":\"task\",\"id\":\"0x%llx\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                id, static_cast<unsigned>(pid), tid, ts);
+            break;
+        case trace_kind::finish:
+            snprintf(line, sizeof(line), "%s{\"ph\":\"E\",\"name\":\"run\",\"cat\":\"task\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                sep, static_cast<unsigned>(pid), tid, ts);
+            break;
+        case trace_kind::steal:
+            snprintf(line, sizeof(line), "%s{\"ph\":\"i\",\"s\":\"t\",\"name\":\"steal\",\"cat\":\"task\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"args\":{\"id\":\"0x%llx\"}}",
+                sep, static_cast<unsigned>(pid), tid, ts, id);
+            break;
+        }
+        out << line;
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+#endif
+
+}
+
+/* Process-wide switch and output of the task trace. Only does something in builds with
+   EXTR_TRACE=1: executors then record when each task is submitted, becomes due, is stolen,
+   starts and finishes, into a ring per thread. Name executors with their set_trace_name. */
+class tracing {
+public:
+    static void start() {
+#if EXTR_TRACE
+        details::trace_log::instance().enable(true);
+#endif
+    }
+
+    static void stop() {
+#if EXTR_TRACE
+        details::trace_log::instance().enable(false);
+#endif
+    }
+
+    static bool active() {
+#if EXTR_TRACE
+        return details::trace_log::instance().enabled();
+#else
+        return false;
+#endif
+    }
+
+    // Forgets the events recorded so far
+    static void clear() {
+#if EXTR_TRACE
+        details::trace_log::instance().clear();
+#endif
+    }
+
+    /* Chrome trace-event JSON, for chrome://tracing or ui.perfetto.dev. Safe while executors are
+       running; events recorded during the call may or may not be included. */
+    static void write_chrome_json(ostream& out) {
+#if EXTR_TRACE
+        details::trace_log::instance().write_chrome_json(out);
+#else
+        out << "{\"traceEvents\":[],\"displayTimeUnit\":\"ns\"}\n";
+#endif
+    }
+
+    // Used by the executors' set_trace_name
+    static void name(void const* executor, string const& executor_name) {
+#if EXTR_TRACE
+        details::trace_log::instance().name(executor, executor_name);
+#else
+        (void)executor;
+        (void)executor_name;
+#endif
+    }
+
+    // Drops the name; called by an executor's destructor, before its address can be reused
+    static void forget(void const* executor) {
+#if EXTR_TRACE
+        details::trace_log::instance().forget(executor);
+#else
+        (void)executor;
+#endif
+    }
+};
+
+#endif
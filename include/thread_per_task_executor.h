@@ -2,15 +2,247 @@
 #define THREAD_EXECUTOR
 
 #include "executor.h"
-#include <vector>
-#include <thread>
+#include "executor_metrics.h"
+#include "platform_thread.h"
+#include "task_node.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <mutex>
 
 using namespace std;
 
+struct thread_per_task_options {
+    thread_per_task_options() :
+        max_threads(numeric_limits<size_t>::max()),
+        max_queued(numeric_limits<size_t>::max()),
+        keep_alive(chrono::seconds(10)),
+        stack_size(0) {}
+
+    size_t max_threads;             // Threads running tasks at once
+    size_t max_queued;              // Tasks waiting for a thread at the cap before add blocks
+    chrono::nanoseconds keep_alive; // How long a thread with nothing to run waits before exiting
+    size_t stack_size;              // 0 keeps the platform default
+};
+
+namespace details {
+
+/* Threads are detached and exit on their own after keep_alive without work, so nothing piles
+   up waiting to be joined. A task goes to an idle thread when there is one, otherwise straight
+   to a new thread while under max_threads, otherwise to the overflow queue. Every thread holds
+   a reference to this state, so the last one to leave may outlive the executor. */
+class thread_per_task_state : public enable_shared_from_this<thread_per_task_state> {
+    thread_per_task_options m_options;
+
+    mutex m_lock;
+    condition_variable m_work;      // Idle threads
+    condition_variable m_space;     // Producers blocked on a full overflow queue
+    condition_variable m_done;      // Shutdown waiting for tasks and threads
+    task_node* m_head;
+    task_node* m_tail;
+    size_t m_queued;
+    size_t m_running;
+    size_t m_threads;
+    size_t m_idle;
+    size_t m_signalled;             // Idle threads woken for a task that have not picked it up yet
+    bool m_stopping;
+
+    shared_task_counters m_counters;
+
+    thread_per_task_state(thread_per_task_state const &);
+    thread_per_task_state & operator=(thread_per_task_state const &);
+
+    task_node* pop_locked() {
+        task_node* t = m_head;
+        if (t) {
+            m_head = t->next;
+            if (!m_head) {
+                m_tail = nullptr;
+            }
+            t->next = nullptr;
+            --m_queued;
+        }
+        return t;
+    }
+
+    // Threads that can take a task right now without it waiting in the overflow queue
+    size_t available_locked() const {
+        size_t spare = m_options.max_threads > m_threads ? m_options.max_threads - m_threads : 0;
+        return m_idle - m_signalled + spare;
+    }
+
+    // What a new thread starts with: the task it was started for, already counted as running
+    struct thread_start {
+        shared_ptr<thread_per_task_state> state;
+        task_node* first;
+    };
+
+    static void thread_main(void* context) {
+        thread_start* start = static_cast<thread_start*>(context);
+        shared_ptr<thread_per_task_state> state(std::move(start->state));
+        task_node* first = start->first;
+        delete start;
+        state->worker_loop(first);
+    }
+
+    // Called with m_lock held and t counted in m_running; returns with the lock held again
+    void run_locked(unique_lock<mutex>& lk, task_node* t) {
+        lk.unlock();
+        m_space.notify_one();
+        uint64_t started = task_clock::now();
+        t->trace.started(this);
+        t->fnc();
+        t->trace.finished(this);
+        m_counters.task_done(t->enqueued, started, task_clock::now());
+        delete t;
+        lk.lock();
+        --m_running;
+    }
+
+    void worker_loop(task_node* first) {
+        unique_lock<mutex> lk(m_lock);
+        run_locked(lk, first);
+        for (;;) {
+            while (task_node* t = pop_locked()) {
+                ++m_running;
+                run_locked(lk, t);
+            }
+            if (m_stopping) {
+                break;
+            }
+            m_done.notify_all();
+
+            ++m_idle;
+            uint64_t idle_since = task_clock::now();
+            bool woken = m_work.wait_for(lk, m_options.keep_alive, [this] { return m_signalled > 0 || m_stopping; });
+            m_counters.idle_for(task_clock::now() - idle_since);
+            --m_idle;
+            if (!woken || m_stopping) {
+                break;
+            }
+            --m_signalled;
+        }
+        --m_threads;
+        m_done.notify_all();
+    }
+
+    /* t was never queued, so when no thread can be started it is simply dropped and the error
+       goes to the caller, whether or not other threads are alive */
+    void start_thread(task_node* t) {
+        thread_start* context = new thread_start{ shared_from_this(), t };
+        try {
+            start_detached_thread(m_options.stack_size, &thread_main, context);
+        } catch (...) {
+            delete context;
+            {
+                lock_guard<mutex> lk(m_lock);
+                --m_threads;
+                --m_running;
+            }
+            m_space.notify_all();
+            m_done.notify_all();
+            delete t;
+            throw;
+        }
+    }
+
+public:
+    explicit thread_per_task_state(thread_per_task_options const& options) :
+        m_options(options),
+        m_head(nullptr),
+        m_tail(nullptr),
+        m_queued(0),
+        m_running(0),
+        m_threads(0),
+        m_idle(0),
+        m_signalled(0),
+        m_stopping(false) {}
+
+    ~thread_per_task_state() {
+        while (task_node* t = pop_locked()) {
+            delete t;
+        }
+        tracing::forget(this);
+    }
+
+    // Runs every queued task, then retires all threads
+    void shutdown() {
+        unique_lock<mutex> lk(m_lock);
+        m_done.wait(lk, [this] { return m_queued == 0 && m_running == 0; });
+        m_stopping = true;
+        m_work.notify_all();
+        m_done.wait(lk, [this] { return m_threads == 0; });
+    }
+
+    template<class Func>
+    void submit(Func&& closure) {
+        task_node* t = new task_node(std::forward<Func>(closure));
+        t->trace.submitted(this);
+        bool spawn = false;
+        {
+            unique_lock<mutex> lk(m_lock);
+            m_space.wait(lk, [this] {
+                size_t available = available_locked();
+                return m_queued < available || m_queued - available < m_options.max_queued;
+            });
+            t->enqueued = task_clock::now();
+            if (m_idle <= m_signalled && m_threads < m_options.max_threads) {
+                ++m_threads;
+                ++m_running;
+                spawn = true;
+            } else {
+                if (m_tail) {
+                    m_tail->next = t;
+                } else {
+                    m_head = t;
+                }
+                m_tail = t;
+                ++m_queued;
+                if (m_idle > m_signalled) {
+                    ++m_signalled;
+                    m_work.notify_one();
+                }
+            }
+        }
+        if (spawn) {
+            start_thread(t);
+        }
+    }
+
+    size_t uninitiated_task_count() {
+        lock_guard<mutex> lk(m_lock);
+        return m_queued;
+    }
+
+    size_t thread_count() {
+        lock_guard<mutex> lk(m_lock);
+        return m_threads;
+    }
+
+    executor_metrics metrics() {
+        executor_metrics m;
+        {
+            lock_guard<mutex> lk(m_lock);
+            m.queued = m_queued;
+            m.running = m_running;
+            m.threads = m_threads;
+        }
+        m_counters.collect(m);
+        return m;
+    }
+};
+
+}
+
 class thread_per_task_executor {
 private:
-    vector<thread> thread_vec;
-    thread_per_task_executor() {}
+    shared_ptr<details::thread_per_task_state> m_state;
+
+    thread_per_task_executor(thread_per_task_executor const &);
+    thread_per_task_executor & operator=(thread_per_task_executor const &);
 public:
 
     static thread_per_task_executor& get_thread_per_task_executor()
@@ -19,22 +251,39 @@ public:
         return instance;
     }
 
+    explicit thread_per_task_executor(thread_per_task_options const& options = thread_per_task_options()) :
+        m_state(std::make_shared<details::thread_per_task_state>(options)) {}
+
+    // Waits for every added task to finish
     virtual ~thread_per_task_executor() {
-        for (thread& t : thread_vec) {
-            if (t.joinable())
-                t.join();
-        }
+        m_state->shutdown();
     }
 
+    /* Blocks while max_threads tasks run and max_queued more are waiting. Throws system_error
+       and drops the closure when it needs a new thread and none can be started. */
     template<class Func>
-    void add(Func closure) {
-        thread_vec.emplace_back(closure);
+    void add(Func&& closure) {
+        m_state->submit(std::forward<Func>(closure));
     }
 
+    // Tasks waiting for a thread
     virtual size_t uninitiated_task_count() const {
-        // TBD
-        return 0;
+        return m_state->uninitiated_task_count();
+    }
+
+    // Threads alive, running a task or idle within keep_alive
+    size_t thread_count() const {
+        return m_state->thread_count();
+    }
+
+    executor_metrics metrics() const {
+        return m_state->metrics();
+    }
+
+    // Names the executor in tracing::write_chrome_json
+    void set_trace_name(string const& name) {
+        tracing::name(m_state.get(), name);
     }
 };
 
-#endif
\ No newline at end of file
+#endif
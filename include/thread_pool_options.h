@@ -0,0 +1,37 @@
+#ifndef THREAD_POOL_OPTIONS
+#define THREAD_POOL_OPTIONS
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include "capacity_gate.h"
+
+using namespace std;
+
+/* How a thread_pool lays out its workers. Placement and keep_alive are implemented by the Linux
+   backend; GCD ignores everything but 'threads' and the Windows pool only takes the counts. */
+struct thread_pool_options {
+    thread_pool_options() :
+        threads(0),
+        min_threads(0),
+        max_threads(0),
+        keep_alive(chrono::seconds(60)),
+        pin(false),
+        numa(false),
+        capacity(0),
+        overflow(overflow_policy::reject) {}
+
+    int threads;        // 0: one worker per CPU, at least two; changed later with set_concurrency
+    int min_threads;    // Workers kept while idle; 0: 'threads', so the pool never shrinks
+    int max_threads;    // Cap including stand-ins for workers in a blocking_region; 0: 4 * 'threads'
+    chrono::nanoseconds keep_alive; // How long a worker above min_threads waits for work before exiting
+    bool pin;           // Pin every worker to a single CPU
+    bool numa;          // One worker group per NUMA node; tasks are stolen within the node first
+                        // and tasks added from outside the pool go to the caller's node
+    vector<int> cpus;   // CPUs to place workers on; empty for every CPU the process may use
+    size_t capacity;    // Tasks add() may queue before 'overflow' applies; 0: unbounded
+    overflow_policy overflow;
+};
+
+#endif
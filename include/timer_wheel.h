@@ -0,0 +1,693 @@
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "task_node.h"
+
+using namespace std;
+
+namespace details {
+
+// Relative delay on steady_clock, rounded up so a timer never fires early
+template<class Rep, class Period>
+chrono::steady_clock::duration to_steady_duration(const chrono::duration<Rep, Period>& rel_time) {
+    auto converted = chrono::duration_cast<chrono::steady_clock::duration>(rel_time);
+    if (converted < rel_time) {
+        ++converted;
+    }
+    return converted;
+}
+
+/* Deadline on steady_clock for a time point of any clock. Other clocks are converted once,
+   against their own now(), so later adjustments of e.g. system_clock do not move the timer. */
+template<class Clock, class Duration>
+chrono::steady_clock::time_point to_steady_time(const chrono::time_point<Clock, Duration>& abs_time) {
+    return chrono::steady_clock::now() + to_steady_duration(abs_time - Clock::now());
+}
+
+template<class Duration>
+chrono::steady_clock::time_point to_steady_time(const chrono::time_point<chrono::steady_clock, Duration>& abs_time) {
+    return chrono::steady_clock::time_point(to_steady_duration(abs_time.time_since_epoch()));
+}
+
+/* Anything that can receive due timed tasks. The target must outlive the timers it scheduled;
+   thread_pool guarantees that by counting them as unfinished work. */
+class timer_target {
+public:
+    // Takes ownership of 'count' tasks linked through task_node::next, in firing order
+    virtual void submit_timers(task_node* first, size_t count) = 0;
+
+    // Takes back a task whose timer was cancelled before it fell due
+    virtual void timer_cancelled(task_node* task) {
+        delete task;
+    }
+
+protected:
+    ~timer_target() {}
+};
+
+struct timer_link {
+    timer_link() : prev(this), next(this) {}
+
+    timer_link* prev;
+    timer_link* next;
+};
+
+/* One pending timer. The timer_service holds a reference until the timer fires or is cancelled,
+   each timer_handle holds another; the last one deletes the node. */
+struct timer_node : timer_link, slab_allocated {
+    // Where the timer_service keeps the node; guarded by its lock
+    enum : uint8_t { in_wheel, in_near, done };
+
+    timer_node(timer_target* owner, uint64_t deadline_ns, uint64_t when, task_node* closure) :
+        deadline(deadline_ns), tick(when), level(0), slot(0), state(in_wheel), heap_index(0), refs(1), target(owner), task(closure), due_next(nullptr) {}
+
+    void release() {
+        if (refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    uint64_t deadline;
+    uint64_t tick;
+    uint8_t level;
+    uint8_t slot;
+    uint8_t state;
+    uint32_t heap_index;
+    atomic<uint32_t> refs;
+    timer_target* target;
+    task_node* task;
+    timer_node* due_next;
+};
+
+// Nodes that reached their tick, linked through due_next
+struct timer_list {
+    timer_list() : head(nullptr), tail(nullptr) {}
+
+    void push_back(timer_node* n) {
+        n->due_next = nullptr;
+        if (tail) {
+            tail->due_next = n;
+        } else {
+            head = n;
+        }
+        tail = n;
+    }
+
+    timer_node* head;
+    timer_node* tail;
+};
+
+/* Hierarchical hashed timer wheel (Varghese & Lauck) with 'levels' wheels of 64 slots.
+   Level k holds timers due between 64^k and 64^(k+1) ticks from now and is cascaded into the
+   lower levels when its slot comes up. Insertion and removal are O(1); per-level occupancy
+   bitmaps let advance() jump straight to the next tick that has work instead of walking
+   every empty slot. Not thread safe. */
+class timer_wheel {
+public:
+    enum : unsigned { slot_bits = 6, slots = 1 << slot_bits, levels = 6 };
+
+private:
+    timer_link m_slots[levels][slots];
+    uint64_t m_occupied[levels];
+    uint64_t m_now;
+    size_t m_size;
+
+    timer_wheel(timer_wheel const &);
+    timer_wheel & operator=(timer_wheel const &);
+
+    static unsigned lowest_bit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<unsigned>(__builtin_ctzll(mask));
+#else
+        unsigned index = 0;
+        while (!(mask & 1)) {
+            mask >>= 1;
+            ++index;
+        }
+        return index;
+#endif
+    }
+
+    static uint64_t rotate_right(uint64_t mask, unsigned n) {
+        return (mask >> n) | (mask << ((slots - n) & (slots - 1)));
+    }
+
+    void link(timer_node* n, unsigned level, unsigned slot) {
+        timer_link& head = m_slots[level][slot];
+        n->level = static_cast<uint8_t>(level);
+        n->slot = static_cast<uint8_t>(slot);
+        n->prev = head.prev;
+        n->next = &head;
+        head.prev->next = n;
+        head.prev = n;
+        m_occupied[level] |= uint64_t(1) << slot;
+    }
+
+    void unlink(timer_node* n) {
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+        n->prev = n;
+        n->next = n;
+        timer_link& head = m_slots[n->level][n->slot];
+        if (head.next == &head) {
+            m_occupied[n->level] &= ~(uint64_t(1) << n->slot);
+        }
+    }
+
+    void place(timer_node* n, timer_list& due) {
+        if (n->tick <= m_now) {
+            --m_size;
+            due.push_back(n);
+            return;
+        }
+        // Timers beyond the top level's span park in the top level and are re-placed on cascade
+        uint64_t const span = uint64_t(1) << (slot_bits * levels);
+        uint64_t tick = n->tick - m_now < span ? n->tick : m_now + span - 1;
+        uint64_t delta = tick - m_now;
+        unsigned level = 0;
+        while (level + 1 < levels && delta >= (uint64_t(1) << (slot_bits * (level + 1)))) {
+            ++level;
+        }
+        link(n, level, static_cast<unsigned>(tick >> (slot_bits * level)) & (slots - 1));
+    }
+
+    void take_slot(unsigned level, unsigned slot, timer_list& out) {
+        timer_link& head = m_slots[level][slot];
+        while (head.next != &head) {
+            timer_node* n = static_cast<timer_node*>(head.next);
+            unlink(n);
+            out.push_back(n);
+        }
+    }
+
+    // Earliest tick after m_now at which a level 0 slot expires or a higher slot must cascade
+    uint64_t next_event() const {
+        uint64_t best = UINT64_MAX;
+        for (unsigned level = 0; level < levels; ++level) {
+            uint64_t mask = m_occupied[level];
+            if (!mask) {
+                continue;
+            }
+            unsigned shift = slot_bits * level;
+            uint64_t position = m_now >> shift;
+            unsigned start = static_cast<unsigned>(position + 1) & (slots - 1);
+            uint64_t distance = lowest_bit(rotate_right(mask, start)) + 1;
+            uint64_t tick = (position + distance) << shift;
+            if (tick < best) {
+                best = tick;
+            }
+        }
+        return best;
+    }
+
+public:
+    explicit timer_wheel(uint64_t now) : m_now(now), m_size(0) {
+        for (unsigned level = 0; level < levels; ++level) {
+            m_occupied[level] = 0;
+        }
+    }
+
+    uint64_t now() const {
+        return m_now;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    // Due timers (tick <= now) go straight to 'due'
+    void insert(timer_node* n, timer_list& due) {
+        ++m_size;
+        place(n, due);
+    }
+
+    void remove(timer_node* n) {
+        unlink(n);
+        --m_size;
+    }
+
+    // Moves every timer of 'target' to 'out'; visits all timers
+    void take_target(timer_target* target, timer_list& out) {
+        for (unsigned level = 0; level < levels; ++level) {
+            for (unsigned slot = 0; slot < slots; ++slot) {
+                timer_link& head = m_slots[level][slot];
+                for (timer_link* l = head.next; l != &head; ) {
+                    timer_node* n = static_cast<timer_node*>(l);
+                    l = l->next;
+                    if (n->target == target) {
+                        remove(n);
+                        out.push_back(n);
+                    }
+                }
+            }
+        }
+    }
+
+    // Earliest tick anything can happen at, UINT64_MAX when empty
+    uint64_t next_tick() const {
+        return m_size ? next_event() : UINT64_MAX;
+    }
+
+    void advance(uint64_t to, timer_list& due) {
+        while (m_now < to) {
+            uint64_t next = next_tick();
+            if (next > to) {
+                m_now = to;
+                return;
+            }
+            m_now = next;
+            for (unsigned level = levels - 1; level > 0; --level) {
+                unsigned shift = slot_bits * level;
+                if ((m_now & ((uint64_t(1) << shift) - 1)) == 0) {
+                    timer_list cascaded;
+                    take_slot(level, static_cast<unsigned>(m_now >> shift) & (slots - 1), cascaded);
+                    for (timer_node* n = cascaded.head; n; ) {
+                        timer_node* following = n->due_next;
+                        place(n, due);
+                        n = following;
+                    }
+                }
+            }
+            timer_list expired;
+            take_slot(0, static_cast<unsigned>(m_now) & (slots - 1), expired);
+            for (timer_node* n = expired.head; n; ) {
+                timer_node* following = n->due_next;
+                --m_size;
+                due.push_back(n);
+                n = following;
+            }
+        }
+    }
+};
+
+/* 4-ary min-heap on exact deadlines for the timers of the current wheel tick */
+class timer_heap {
+    vector<timer_node*> m_nodes;
+
+    static bool earlier(const timer_node* a, const timer_node* b) {
+        return a->deadline < b->deadline;
+    }
+
+    void put(size_t index, timer_node* n) {
+        m_nodes[index] = n;
+        n->heap_index = static_cast<uint32_t>(index);
+    }
+
+    void sift_up(size_t index) {
+        timer_node* n = m_nodes[index];
+        while (index > 0) {
+            size_t parent = (index - 1) / 4;
+            if (!earlier(n, m_nodes[parent])) {
+                break;
+            }
+            put(index, m_nodes[parent]);
+            index = parent;
+        }
+        put(index, n);
+    }
+
+    void sift_down(size_t index) {
+        timer_node* n = m_nodes[index];
+        size_t count = m_nodes.size();
+        for (;;) {
+            size_t first = index * 4 + 1;
+            if (first >= count) {
+                break;
+            }
+            size_t best = first;
+            size_t last = first + 4 < count ? first + 4 : count;
+            for (size_t child = first + 1; child < last; ++child) {
+                if (earlier(m_nodes[child], m_nodes[best])) {
+                    best = child;
+                }
+            }
+            if (!earlier(m_nodes[best], n)) {
+                break;
+            }
+            put(index, m_nodes[best]);
+            index = best;
+        }
+        put(index, n);
+    }
+
+public:
+    bool empty() const {
+        return m_nodes.empty();
+    }
+
+    timer_node* top() const {
+        return m_nodes.front();
+    }
+
+    void push(timer_node* n) {
+        m_nodes.push_back(n);
+        sift_up(m_nodes.size() - 1);
+    }
+
+    void remove(timer_node* n) {
+        size_t index = n->heap_index;
+        timer_node* last = m_nodes.back();
+        m_nodes.pop_back();
+        if (last != n) {
+            put(index, last);
+            sift_down(index);
+            sift_up(last->heap_index);
+        }
+    }
+
+    timer_node* pop() {
+        timer_node* n = top();
+        remove(n);
+        return n;
+    }
+
+    // Moves every timer of 'target' to 'out' and rebuilds the heap from the rest
+    void take_target(timer_target* target, timer_list& out) {
+        vector<timer_node*> kept;
+        for (timer_node* n : m_nodes) {
+            if (n->target == target) {
+                out.push_back(n);
+            } else {
+                kept.push_back(n);
+            }
+        }
+        m_nodes.clear();
+        for (timer_node* n : kept) {
+            push(n);
+        }
+    }
+};
+
+/* Process-wide timer thread behind every thread_pool's add_at/add_after. The wheel only needs to
+   get a timer into the right ~1ms tick: when the tick starts, its timers move to a near heap
+   ordered by their exact nanosecond deadline and the thread sleeps until the earliest one,
+   spinning for the last few microseconds. Due tasks are grouped by target and handed over in
+   one submit_timers call per target per wakeup. */
+class timer_service {
+public:
+    enum : unsigned { tick_shift = 20 };
+
+    // Closer than this to the next deadline the thread yields instead of sleeping
+    enum : uint64_t { spin_ns = 50000 };
+
+private:
+    mutex m_lock;
+    condition_variable m_wake;
+    timer_wheel m_wheel;
+    timer_heap m_near;
+    uint64_t m_sleep_until;
+    thread m_thread;
+
+    timer_service(timer_service const &);
+    timer_service & operator=(timer_service const &);
+
+    static uint64_t now_ns() {
+        using namespace std::chrono;
+        return static_cast<uint64_t>(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+    }
+
+    static uint64_t to_ns(const chrono::steady_clock::time_point& when) {
+        using namespace std::chrono;
+        auto ns = duration_cast<nanoseconds>(when.time_since_epoch()).count();
+        return ns > 0 ? static_cast<uint64_t>(ns) : 0;
+    }
+
+    static chrono::steady_clock::time_point from_ns(uint64_t ns) {
+        using namespace std::chrono;
+        return steady_clock::time_point(duration_cast<steady_clock::duration>(nanoseconds(ns)));
+    }
+
+    // Timers whose tick has started either fire now or wait in the near heap
+    void stage(timer_list& reached, uint64_t now, timer_list& due) {
+        for (timer_node* n = reached.head; n; ) {
+            timer_node* following = n->due_next;
+            if (n->deadline <= now) {
+                n->state = timer_node::done;
+                due.push_back(n);
+            } else {
+                n->state = timer_node::in_near;
+                m_near.push(n);
+            }
+            n = following;
+        }
+    }
+
+    void insert(timer_node* n, timer_list& due) {
+        timer_list reached;
+        n->state = timer_node::in_wheel;
+        m_wheel.insert(n, reached);
+        stage(reached, now_ns(), due);
+        if (!due.head && n->deadline < m_sleep_until) {
+            m_sleep_until = n->deadline;
+            m_wake.notify_one();
+        }
+    }
+
+    // Takes a timer that has neither fired nor been cancelled out of the wheel or the near heap
+    bool unlink(timer_node* n) {
+        if (n->state == timer_node::in_wheel) {
+            m_wheel.remove(n);
+        } else if (n->state == timer_node::in_near) {
+            m_near.remove(n);
+        } else {
+            return false;
+        }
+        n->state = timer_node::done;
+        return true;
+    }
+
+    uint64_t next_wakeup() const {
+        uint64_t wake = m_near.empty() ? UINT64_MAX : m_near.top()->deadline;
+        uint64_t tick = m_wheel.next_tick();
+        if (tick != UINT64_MAX && (tick << tick_shift) < wake) {
+            wake = tick << tick_shift;
+        }
+        return wake;
+    }
+    static void dispatch(timer_list& due) {
+        // Group by target, keeping each target's tasks in firing order
+        struct batch {
+            timer_target* target;
+            task_node* head;
+            task_node* tail;
+            size_t count;
+        };
+        vector<batch> batches;
+        for (timer_node* n = due.head; n; ) {
+            timer_node* following = n->due_next;
+            batch* b = nullptr;
+            for (auto& candidate : batches) {
+                if (candidate.target == n->target) {
+                    b = &candidate;
+                    break;
+                }
+            }
+            if (!b) {
+                batch fresh = { n->target, nullptr, nullptr, 0 };
+                batches.push_back(fresh);
+                b = &batches.back();
+            }
+            n->task->next = nullptr;
+            if (b->tail) {
+                b->tail->next = n->task;
+            } else {
+                b->head = n->task;
+            }
+            b->tail = n->task;
+            ++b->count;
+            n->release();
+            n = following;
+        }
+        for (auto& b : batches) {
+            b.target->submit_timers(b.head, b.count);
+        }
+    }
+
+    void run() {
+        unique_lock<mutex> lk(m_lock);
+        for (;;) {
+            uint64_t now = now_ns();
+            timer_list reached;
+            timer_list due;
+            m_wheel.advance(now >> tick_shift, reached);
+            stage(reached, now, due);
+            while (!m_near.empty() && m_near.top()->deadline <= now) {
+                timer_node* n = m_near.pop();
+                n->state = timer_node::done;
+                due.push_back(n);
+            }
+            if (due.head) {
+                m_sleep_until = 0;
+                lk.unlock();
+                dispatch(due);
+                lk.lock();
+                continue;
+            }
+            m_sleep_until = next_wakeup();
+            if (m_sleep_until == UINT64_MAX) {
+                m_wake.wait(lk);
+            } else if (m_sleep_until - now <= spin_ns) {
+                lk.unlock();
+                this_thread::yield();
+                lk.lock();
+            } else {
+                m_wake.wait_until(lk, from_ns(m_sleep_until - spin_ns));
+            }
+        }
+    }
+
+    timer_service() : m_wheel(now_ns() >> tick_shift), m_sleep_until(UINT64_MAX) {
+        m_thread = thread([this] { run(); });
+    }
+
+public:
+    // Never destroyed: pools with pending timers may still be draining during static destruction
+    static timer_service& instance() {
+        static timer_service* service = new timer_service();
+        return *service;
+    }
+
+    /* Returns the timer with a reference for the caller, which a timer_handle adopts; callers
+       that need no handle release() it */
+    timer_node* schedule(timer_target* target, const chrono::steady_clock::time_point& when, task_node* task) {
+        uint64_t deadline = to_ns(when);
+        timer_node* n = new timer_node(target, deadline, deadline >> tick_shift, task);
+        n->refs.store(2, memory_order_relaxed);
+        timer_list due;
+        {
+            lock_guard<mutex> lk(m_lock);
+            insert(n, due);
+        }
+        dispatch(due);
+        return n;
+    }
+
+    /* Destroys the task of a timer that has not fired yet and hands it back to its target
+       through timer_cancelled. O(1) in the wheel; timers due within the current tick sit in the
+       near heap and take O(log n) of those. */
+    bool cancel(timer_node* n) {
+        timer_target* target;
+        task_node* task;
+        {
+            lock_guard<mutex> lk(m_lock);
+            if (!unlink(n)) {
+                return false;
+            }
+            target = n->target;
+            task = n->task;
+        }
+        n->release();
+        target->timer_cancelled(task);
+        return true;
+    }
+
+    // Moves a timer that has not fired yet to a new deadline
+    bool reschedule(timer_node* n, const chrono::steady_clock::time_point& when) {
+        timer_list due;
+        {
+            lock_guard<mutex> lk(m_lock);
+            if (!unlink(n)) {
+                return false;
+            }
+            n->deadline = to_ns(when);
+            n->tick = n->deadline >> tick_shift;
+            insert(n, due);
+        }
+        dispatch(due);
+        return true;
+    }
+
+    bool pending(timer_node* n) {
+        lock_guard<mutex> lk(m_lock);
+        return n->state != timer_node::done;
+    }
+
+    /* Takes every timer 'target' still has waiting out of the service and returns their tasks,
+       linked through task_node::next, in no particular order. Visits every pending timer, so it
+       is meant for shutdown. Timers already handed to dispatch still reach submit_timers. */
+    task_node* cancel_all(timer_target* target, size_t& count) {
+        timer_list cancelled;
+        task_node* head = nullptr;
+        count = 0;
+        lock_guard<mutex> lk(m_lock);
+        m_wheel.take_target(target, cancelled);
+        m_near.take_target(target, cancelled);
+        for (timer_node* n = cancelled.head; n; ) {
+            timer_node* following = n->due_next;
+            n->state = timer_node::done;
+            n->task->next = head;
+            head = n->task;
+            ++count;
+            n->release();
+            n = following;
+        }
+        return head;
+    }
+};
+
+}
+
+/* Refers to one task added with add_at or add_after. Dropping or copying a handle leaves the
+   timer alone; cancel() and reschedule() return false once it has fired or been cancelled. */
+class timer_handle {
+    details::timer_node* m_node;
+
+public:
+    timer_handle() : m_node(nullptr) {}
+
+    // Adopts the reference timer_service::schedule returned
+    explicit timer_handle(details::timer_node* node) : m_node(node) {}
+
+    timer_handle(timer_handle const& other) : m_node(other.m_node) {
+        if (m_node) {
+            m_node->refs.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    timer_handle(timer_handle&& other) : m_node(other.m_node) {
+        other.m_node = nullptr;
+    }
+
+    timer_handle& operator=(timer_handle other) {
+        std::swap(m_node, other.m_node);
+        return *this;
+    }
+
+    ~timer_handle() {
+        if (m_node) {
+            m_node->release();
+        }
+    }
+
+    // Destroys the task, and whatever it captured, before returning if it has not fired yet
+    bool cancel() {
+        return m_node && details::timer_service::instance().cancel(m_node);
+    }
+
+    template<class Clock, class Duration>
+    bool reschedule(const chrono::time_point<Clock, Duration>& abs_time) {
+        return m_node && details::timer_service::instance().reschedule(m_node, details::to_steady_time(abs_time));
+    }
+
+    template<class Rep, class Period>
+    bool reschedule(const chrono::duration<Rep, Period>& rel_time) {
+        return m_node && details::timer_service::instance().reschedule(m_node,
+            chrono::steady_clock::now() + details::to_steady_duration(rel_time));
+    }
+
+    // Neither fired nor cancelled yet
+    bool pending() const {
+        return m_node && details::timer_service::instance().pending(m_node);
+    }
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef UNIQUE_TASK
+#define UNIQUE_TASK
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bytes of closure state unique_task keeps inline before falling back to the heap
+#ifndef EXTR_UNIQUE_TASK_BUFFER_SIZE
+#define EXTR_UNIQUE_TASK_BUFFER_SIZE 48
+#endif
+
+using namespace std;
+
+/* Move-only replacement for std::function<void()> on the submit path.
+   Closures that fit in BufferSize bytes and are nothrow-movable live inline, larger ones
+   are boxed on the heap. Invoking is a single indirect call through m_invoke; m_manage
+   handles move and destruction and is null for trivially copyable closures, which are
+   relocated with memcpy. */
+template<size_t BufferSize>
+class basic_unique_task {
+    typedef typename aligned_storage<BufferSize, alignof(max_align_t)>::type storage_type;
+
+    enum class operation { move, destroy };
+
+    typedef void (*invoke_type)(void*);
+    typedef void (*manage_type)(operation, void*, void*);
+
+    template<class Func>
+    struct fits_inline : integral_constant<bool,
+        sizeof(Func) <= BufferSize &&
+        alignof(max_align_t) % alignof(Func) == 0 &&
+        is_nothrow_move_constructible<Func>::value> {};
+
+    template<class Func>
+    struct inline_model {
+        static void invoke(void* storage) {
+            (*static_cast<Func*>(storage))();
+        }
+        static void manage(operation op, void* dst, void* src) {
+            if (op == operation::move) {
+                ::new (dst) Func(std::move(*static_cast<Func*>(src)));
+            }
+            static_cast<Func*>(src)->~Func();
+        }
+    };
+
+    template<class Func>
+    struct heap_model {
+        static Func*& target(void* storage) {
+            return *static_cast<Func**>(storage);
+        }
+        static void invoke(void* storage) {
+            (*target(storage))();
+        }
+        static void manage(operation op, void* dst, void* src) {
+            if (op == operation::move) {
+                ::new (dst) Func*(target(src));
+            } else {
+                delete target(src);
+            }
+        }
+    };
+
+    invoke_type m_invoke;
+    manage_type m_manage;
+    storage_type m_storage;
+
+    template<class Func, class Arg>
+    void construct(Arg&& closure, true_type /* inline */) {
+        ::new (&m_storage) Func(std::forward<Arg>(closure));
+        m_invoke = &inline_model<Func>::invoke;
+        m_manage = is_trivially_copyable<Func>::value ? nullptr : &inline_model<Func>::manage;
+    }
+
+    template<class Func, class Arg>
+    void construct(Arg&& closure, false_type /* boxed */) {
+        ::new (&m_storage) Func*(new Func(std::forward<Arg>(closure)));
+        m_invoke = &heap_model<Func>::invoke;
+        m_manage = &heap_model<Func>::manage;
+    }
+
+    void take(basic_unique_task& other) {
+        m_invoke = other.m_invoke;
+        m_manage = other.m_manage;
+        if (m_manage) {
+            m_manage(operation::move, &m_storage, &other.m_storage);
+        } else if (m_invoke) {
+            memcpy(&m_storage, &other.m_storage, sizeof(m_storage));
+        }
+        other.m_invoke = nullptr;
+        other.m_manage = nullptr;
+    }
+
+    basic_unique_task(basic_unique_task const &);
+    basic_unique_task & operator=(basic_unique_task const &);
+
+public:
+    basic_unique_task() : m_invoke(nullptr), m_manage(nullptr) {}
+
+    basic_unique_task(nullptr_t) : m_invoke(nullptr), m_manage(nullptr) {}
+
+    template<class Func, class = typename enable_if<!is_same<typename decay<Func>::type, basic_unique_task>::value>::type>
+    basic_unique_task(Func&& closure) {
+        typedef typename decay<Func>::type closure_type;
+        construct<closure_type>(std::forward<Func>(closure), fits_inline<closure_type>());
+    }
+
+    basic_unique_task(basic_unique_task&& other) throw() {
+        take(other);
+    }
+
+    basic_unique_task& operator=(basic_unique_task&& other) throw() {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~basic_unique_task() {
+        reset();
+    }
+
+    void reset() {
+        if (m_manage) {
+            m_manage(operation::destroy, nullptr, &m_storage);
+        }
+        m_invoke = nullptr;
+        m_manage = nullptr;
+    }
+
+    explicit operator bool() const {
+        return m_invoke != nullptr;
+    }
+
+    void operator()() {
+        assert(m_invoke);
+        m_invoke(&m_storage);
+    }
+};
+
+typedef basic_unique_task<EXTR_UNIQUE_TASK_BUFFER_SIZE> unique_task;
+
+#endif
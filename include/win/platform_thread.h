@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <system_error>
+
+#include <process.h>
+#include <windows.h>
+
+namespace details {
+
+/* Starts a detached thread running entry(arg); stack_size 0 keeps the platform default.
+   Throws system_error like std::thread when the thread cannot be created. */
+inline void start_detached_thread(size_t stack_size, void (*entry)(void*), void* arg) {
+    struct trampoline {
+        void (*entry)(void*);
+        void* arg;
+
+        static unsigned __stdcall run(void* context) {
+            trampoline t = *static_cast<trampoline*>(context);
+            delete static_cast<trampoline*>(context);
+            t.entry(t.arg);
+            return 0;
+        }
+    };
+
+    trampoline* context = new trampoline{ entry, arg };
+    uintptr_t handle = _beginthreadex(nullptr, static_cast<unsigned>(stack_size), &trampoline::run, context,
+        stack_size ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0, nullptr);
+    if (!handle) {
+        delete context;
+        throw std::system_error(errno, std::generic_category(), "start_detached_thread");
+    }
+    // Nobody joins the thread, only its handle has to go
+    CloseHandle(reinterpret_cast<HANDLE>(handle));
+}
+
+}
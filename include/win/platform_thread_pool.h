@@ -1,4 +1,5 @@
 #include "thread_helper.h"
+#include "thread_pool_options.h"
 
 using namespace std;
 
@@ -10,26 +11,162 @@ public:
     }
     explicit thread_pool(int N) : pool(new details::functional_timer_pool(N)) {
     }
+    /* The Windows pool places its own threads and retires idle ones on its own schedule; only the
+       counts and the capacity are honoured. max_threads defaults to 'threads' here, since the pool
+       grows to its maximum whenever work is queued, not just for blocked callbacks. */
+    explicit thread_pool(thread_pool_options const& options) :
+        pool(options.threads > 0 ?
+            new details::functional_timer_pool(
+                options.min_threads > 0 ? (std::min)(options.min_threads, options.threads) : options.threads,
+                options.max_threads > 0 ? (std::max)(options.max_threads, options.threads) : options.threads) :
+            new details::functional_timer_pool()) {
+        pool->set_capacity(options.capacity, options.overflow);
+    }
 
     template<class Func>
     void add(Func&& closure) {
-        pool->submit(std::move(closure));
+        pool->submit(std::forward<Func>(closure));
+    }
+
+    template<class Func>
+    void add(task_priority priority, Func&& closure) {
+        pool->submit(priority, std::forward<Func>(closure));
+    }
+
+    // Queues closure however full the queue is; see abstract_executor_ref::add_unbounded
+    template<class Func>
+    void add_unbounded(Func&& closure) {
+        pool->submit_admitted(task_priority::normal, false, std::forward<Func>(closure));
     }
 
+    // Queues closure unless the queue is at its capacity; closure is left alone when this returns false
     template<class Func>
-    void add_at(const chrono::system_clock::time_point& abs_time, Func&& closure) {
-        pool->submit_at(abs_time, std::move(closure));
+    bool try_add(Func&& closure) {
+        return pool->try_submit(task_priority::normal, std::forward<Func>(closure));
+    }
+
+    // Like try_add, but waits up to rel_time for a queued task to start
+    template<class Rep, class Period, class Func>
+    bool add_for(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool->submit_until(chrono::steady_clock::now() + details::to_steady_duration(rel_time),
+            task_priority::normal, std::forward<Func>(closure));
+    }
+
+    /* Bounds the tasks add() and its variants may queue; 0 removes the bound. A task holds its
+       place until it starts; timed tasks and add_unbounded are not counted. drop_oldest acts like
+       reject, since submitted callbacks cannot be taken back. */
+    void set_capacity(size_t capacity, overflow_policy policy = overflow_policy::reject) {
+        pool->set_capacity(capacity, policy);
+    }
+
+    size_t capacity() const {
+        return pool->capacity();
+    }
+
+    // Runs closure like add(); the returned future carries its result or exception
+    template<class Func>
+    typename detail::future_of<Func>::type add_with_result(Func&& closure) {
+        return detail::add_with_result(*this, std::forward<Func>(closure));
+    }
+
+    // Runs closure before returning when called from one of this pool's tasks, otherwise add(closure)
+    template<class Func>
+    void dispatch(Func&& closure) {
+        detail::dispatch_or_add(*this, std::forward<Func>(closure));
+    }
+
+    bool running_in_this_thread() const {
+        return pool->running_in_this_thread();
+    }
+
+    // System pool callbacks cannot be run from outside, so a waiting task always blocks
+    bool try_run_one() {
+        return false;
+    }
+
+    // The Windows pool has no batched submit; each task is still a single work item
+    template<class Iterator>
+    void add_bulk(Iterator first, Iterator last) {
+        for (; first != last; ++first) {
+            pool->submit(*first);
+        }
     }
 
+    // Calls closure(i) for every i in [0, count) from at most one runner per core
     template<class Func>
-    void add_after(const chrono::system_clock::duration& rel_time, Func&& closure) {
-        pool->submit_after(rel_time, std::move(closure));
+    void add_n(size_t count, Func&& closure) {
+        detail::add_apply(*this, count, (std::max)(1u, thread::hardware_concurrency()), std::forward<Func>(closure));
+    }
+
+    /* Any clock; steady_clock deadlines are kept as is with nanosecond resolution. The handle can
+       cancel the task or move its deadline until it falls due. */
+    template<class Clock, class Duration, class Func>
+    timer_handle add_at(const chrono::time_point<Clock, Duration>& abs_time, Func&& closure) {
+        return pool->submit_at(details::to_steady_time(abs_time), std::forward<Func>(closure));
+    }
+
+    template<class Rep, class Period, class Func>
+    timer_handle add_after(const chrono::duration<Rep, Period>& rel_time, Func&& closure) {
+        return pool->submit_at(chrono::steady_clock::now() + details::to_steady_duration(rel_time), std::forward<Func>(closure));
     }
 
     virtual size_t uninitiated_task_count() const {
-        return 0;
+        return pool->uninitiated_task_count();
     }
 
+    size_t node_count() const {
+        return 1;
+    }
+
+    // Caps a pool created with a thread count; the default system pool sizes itself
+    void set_concurrency(int n) {
+        pool->set_concurrency(n > 0 ? n : 1);
+    }
+
+    size_t concurrency() const {
+        return pool->concurrency();
+    }
+
+    /* Stops taking tasks from other threads, gives the queued ones up to 'drain_for' to run and
+       then discards the rest as the system pool hands them out; timed tasks are discarded at once.
+       Returns once nothing of this pool is queued or running. See the Linux thread_pool for details. */
+    template<class Rep, class Period>
+    shutdown_result shutdown(const chrono::duration<Rep, Period>& drain_for, discard_handler const& on_discard = discard_handler()) {
+        return pool->shutdown(chrono::steady_clock::now() + details::to_steady_duration(drain_for), on_discard);
+    }
+
+    // Runs everything queued, however long it takes; only timed tasks are discarded
+    shutdown_result shutdown() {
+        return pool->shutdown(chrono::steady_clock::time_point::max(), discard_handler());
+    }
+
+    // Discards everything that has not started
+    shutdown_result shutdown_now(discard_handler const& on_discard = discard_handler()) {
+        return pool->shutdown(chrono::steady_clock::now(), on_discard);
+    }
+
+    executor_metrics metrics() const {
+        return pool->metrics();
+    }
+
+    // Names the pool in tracing::write_chrome_json; shared by every copy
+    void set_trace_name(string const& name) {
+        tracing::name(pool.get(), name);
+    }
+
+#if EXTR_COROUTINES
+    // co_await executor.after(d) / executor.at(t) resume the coroutine on this executor
+    template<class Rep, class Period>
+    timed_awaitable<thread_pool> after(const chrono::duration<Rep, Period>& rel_time) {
+        return ::after(*this, rel_time);
+    }
+
+    template<class Clock, class Duration>
+    timed_awaitable<thread_pool> at(const chrono::time_point<Clock, Duration>& abs_time) {
+        return ::at(*this, abs_time);
+    }
+#endif
+
 #if 0 // debugging
     thread_pool(thread_pool const& other) {
         this->pool = other.pool;
@@ -2,14 +2,21 @@
 #define THREAD_HELPER
 
 #include "thread_traits.h"
+#include "capacity_gate.h"
+#include "executor.h"
+#include "task_node.h"
 #include "thread_util.h"
+#include "timer_wheel.h"
+#include "unique_task.h"
 
 #include <windows.h>
+#include <algorithm>
 #include <atomic>
 #include <functional>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 
 using namespace std;
 
@@ -34,21 +41,9 @@ public:
     }
 };
 
-inline DWORD absolute_to_relative_milli(const chrono::system_clock::time_point& abs_time) {
-    using namespace std::chrono;
-    return static_cast<DWORD>(std::max(0LL, duration_cast<milliseconds>(abs_time - system_clock::now()).count()));
-}
-
-inline DWORD relative_to_relative_milli(const chrono::system_clock::duration& rel_time) {
-    using namespace std::chrono;
-    typedef std::chrono::duration<DWORD, std::ratio<1, 1000>> milli;
-
-    return duration_cast<milli>(rel_time).count();
-}
-
 namespace details {
 
-/* For passing std::function as a void pointer */
+/* For passing a unique_task as a void pointer */
 template <class derived>
 class fnc_wrapper_interface {
     void run() {
@@ -58,72 +53,171 @@ class fnc_wrapper_interface {
 
 class functional_pool;
 
-class fnc_wrapper : fnc_wrapper_interface<fnc_wrapper> {
-    function<void()> m_ptr;
+class fnc_wrapper : fnc_wrapper_interface<fnc_wrapper>, public slab_allocated {
+    unique_task m_ptr;
     functional_pool * m_pool;
+    uint64_t m_enqueued;
+    bool m_slot;                // Holds a slot of the pool's capacity_gate until it starts
+    task_trace m_trace;
 public:
     template<class Func>
-    fnc_wrapper(Func&& wrapper, functional_pool* pool) : m_ptr(wrapper), m_pool(pool) {}
+    fnc_wrapper(Func&& wrapper, functional_pool* pool, bool slot, task_trace const& trace) : m_ptr(std::forward<Func>(wrapper)), m_pool(pool), m_enqueued(task_clock::now()), m_slot(slot), m_trace(trace) {}
     void run() { m_ptr(); }
+    unique_task& task() { return m_ptr; }
+    task_trace const& trace() const { return m_trace; }
     functional_pool* pool() { return m_pool; }
+    uint64_t enqueued() const { return m_enqueued; }
+    bool slot() const { return m_slot; }
 };
 
-class functional_pool
+class functional_pool : public detail::blocking_handler
 {
 private:
     pool m_pool;                // Represents the internal threadpool
     cleanup_group cg;           // Responsible for cleaning up objects in the m_pool environment
-    environment e;              // Custom environment for threadpool
+    environment e[task_priority_levels]; // Callback environments, one per task_priority
+    int m_min_threads;
+    atomic<int> m_concurrency;
+    atomic<size_t> m_discarded;
+    discard_handler m_on_discard;   // Written before m_phase leaves phase_open
+    mutex m_shutdown_lock;
+    capacity_gate m_gate;
 
     condition_variable all_tasks_finished_cv;
     mutex              all_tasks_finished_mutex;
 
+    // The system pool owns the threads, so every task reports into one set of shared counters
+    shared_task_counters m_counters;
+
     void start_task()
     {
         m_uninitiated_task_count--;
     }
 
-    void finish_task()
+    void finish_task(uint64_t enqueued, uint64_t started)
     {
-        m_unfinished_task_count--;
-        if (m_unfinished_task_count == 0) {
-            all_tasks_finished_cv.notify_all();
-        }
+        m_counters.task_done(enqueued, started, task_clock::now());
+        finish_task();
     }
 
-    static void CALLBACK callback(PTP_CALLBACK_INSTANCE, void * context)
+
+    // Callback instance of the task running on this thread, for CallbackMayRunLong
+    static PTP_CALLBACK_INSTANCE& current_instance()
     {
+        static thread_local PTP_CALLBACK_INSTANCE instance = nullptr;
+        return instance;
+    }
+
+    static void CALLBACK callback(PTP_CALLBACK_INSTANCE instance, void * context)
+    {
+        current_instance() = instance;
         run(context);
+        current_instance() = nullptr;
     }
 
 protected:
+    enum : int { phase_open, phase_draining, phase_discarding };
+
     atomic<int> m_uninitiated_task_count;
     atomic<int> m_unfinished_task_count;
+    atomic<int> m_phase;
+    atomic<int> m_submitting;       // submit and submit_at calls past their phase check
+
+    void finish_task()
+    {
+        if (--m_unfinished_task_count == 0) {
+            // Under the lock, so a waiter between its check and its sleep cannot miss this
+            lock_guard<mutex> lk(all_tasks_finished_mutex);
+            all_tasks_finished_cv.notify_all();
+        }
+    }
 
     // Runs closure from callback
     static void run(void * context)
     {
         auto q = reinterpret_cast<fnc_wrapper *>(context);
         q->pool()->start_task();
-        q->run();
-        q->pool()->finish_task();
+        if (q->slot()) {
+            q->pool()->m_gate.release();
+        }
+        // Callbacks cannot be taken back from the system pool, so a shutdown discards them as they come up
+        if (q->pool()->m_phase.load(memory_order_acquire) == phase_discarding) {
+            functional_pool* pool = q->pool();
+            pool->discard(q->task());
+            delete q;
+            pool->finish_task();
+            return;
+        }
+        uint64_t started = task_clock::now();
+        {
+            // Callbacks of every pool can share a system thread, so the pool is only known per task
+            detail::executor_frame frame(q->pool());
+            detail::blocking_handler::current() = q->pool();
+            q->trace().started(q->pool());
+            q->run();
+            q->trace().finished(q->pool());
+            detail::blocking_handler::current() = nullptr;
+        }
+        q->pool()->finish_task(q->enqueued(), started);
         delete q;
     }
 
 public:
 
-    functional_pool() : m_pool(nullptr), cg(nullptr), m_uninitiated_task_count(0), m_unfinished_task_count(0) {
+    // The system pool has three callback priorities; background shares the low one
+    void set_priorities()
+    {
+        static const TP_CALLBACK_PRIORITY priorities[task_priority_levels] = {
+            TP_CALLBACK_PRIORITY_HIGH, TP_CALLBACK_PRIORITY_NORMAL, TP_CALLBACK_PRIORITY_LOW, TP_CALLBACK_PRIORITY_LOW
+        };
+        for (size_t level = 0; level < task_priority_levels; ++level) {
+            SetThreadpoolCallbackPriority(e[level].get(), priorities[level]);
+        }
     }
 
-    functional_pool(int num_threads) : m_pool(CreateThreadpool(nullptr)), cg(CreateThreadpoolCleanupGroup()), m_uninitiated_task_count(0), m_unfinished_task_count(0), e()
+    functional_pool() : m_pool(nullptr), cg(nullptr), m_min_threads(0), m_concurrency((int)thread::hardware_concurrency()), m_discarded(0), m_uninitiated_task_count(0), m_unfinished_task_count(0), m_phase(phase_open), m_submitting(0) {
+        set_priorities();
+    }
+
+    functional_pool(int num_threads) : functional_pool(num_threads, num_threads) {}
+
+    functional_pool(int min_threads, int max_threads) : m_pool(CreateThreadpool(nullptr)), cg(CreateThreadpoolCleanupGroup()), m_min_threads(min_threads), m_concurrency(max_threads), m_discarded(0), m_uninitiated_task_count(0), m_unfinished_task_count(0), m_phase(phase_open), m_submitting(0)
     {
-        SetThreadpoolCallbackPool(e.get(), m_pool.get());
-        SetThreadpoolCallbackCleanupGroup(e.get(), cg.get(), nullptr);
+        for (size_t level = 0; level < task_priority_levels; ++level) {
+            SetThreadpoolCallbackPool(e[level].get(), m_pool.get());
+            SetThreadpoolCallbackCleanupGroup(e[level].get(), cg.get(), nullptr);
+        }
+        set_priorities();
+
+        SetThreadpoolThreadMinimum(m_pool.get(), min_threads);
+        SetThreadpoolThreadMaximum(m_pool.get(), max_threads);
+    }
+
+    // Caps a custom pool at n threads; the process-wide default pool sizes itself
+    void set_concurrency(int n)
+    {
+        if (m_pool.get()) {
+            SetThreadpoolThreadMaximum(m_pool.get(), n);
+            SetThreadpoolThreadMinimum(m_pool.get(), (std::min)(m_min_threads, n));
+            m_concurrency = n;
+        }
+    }
 
-        SetThreadpoolThreadMinimum(m_pool.get(), num_threads);
-        SetThreadpoolThreadMaximum(m_pool.get(), num_threads);
+    size_t concurrency() const
+    {
+        return (size_t)(int)m_concurrency;
     }
 
+    // The system pool may add a thread while this callback blocks, up to the pool's maximum
+    virtual void enter_blocking() override
+    {
+        if (current_instance()) {
+            CallbackMayRunLong(current_instance());
+        }
+    }
+
+    virtual void leave_blocking() override {}
+
     void wait()
     {
         if (m_unfinished_task_count > 0) { 
@@ -142,54 +236,236 @@ public:
     template<class Func>
     void submit(Func&& closure)
     {
-        m_unfinished_task_count++;
-        m_uninitiated_task_count++;
-        fnc_wrapper * wrapper = new fnc_wrapper(std::move(closure), this);
-        TrySubmitThreadpoolCallback(callback, wrapper, e.get());
+        submit(task_priority::normal, std::forward<Func>(closure));
     }
 
-    size_t uninitiated_task_count() const
+    template<class Func>
+    void submit(task_priority priority, Func&& closure)
     {
-        return (size_t)m_uninitiated_task_count;
+        bool slot;
+        if (m_gate.try_acquire(slot)) {
+            submit_admitted(priority, slot, std::forward<Func>(closure));
+        } else if (m_gate.policy() == overflow_policy::run_in_caller) {
+            typename decay<Func>::type f(std::forward<Func>(closure));
+            f();
+        } else {
+            // Submitted callbacks cannot be taken back, so drop_oldest rejects the new closure too
+            m_gate.rejected();
+        }
     }
-};
 
-class functional_timer_pool : public functional_pool {
-private:
-    timer_queue t_queue;
+    template<class Func>
+    bool try_submit(task_priority priority, Func&& closure)
+    {
+        bool slot;
+        if (!m_gate.try_acquire(slot)) {
+            return false;
+        }
+        submit_admitted(priority, slot, std::forward<Func>(closure));
+        return true;
+    }
 
-    static void CALLBACK TimerRoutine(PVOID lpParam, BOOLEAN TimerOrWaitFired) {
-        run(lpParam);
+    template<class Func>
+    bool submit_until(const chrono::steady_clock::time_point& deadline, task_priority priority, Func&& closure)
+    {
+        bool slot;
+        if (!m_gate.try_acquire(slot)) {
+            // Waiting on one of our own threads lets the pool bring in a stand-in that drains the queue
+            blocking_region hint;
+            if (!m_gate.acquire_until(deadline, slot)) {
+                return false;
+            }
+        }
+        submit_admitted(priority, slot, std::forward<Func>(closure));
+        return true;
     }
 
+    // A timed task comes with the trace id it got from submit_at
     template<class Func>
-    void submit_internal(Func&& closure, DWORD msec) {
+    void submit_admitted(task_priority priority, bool slot, Func&& closure, task_trace trace = task_trace())
+    {
+        // Counted before the phase check, so a shutdown that missed this task waits for it
         m_unfinished_task_count++;
+        if (!accepting()) {
+            if (slot) {
+                m_gate.release();
+            }
+            unique_task rejected(std::forward<Func>(closure));
+            discard(rejected);
+            finish_task();
+            return;
+        }
         m_uninitiated_task_count++;
-        fnc_wrapper * wrapper = new fnc_wrapper(std::move(closure), this);
-        HANDLE t = NULL;
-        CreateTimerQueueTimer(&t, t_queue.get(), reinterpret_cast<WAITORTIMERCALLBACK>(TimerRoutine), wrapper, msec, 0, 0);
+        trace.submitted(this);
+        fnc_wrapper * wrapper = new fnc_wrapper(std::forward<Func>(closure), this, slot, trace);
+        TrySubmitThreadpoolCallback(callback, wrapper, e[static_cast<size_t>(priority)].get());
+    }
+
+    void set_capacity(size_t capacity, overflow_policy policy)
+    {
+        m_gate.set(capacity, policy);
+    }
+
+    size_t capacity() const
+    {
+        return m_gate.capacity();
+    }
+
+    // While draining, the pool's own tasks may still add work, e.g. continuations of what is queued
+    bool accepting() const
+    {
+        int current = m_phase.load(memory_order_seq_cst);
+        return current == phase_open || (current == phase_draining && running_in_this_thread());
+    }
+
+    void discard(unique_task& fnc)
+    {
+        if (m_on_discard) {
+            m_on_discard(fnc);
+        }
+        m_discarded++;
+    }
+
+    shutdown_result shutdown(const chrono::steady_clock::time_point& deadline, discard_handler const& handler)
+    {
+        shutdown_result result;
+        lock_guard<mutex> once(m_shutdown_lock);
+        if (m_phase.load(memory_order_relaxed) != phase_open) {
+            return result;
+        }
+        m_on_discard = handler;
+        m_phase.store(phase_draining, memory_order_seq_cst);
+        while (m_submitting.load(memory_order_seq_cst) != 0) {
+            this_thread::yield();
+        }
+        cancel_timers();
+        if (deadline == chrono::steady_clock::time_point::max()) {
+            wait();
+        } else {
+            std::unique_lock<std::mutex> lk(all_tasks_finished_mutex);
+            result.drained = all_tasks_finished_cv.wait_until(lk, deadline, [this] { return m_unfinished_task_count == 0; });
+        }
+        m_phase.store(phase_discarding, memory_order_seq_cst);
+        wait();
+        result.discarded = m_discarded.load(memory_order_relaxed);
+        return result;
+    }
+
+    // Takes back the pool's timed tasks; only the timer pool has any
+    virtual void cancel_timers() {}
+
+    bool running_in_this_thread() const
+    {
+        return detail::executor_frame::running_in(this);
+    }
+
+    size_t uninitiated_task_count() const
+    {
+        return (size_t)m_uninitiated_task_count;
+    }
+
+    executor_metrics metrics() const
+    {
+        executor_metrics m;
+        int unfinished = m_unfinished_task_count;
+        int uninitiated = m_uninitiated_task_count;
+        m.queued = (size_t)uninitiated;
+        m.running = unfinished > uninitiated ? (size_t)(unfinished - uninitiated) : 0;
+        m.rejected = m_gate.rejected_count();
+        m_counters.collect(m);
+        return m;
     }
+};
+
+/* Timed tasks wait in the shared timer_service and are submitted to the pool when due */
+class functional_timer_pool : public functional_pool, public timer_target {
+    atomic<int> m_timers_pending;
 
 public:
     ~functional_timer_pool()
     {
         wait();
+        tracing::forget(this);
     }
-    functional_timer_pool() : functional_pool(), t_queue(CreateTimerQueue()) {} // default threadpool with timer
+    functional_timer_pool() : functional_pool(), m_timers_pending(0) {} // default threadpool with timer
 
-    functional_timer_pool(int num_threads) : functional_pool(num_threads), t_queue(CreateTimerQueue()) {}
+    functional_timer_pool(int num_threads) : functional_pool(num_threads), m_timers_pending(0) {}
 
-    template<class Func>
-    void submit_at(const chrono::system_clock::time_point& abs_time, Func&& closure) {
-        DWORD msec = absolute_to_relative_milli(abs_time);
-        submit_internal(closure, msec);
+    functional_timer_pool(int min_threads, int max_threads) : functional_pool(min_threads, max_threads), m_timers_pending(0) {}
+
+    executor_metrics metrics() const
+    {
+        executor_metrics m = functional_pool::metrics();
+        // Pending timers count as unfinished but not as uninitiated; take them back out of running
+        m.timers_pending = (size_t)(int)m_timers_pending;
+        m.running = m.running > m.timers_pending ? m.running - m.timers_pending : 0;
+        return m;
     }
 
     template<class Func>
-    void submit_after(const chrono::system_clock::duration& rel_time, Func&& closure) {
-        DWORD msec = relative_to_relative_milli(rel_time);
-        submit_internal(closure, msec);
+    timer_handle submit_at(const chrono::steady_clock::time_point& abs_time, Func&& closure) {
+        // Timers are cancelled as soon as a shutdown starts, so none are taken after that
+        m_submitting.fetch_add(1, memory_order_seq_cst);
+        if (m_phase.load(memory_order_seq_cst) != phase_open) {
+            m_submitting.fetch_sub(1, memory_order_relaxed);
+            unique_task rejected(std::forward<Func>(closure));
+            discard(rejected);
+            return timer_handle();
+        }
+        // Counted as unfinished until it fires or is cancelled, so wait() covers pending timers
+        m_unfinished_task_count++;
+        m_timers_pending++;
+        task_node* t = new task_node(std::forward<Func>(closure));
+        t->trace.submitted(this);
+        timer_handle handle(timer_service::instance().schedule(this, abs_time, t));
+        m_submitting.fetch_sub(1, memory_order_seq_cst);
+        return handle;
+    }
+
+    virtual void timer_cancelled(task_node* task) override {
+        delete task;
+        m_timers_pending--;
+        finish_task();
+    }
+
+    virtual void cancel_timers() override {
+        size_t count = 0;
+        task_node* first = timer_service::instance().cancel_all(this, count);
+        m_timers_pending -= (int)count;
+        discard_timers(first);
+    }
+
+    void discard_timers(task_node* first) {
+        while (first) {
+            task_node* next = first->next;
+            discard(first->fnc);
+            delete first;
+            finish_task();
+            first = next;
+        }
+    }
+
+    virtual void submit_timers(task_node* first, size_t count) override {
+        /* The timer thread holds no reference to the pool. An unfinished count of its own keeps
+           wait() from returning until the batch is handed over, not just until its tasks ran. */
+        m_unfinished_task_count++;
+        m_timers_pending -= (int)count;
+        if (m_phase.load(memory_order_acquire) != phase_open) {
+            discard_timers(first);
+        } else {
+            while (first) {
+                task_node* next = first->next;
+                first->trace.fired(this);
+                // Timed tasks take no place in a bounded queue
+                submit_admitted(task_priority::normal, false, std::move(first->fnc), first->trace);
+                delete first;
+                // The timer's own count; its callback holds another from submit_admitted
+                finish_task();
+                first = next;
+            }
+        }
+        // May let the pool go, so nothing of it is touched after this
+        finish_task();
     }
 };
 
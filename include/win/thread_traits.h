@@ -33,18 +33,4 @@ struct cleanup_group_traits
 };
 typedef unique_handle<PTP_CLEANUP_GROUP, cleanup_group_traits> cleanup_group;
 
-struct timer_queue_traits
-{
-    static HANDLE invalid() throw()
-    {
-        return nullptr;
-    }
-
-    static void close(HANDLE value) throw()
-    {
-        DeleteTimerQueueEx(value, INVALID_HANDLE_VALUE); //Waits for all callback functions to complete with INVALID_HANDLE_VALUE
-    }
-};
-typedef unique_handle<HANDLE, timer_queue_traits> timer_queue;
-
 #endif
\ No newline at end of file
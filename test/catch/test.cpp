@@ -1,13 +1,28 @@
 #define CATCH_CONFIG_MAIN
 #include <catch.hpp>
 
+#include <algorithm>
+#include <functional>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <executor.h>
+#include <executor_metrics.h>
+#include <partitioned_serial_executor.h>
+#include <rate_limited_executor.h>
 #include <serial_executor.h>
+#include <strand.h>
 #include <system_executor.h>
+#include <task_future.h>
+#include <task_group.h>
+#include <task_trace.h>
 #include <thread_per_task_executor.h>
 #include <thread_pool.h>
+#include <timer_wheel.h>
 #include <utils/semaphore.h>
 
 const float time_delta = 0.9f;
@@ -90,9 +105,1006 @@ SCENARIO("thread_pool(1) is serial", "[thread_pool][executor]"){
                 REQUIRE(task2_passed);
             }
         }
+#if defined(__linux__)
+        WHEN("a task waits in a blocking_region on one queued behind it"){
+            std::atomic<int> inside{0};
+            std::atomic<bool> overlapped{false};
+            std::atomic<int> completed{0};
+            auto enter = [&] {
+                if (++inside > 1) {
+                    overlapped = true;
+                }
+            };
+            {
+                utils::semaphore started(1);
+                utils::semaphore blocked(1);
+                thread_pool tp(1);
+
+                tp.add([&] {
+                    {
+                        blocking_region hint;
+                        blocked.notify();
+                        started.wait();
+                    }
+                    // Only goes on once the stand-in is done with its task
+                    enter();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    --inside;
+                    ++completed;
+                });
+                blocked.wait();
+                tp.add([&] {
+                    enter();
+                    started.notify();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    --inside;
+                    ++completed;
+                });
+                for (int i = 0; i < 3; ++i) {
+                    tp.add([&] {
+                        enter();
+                        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                        --inside;
+                        ++completed;
+                    });
+                }
+            }
+
+            THEN("its stand-in never runs alongside it"){
+                REQUIRE(completed == 5);
+                REQUIRE(!overlapped);
+            }
+        }
+#endif
+    }
+}
+
+
+SCENARIO("thread_pool runs tasks submitted from its workers", "[thread_pool][executor]"){
+    GIVEN("a thread_pool"){
+        WHEN("every task fans out more tasks"){
+            std::atomic<int> completed{0};
+            {
+                thread_pool tp(4);
+
+                // Submissions from a worker land in its own deque, the other workers have to steal them
+                for (int i = 0; i < 10; ++i) {
+                    tp.add([&] {
+                        for (int j = 0; j < 100; ++j) {
+                            tp.add([&] { ++completed; });
+                        }
+                        ++completed;
+                    });
+                }
+            }
+
+            THEN("all must finish"){
+                REQUIRE(completed == 1010);
+            }
+        }
+        WHEN("tasks wait behind a blocked worker"){
+            utils::semaphore release(1);
+            std::atomic<int> completed{0};
+            size_t waiting = 0;
+            {
+                thread_pool tp(1);
+
+                tp.add([&] { release.wait(); });
+                tp.add([&] { ++completed; });
+                tp.add([&] { ++completed; });
+
+                waiting = tp.uninitiated_task_count();
+                release.notify();
+            }
+
+            THEN("they are counted as uninitiated"){
+                REQUIRE(waiting >= 2);
+                REQUIRE(completed == 2);
+            }
+        }
+    }
+}
+
+SCENARIO("bulk submission", "[thread_pool][system_executor][abstract_executor][executor]"){
+    GIVEN("a batch of tasks"){
+        WHEN("it is added in one call to every kind of executor"){
+            std::atomic<int> completed{0};
+            {
+                thread_pool tp(4);
+                serial_executor se(&tp);
+                abstract_executor ae(tp);
+                abstract_executor serial_ae(se);
+
+                std::vector<std::function<void()>> tasks(100, [&] { ++completed; });
+                tp.add_bulk(tasks.begin(), tasks.end());
+                ae.add_bulk(tasks.begin(), tasks.end());
+                serial_ae.add_bulk(tasks.begin(), tasks.end());
+
+                std::vector<unique_task> moved;
+                for (int i = 0; i < 100; ++i) {
+                    moved.emplace_back([&] { ++completed; });
+                }
+                system_executor::get_system_executor().add_bulk(std::make_move_iterator(moved.begin()), std::make_move_iterator(moved.end()));
+
+                // Submitted from a worker the batch goes to its deque and is stolen from there
+                utils::semaphore done(1);
+                tp.add([&] {
+                    tp.add_bulk(tasks.begin(), tasks.end());
+                    done.notify();
+                });
+                done.wait();
+
+                utils::semaphore system_done(1);
+                system_executor::get_system_executor().add([&] {
+                    while (completed < 500) {
+                        std::this_thread::yield();
+                    }
+                    system_done.notify();
+                });
+                system_done.wait();
+            }
+
+            THEN("every task runs once"){
+                REQUIRE(completed == 500);
+            }
+        }
+        WHEN("an index range is added with add_n"){
+            const size_t count = 1000;
+            std::vector<std::atomic<int>> hits(count);
+            for (auto& h : hits) {
+                h = 0;
+            }
+            {
+                thread_pool tp(4);
+                serial_executor se(&tp);
+                abstract_executor ae(tp);
+                abstract_executor serial_ae(se);
+
+                tp.add_n(count, [&](size_t i) { ++hits[i]; });
+                ae.add_n(count, [&](size_t i) { ++hits[i]; });
+                serial_ae.add_n(count, [&](size_t i) { ++hits[i]; });
+                tp.add_n(0, [&](size_t i) { ++hits[i]; });
+            }
+
+            THEN("every index runs once per call"){
+                bool all = true;
+                for (auto& h : hits) {
+                    all = all && h == 3;
+                }
+                REQUIRE(all);
+            }
+        }
+    }
+}
+
+SCENARIO("executor metrics", "[metrics][executor]"){
+    GIVEN("a thread_pool with a blocked worker"){
+        WHEN("tasks and timers are queued behind it"){
+            utils::semaphore started(1);
+            utils::semaphore release(1);
+            executor_metrics busy;
+            executor_metrics done;
+            executor_metrics through_abstract;
+            {
+                thread_pool tp(1);
+                abstract_executor ae(tp);
+
+                tp.add([&] {
+                    started.notify();
+                    release.wait();
+                });
+                started.wait();
+                for (int i = 0; i < 10; ++i) {
+                    tp.add([] {});
+                }
+                tp.add_after(std::chrono::milliseconds(300), [] {});
+
+                busy = tp.metrics();
+                release.notify();
+
+                // The timer is still pending, wait for everything else
+                while (tp.metrics().completed < 11) {
+                    std::this_thread::yield();
+                }
+                done = tp.metrics();
+                through_abstract = ae.metrics();
+            }
+
+            THEN("the counters follow the tasks"){
+                REQUIRE(busy.running == 1);
+                REQUIRE(busy.queued == 10);
+                REQUIRE(busy.timers_pending == 1);
+                REQUIRE(done.completed == 11);
+                REQUIRE(done.queued == 0);
+                REQUIRE(done.workers.size() == 1);
+                REQUIRE(done.workers[0].completed == 11);
+                REQUIRE(done.run_time.count() == 11);
+                REQUIRE(done.queue_wait.count() == 11);
+                REQUIRE(done.run_time.quantile(1.0) > 0);
+                REQUIRE(through_abstract.completed == 11);
+            }
+        }
+    }
+    GIVEN("a serial_executor"){
+        WHEN("tasks run through it"){
+            executor_metrics m;
+            {
+                thread_pool tp;
+                serial_executor se(&tp);
+                utils::semaphore done(1);
+                for (int i = 0; i < 100; ++i) {
+                    se.add([] {});
+                }
+                se.add([&] { done.notify(); });
+                done.wait();
+                while (se.metrics().completed < 101) {
+                    std::this_thread::yield();
+                }
+                m = se.metrics();
+            }
+
+            THEN("the strand counts them"){
+                REQUIRE(m.completed == 101);
+                REQUIRE(m.queued == 0);
+                REQUIRE(m.queue_wait.count() == 101);
+            }
+        }
+    }
+    GIVEN("a latency_histogram"){
+        WHEN("values are added"){
+            latency_histogram h;
+            h.buckets[latency_histogram::bucket_of(0)]++;
+            h.buckets[latency_histogram::bucket_of(1000)]++;
+            h.buckets[latency_histogram::bucket_of(1000000)]++;
+
+            THEN("quantiles bound them from above"){
+                REQUIRE(latency_histogram::bucket_of(1) == 0);
+                REQUIRE(latency_histogram::bucket_of(1024) == 10);
+                REQUIRE(h.count() == 3);
+                REQUIRE(h.quantile(0.5) >= 1000);
+                REQUIRE(h.quantile(0.5) < 2048);
+                REQUIRE(h.quantile(1.0) >= 1000000);
+            }
+        }
+    }
+}
+
+SCENARIO("thread_pool placement options", "[thread_pool][executor]"){
+    GIVEN("a thread_pool split by NUMA node with pinned workers"){
+        WHEN("tasks fan out from its workers"){
+            std::atomic<int> completed{0};
+            size_t nodes = 0;
+            {
+                thread_pool_options options;
+                options.threads = 4;
+                options.numa = true;
+                options.pin = true;
+                thread_pool tp(options);
+                nodes = tp.node_count();
+
+                for (int i = 0; i < 10; ++i) {
+                    tp.add([&] {
+                        for (int j = 0; j < 100; ++j) {
+                            tp.add([&] { ++completed; });
+                        }
+                        ++completed;
+                    });
+                }
+            }
+
+            THEN("all must finish"){
+                REQUIRE(nodes >= 1);
+                REQUIRE(completed == 1010);
+            }
+        }
+    }
+    GIVEN("the NUMA system_executor"){
+        WHEN("a task is added"){
+            utils::semaphore s(1);
+            system_executor::get_numa_system_executor().add([&] { s.notify(); });
+            s.wait();
+
+            THEN("it runs"){
+                SUCCEED();
+            }
+        }
+    }
+#if defined(__linux__)
+    GIVEN("a sysfs cpulist"){
+        WHEN("it is parsed"){
+            std::vector<int> cpus = details::cpu_topology::parse_cpu_list("0-3,8,10-11\n");
+
+            THEN("ranges are expanded"){
+                std::vector<int> expected = { 0, 1, 2, 3, 8, 10, 11 };
+                REQUIRE(cpus == expected);
+                REQUIRE(!details::cpu_topology::system().nodes.empty());
+            }
+        }
+    }
+#endif
+}
+
+SCENARIO("thread_pool worker count is elastic", "[elastic][thread_pool][executor]"){
+    GIVEN("a thread_pool of two workers that may shrink to one and grow to eight"){
+        thread_pool_options options;
+        options.threads = 2;
+        options.min_threads = 1;
+        options.max_threads = 8;
+        options.keep_alive = std::chrono::milliseconds(200);
+
+        WHEN("both workers block on a task queued behind them"){
+            std::atomic<int> completed{0};
+            {
+                utils::semaphore gate(1);
+                utils::semaphore blocked(2);
+                thread_pool tp(options);
+                for (int i = 0; i < 2; ++i) {
+                    tp.add([&] {
+                        blocking_region hint;
+                        blocked.notify();
+                        gate.wait();
+                        ++completed;
+                    });
+                }
+                blocked.wait();
+                tp.add([&] {
+                    gate.notify();
+                    ++completed;
+                });
+            }
+
+            THEN("a stand-in worker runs it"){
+                REQUIRE(completed == 3);
+            }
+        }
+        WHEN("a single-worker pool waits on a future from its own task"){
+            int answer = 0;
+            {
+                utils::semaphore s(1);
+                thread_pool tp(1);
+                tp.add([&] {
+                    task_future<int> f = tp.add_with_result([] { return 42; });
+                    answer = f.get();
+                    s.notify();
+                });
+                s.wait();
+            }
+
+            THEN("the wait does not starve the pool"){
+                REQUIRE(answer == 42);
+            }
+        }
+        WHEN("the pool is idle for longer than the keep-alive"){
+            utils::semaphore s(1);
+            thread_pool tp(options);
+            size_t initial = tp.metrics().threads;
+            while (tp.metrics().threads > 1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            size_t idle = tp.metrics().threads;
+            tp.add([&] { s.notify(); });
+            s.wait();
+
+            THEN("it keeps min_threads and still runs tasks"){
+                REQUIRE(initial == 2);
+                REQUIRE(idle == 1);
+            }
+        }
+        WHEN("the concurrency is changed at runtime"){
+            std::atomic<int> arrived{0};
+            utils::semaphore s(4);
+            thread_pool tp(options);
+            tp.set_concurrency(4);
+            size_t raised = tp.concurrency();
+            for (int i = 0; i < 4; ++i) {
+                tp.add([&] {
+                    // Only returns once all four run at the same time
+                    ++arrived;
+                    while (arrived < 4) {
+                        std::this_thread::yield();
+                    }
+                    s.notify();
+                });
+            }
+            s.wait();
+
+            tp.set_concurrency(100);
+            size_t capped = tp.concurrency();
+            tp.set_concurrency(1);
+            while (tp.metrics().threads > 1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+
+            THEN("workers are added up to the new target and leave once it drops"){
+                REQUIRE(raised == 4);
+                REQUIRE(capped == 8);
+                REQUIRE(tp.concurrency() == 1);
+                REQUIRE(tp.metrics().threads == 1);
+            }
+        }
+    }
+}
+
+SCENARIO("thread_pool shutdown", "[shutdown][thread_pool][executor]"){
+    GIVEN("a thread_pool(1)"){
+        WHEN("it is shut down with a timer an hour away"){
+            std::atomic<int> ran{0};
+            thread_pool tp(1);
+            tp.add_after(std::chrono::hours(1), [&] { ++ran; });
+            for (int i = 0; i < 10; ++i) {
+                tp.add([&] { ++ran; });
+            }
+            auto started = std::chrono::steady_clock::now();
+            shutdown_result result = tp.shutdown();
+            auto took = std::chrono::steady_clock::now() - started;
+            tp.add([&] { ++ran; });
+
+            THEN("queued tasks run, the timer and later tasks are discarded"){
+                REQUIRE(ran == 10);
+                REQUIRE(result.drained);
+                REQUIRE(result.discarded == 1);
+                REQUIRE(took < std::chrono::seconds(10));
+                REQUIRE(tp.metrics().timers_pending == 0);
+            }
+        }
+        WHEN("it is shut down at once while its worker is blocked"){
+            std::atomic<int> ran{0};
+            std::atomic<int> seen{0};
+            utils::semaphore gate(1);
+            utils::semaphore blocked(1);
+            thread_pool tp(1);
+            tp.add([&] {
+                blocked.notify();
+                gate.wait();
+                ++ran;
+            });
+            blocked.wait();
+            for (int i = 0; i < 20; ++i) {
+                tp.add([&] { ++ran; });
+            }
+            tp.add_n(8, [&](size_t) { ++ran; });
+            std::thread releaser([&] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                gate.notify();
+            });
+            shutdown_result result = tp.shutdown_now([&](unique_task&) { ++seen; });
+            releaser.join();
+
+            THEN("the running task finishes and everything queued is handed to the handler"){
+                REQUIRE(ran == 1);
+                REQUIRE(!result.drained);
+                REQUIRE(result.discarded == static_cast<size_t>(seen));
+                REQUIRE(seen >= 20);
+                REQUIRE(tp.metrics().queued == 0);
+            }
+        }
+        WHEN("the drain deadline passes before the queue is empty"){
+            std::atomic<int> ran{0};
+            thread_pool tp(1);
+            for (int i = 0; i < 10; ++i) {
+                tp.add([&] {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                    ++ran;
+                });
+            }
+            shutdown_result result = tp.shutdown(std::chrono::milliseconds(50));
+
+            THEN("the tasks left are discarded"){
+                REQUIRE(!result.drained);
+                REQUIRE(static_cast<size_t>(ran) + result.discarded == 10);
+                REQUIRE(result.discarded > 0);
+            }
+        }
+        WHEN("a task adds more work while the pool drains"){
+            std::atomic<int> ran{0};
+            thread_pool tp(1);
+            tp.add([&] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                tp.add([&] { ++ran; });
+                ++ran;
+            });
+            shutdown_result result = tp.shutdown(std::chrono::seconds(10));
+
+            THEN("the continuation still runs"){
+                REQUIRE(ran == 2);
+                REQUIRE(result.drained);
+                REQUIRE(result.discarded == 0);
+            }
+        }
+        WHEN("a serial_executor and a strand have closures queued when it is shut down at once"){
+            std::atomic<int> ran{0};
+            utils::semaphore gate(1);
+            utils::semaphore blocked(1);
+            thread_pool tp(1);
+            bool idle = false;
+            {
+                serial_executor se(&tp);
+                strand st;
+                partitioned_serial_executor pe(&tp, 4);
+                tp.add([&] {
+                    blocked.notify();
+                    gate.wait();
+                });
+                blocked.wait();
+                for (int i = 0; i < 5; ++i) {
+                    se.add([&] { ++ran; });
+                    st.add(&tp, [&] { ++ran; });
+                    pe.add(i, [&] { ++ran; });
+                }
+                std::thread releaser([&] {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    gate.notify();
+                });
+                tp.shutdown_now();
+                releaser.join();
+                idle = st.idle() && se.metrics().queued == 0 && pe.metrics().queued == 0;
+            }
+
+            THEN("their drain jobs drop the closures and both can be destroyed"){
+                REQUIRE(ran == 0);
+                REQUIRE(idle);
+            }
+        }
+    }
+}
+
+SCENARIO("bounded executor queues", "[capacity][thread_pool][executor]"){
+    GIVEN("a thread_pool(1) with room for four tasks behind a blocked worker"){
+        thread_pool_options options;
+        options.threads = 1;
+        options.capacity = 4;
+
+        WHEN("try_add and add_for meet a full queue"){
+            std::atomic<int> ran{0};
+            utils::semaphore gate(1);
+            utils::semaphore blocked(1);
+            thread_pool tp(options);
+            tp.add([&] {
+                blocked.notify();
+                gate.wait();
+            });
+            blocked.wait();
+            int admitted = 0;
+            for (int i = 0; i < 5; ++i) {
+                admitted += tp.try_add([&] { ++ran; });
+            }
+            auto state = std::make_shared<int>(0);
+            auto keep = [&ran, state] { ++ran; };
+            bool kept = !tp.try_add(keep) && state.use_count() == 2;
+            bool timed_out = !tp.add_for(std::chrono::milliseconds(20), [&] { ++ran; });
+            std::thread releaser([&] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                gate.notify();
+            });
+            bool waited = tp.add_for(std::chrono::seconds(10), [&] { ++ran; });
+            releaser.join();
+            tp.shutdown();
+
+            THEN("they fail without taking the closure, or wait for a task to start"){
+                REQUIRE(admitted == 4);
+                REQUIRE(kept);
+                REQUIRE(timed_out);
+                REQUIRE(waited);
+                REQUIRE(ran == 5);
+                REQUIRE(tp.metrics().rejected == 0);
+            }
+        }
+        WHEN("add() meets a full queue under each policy"){
+            std::thread::id ran_on;
+            std::thread::id caller = std::this_thread::get_id();
+            uint64_t rejected[3] = { 0, 0, 0 };
+            const overflow_policy policies[3] = { overflow_policy::reject, overflow_policy::run_in_caller, overflow_policy::drop_oldest };
+            std::vector<int> orders[3];
+            for (int p = 0; p < 3; ++p) {
+                utils::semaphore gate(1);
+                utils::semaphore blocked(1);
+                options.overflow = policies[p];
+                thread_pool tp(options);
+                tp.add([&] {
+                    blocked.notify();
+                    gate.wait();
+                });
+                blocked.wait();
+                for (int i = 1; i <= 6; ++i) {
+                    tp.add([&orders, &ran_on, p, i] {
+                        orders[p].push_back(i);
+                        ran_on = std::this_thread::get_id();
+                    });
+                }
+                gate.notify();
+                tp.shutdown();
+                rejected[p] = tp.metrics().rejected;
+            }
+
+            THEN("reject drops the newest, run_in_caller runs them at once, drop_oldest drops the oldest"){
+                REQUIRE(orders[0] == std::vector<int>({ 1, 2, 3, 4 }));
+                REQUIRE(rejected[0] == 2);
+                // The caller ran 5 and 6 while the worker was blocked; 4 ran last, on the worker
+                REQUIRE(orders[1] == std::vector<int>({ 5, 6, 1, 2, 3, 4 }));
+                REQUIRE(rejected[1] == 0);
+                REQUIRE(ran_on != caller);
+                REQUIRE(orders[2] == std::vector<int>({ 3, 4, 5, 6 }));
+                REQUIRE(rejected[2] == 2);
+            }
+        }
+        WHEN("a capacity is set on an unbounded pool"){
+            std::atomic<int> ran{0};
+            utils::semaphore gate(1);
+            utils::semaphore blocked(1);
+            thread_pool tp(1);
+            tp.add([&] {
+                blocked.notify();
+                gate.wait();
+            });
+            blocked.wait();
+            for (int i = 0; i < 3; ++i) {
+                tp.add([&] { ++ran; });
+            }
+            tp.set_capacity(1);
+            bool first = tp.try_add([&] { ++ran; });
+            bool second = tp.try_add([&] { ++ran; });
+            size_t capacity = tp.capacity();
+            gate.notify();
+            tp.shutdown();
+
+            THEN("only tasks added from then on count against it"){
+                REQUIRE(capacity == 1);
+                REQUIRE(first);
+                REQUIRE(!second);
+                REQUIRE(ran == 4);
+            }
+        }
+        WHEN("a strand and a serial_executor add to the full queue"){
+            std::atomic<int> ran{0};
+            utils::semaphore gate(1);
+            utils::semaphore blocked(1);
+            thread_pool tp(options);
+            bool idle = false;
+            uint64_t rejected = 0;
+            {
+                strand st;
+                serial_executor se(&tp);
+                tp.add([&] {
+                    blocked.notify();
+                    gate.wait();
+                });
+                blocked.wait();
+                for (int i = 0; i < 4; ++i) {
+                    tp.add([&] { ++ran; });
+                }
+                for (int i = 0; i < 3; ++i) {
+                    st.add(&tp, [&] { ++ran; });
+                    se.add([&] { ++ran; });
+                }
+                rejected = tp.metrics().rejected;
+                gate.notify();
+                tp.shutdown();
+                idle = st.idle();
+            }
+
+            THEN("their drain jobs still get in and both run everything"){
+                REQUIRE(rejected == 0);
+                REQUIRE(ran == 10);
+                REQUIRE(idle);
+            }
+        }
+        WHEN("drop_oldest makes room among strand and serial_executor work"){
+            std::vector<int> order;
+            utils::semaphore gate(1);
+            utils::semaphore blocked(1);
+            options.capacity = 1;
+            options.overflow = overflow_policy::drop_oldest;
+            thread_pool tp(options);
+            uint64_t rejected = 0;
+            bool idle = false;
+            {
+                strand st;
+                serial_executor se(&tp);
+                tp.add([&] {
+                    blocked.notify();
+                    gate.wait();
+                });
+                blocked.wait();
+                se.add([&] { order.push_back(1); });
+                st.add(&tp, [&] { order.push_back(2); });
+                tp.add([&] { order.push_back(3); });
+                tp.add([&] { order.push_back(4); });
+                rejected = tp.metrics().rejected;
+                gate.notify();
+                tp.shutdown();
+                idle = st.idle();
+            }
+
+            THEN("only the pool's own task is dropped and the drain jobs survive"){
+                REQUIRE(order == std::vector<int>({ 1, 2, 4 }));
+                REQUIRE(rejected == 1);
+                REQUIRE(idle);
+            }
+        }
+    }
+    GIVEN("a serial_executor with room for two closures"){
+        WHEN("it is full"){
+            std::vector<int> order;
+            bool admitted[3] = { false, false, false };
+            {
+                utils::semaphore gate(1);
+                utils::semaphore blocked(1);
+                thread_pool tp(2);
+                serial_executor se(&tp, 2, overflow_policy::run_in_caller);
+                se.add([&] {
+                    blocked.notify();
+                    gate.wait();
+                    order.push_back(0);
+                });
+                blocked.wait();
+                admitted[0] = se.try_add([&] { order.push_back(1); });
+                admitted[1] = se.try_add([&] { order.push_back(2); });
+                admitted[2] = se.try_add([&] { order.push_back(3); });
+                std::thread releaser([&] {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                    gate.notify();
+                });
+                // Waits for space instead of running out of turn
+                se.add([&] { order.push_back(3); });
+                releaser.join();
+                utils::semaphore done(1);
+                se.add([&] { done.notify(); });
+                done.wait();
+            }
+
+            THEN("try_add fails and add() waits, keeping the order"){
+                REQUIRE(admitted[0]);
+                REQUIRE(admitted[1]);
+                REQUIRE(!admitted[2]);
+                REQUIRE(order == std::vector<int>({ 0, 1, 2, 3 }));
+            }
+        }
+    }
+}
+
+SCENARIO("thread_pool priorities", "[priority][thread_pool][executor]"){
+    GIVEN("a thread_pool(1) with a blocked worker"){
+        WHEN("tasks of every priority queue up"){
+            std::vector<int> order;
+            {
+                thread_pool tp(1);
+                abstract_executor ae(tp);
+                utils::semaphore started(1);
+                utils::semaphore release(1);
+                tp.add([&] {
+                    started.notify();
+                    release.wait();
+                });
+                started.wait();
+
+                const task_priority priorities[] = { task_priority::background, task_priority::low, task_priority::normal, task_priority::high };
+                for (task_priority p : priorities) {
+                    for (int i = 0; i < 5; ++i) {
+                        ae.add(p, [&order, p] { order.push_back(static_cast<int>(p)); });
+                    }
+                }
+                release.notify();
+            }
+
+            THEN("they run most urgent first"){
+                REQUIRE(order.size() == 20);
+                REQUIRE(std::is_sorted(order.begin(), order.end()));
+            }
+        }
+        WHEN("a background task waits behind a flood of high priority tasks"){
+            std::vector<int> order;
+            {
+                thread_pool tp(1);
+                utils::semaphore started(1);
+                utils::semaphore release(1);
+                tp.add([&] {
+                    started.notify();
+                    release.wait();
+                });
+                started.wait();
+
+                tp.add(task_priority::background, [&] { order.push_back(-1); });
+                for (int i = 0; i < 1000; ++i) {
+                    tp.add(task_priority::high, [&order, i] { order.push_back(i); });
+                }
+                release.notify();
+            }
+
+            THEN("aging lets it run before the flood is over"){
+                auto position = std::find(order.begin(), order.end(), -1) - order.begin();
+                REQUIRE(order.size() == 1001);
+                REQUIRE(position > 0);
+                REQUIRE(position < 1000);
+            }
+        }
+    }
+}
+
+SCENARIO("dispatch runs inline on the same executor", "[dispatch][thread_pool][serial_executor][executor]"){
+    GIVEN("a thread_pool and a serial_executor on it"){
+        WHEN("dispatch is called from inside and outside the executors"){
+            bool pool_inline = false;
+            bool strand_inline = false;
+            bool idle_strand_inline = false;
+            bool abstract_inline = false;
+            std::atomic<bool> outside_inline{ true };
+            std::atomic<int> chain{ 0 };
+            {
+                utils::semaphore done(4);
+                thread_pool tp(2);
+                serial_executor se(&tp);
+
+                std::thread::id caller = std::this_thread::get_id();
+                tp.dispatch([&] {
+                    outside_inline = std::this_thread::get_id() == caller;
+                    done.notify();
+                });
+                tp.add([&] {
+                    bool ran = false;
+                    tp.dispatch([&] { ran = true; });
+                    pool_inline = ran;
+
+                    ran = false;
+                    se.dispatch([&] { ran = true; });
+                    idle_strand_inline = ran;
+                    done.notify();
+
+                    se.add([&] {
+                        bool ran = false;
+                        se.dispatch([&] { ran = true; });
+                        strand_inline = ran;
+
+                        ran = false;
+                        abstract_executor ae(se);
+                        ae.dispatch([&] { ran = true; });
+                        abstract_inline = ran;
+                        done.notify();
+                    });
+                });
+
+                // Each link dispatches the next; past the depth bound links are queued instead
+                std::function<void()> link = [&] {
+                    if (++chain < 1000) {
+                        tp.dispatch(link);
+                    } else {
+                        done.notify();
+                    }
+                };
+                tp.add(link);
+                done.wait();
+            }
+
+            THEN("only callers already on the executor run the closure inline"){
+                REQUIRE_FALSE(outside_inline);
+                REQUIRE(pool_inline);
+                REQUIRE(idle_strand_inline);
+                REQUIRE(strand_inline);
+                REQUIRE(abstract_inline);
+            }
+            THEN("a long same-executor chain completes without exhausting the stack"){
+                REQUIRE(chain == 1000);
+            }
+        }
+    }
+}
+
+SCENARIO("add_with_result futures", "[future][thread_pool][serial_executor][abstract_executor][executor]"){
+    GIVEN("a thread_pool, a serial_executor and an abstract_executor"){
+        thread_pool tp(2);
+        serial_executor se(&tp);
+        abstract_executor ae(tp);
+
+        WHEN("stages are chained across executors"){
+            task_future<int> first = tp.add_with_result([] { return 20; });
+            task_future<std::string> last = first
+                .then(se, [](int v) { return v + 1; })
+                .then(ae, [](int v) { return std::to_string(v * 2); });
+            THEN("each stage gets the previous result"){
+                REQUIRE_FALSE(first.valid());
+                REQUIRE(last.get() == "42");
+            }
+        }
+        WHEN("a stage throws"){
+            bool skipped = true;
+            task_future<void> failed = se.add_with_result([]() -> int { throw std::runtime_error("boom"); })
+                .then(tp, [&](int) { skipped = false; });
+            THEN("later stages are skipped and get() rethrows"){
+                REQUIRE_THROWS_AS(failed.get(), std::runtime_error);
+                REQUIRE(skipped);
+            }
+        }
+        WHEN("a continuation is attached to a finished future"){
+            task_future<void> done = ae.add_with_result([] {});
+            done.wait();
+            REQUIRE(done.is_ready());
+            task_future<int> next = done.then(tp, [] { return 7; });
+            THEN("it still runs"){
+                REQUIRE(next.get() == 7);
+            }
+        }
+        WHEN("futures are combined"){
+            std::vector<task_future<int>> all;
+            std::vector<task_future<int>> any;
+            for (int i = 0; i < 10; ++i) {
+                all.push_back(tp.add_with_result([i] { return i; }));
+                any.push_back(tp.add_with_result([i] { return i * 10; }));
+            }
+            task_future<std::vector<int>> values = when_all(all.begin(), all.end());
+            task_future<when_any_result<int>> first = when_any(any.begin(), any.end());
+            THEN("when_all keeps input order and when_any reports the winner"){
+                std::vector<int> expected;
+                for (int i = 0; i < 10; ++i) {
+                    expected.push_back(i);
+                }
+                REQUIRE(values.get() == expected);
+                when_any_result<int> winner = first.get();
+                REQUIRE(winner.index < 10);
+                REQUIRE(winner.value == static_cast<int>(winner.index) * 10);
+            }
+        }
+    }
+}
+
+#if EXTR_COROUTINES
+task<int> answer_on(serial_executor& se) {
+    co_await schedule_on(se);
+    co_return 21;
+}
+
+task<int> waits_on_executors(thread_pool& tp, serial_executor& se, abstract_executor_ref ref, std::thread::id caller, bool& hopped) {
+    using namespace std::chrono;
+    co_await schedule_on(tp);
+    hopped = std::this_thread::get_id() != caller;
+    co_await tp.after(milliseconds(20));
+    co_await se.after(milliseconds(20));
+    co_await ref.at(system_clock::now() + milliseconds(20));
+    int doubled = co_await answer_on(se) * 2;
+    co_return doubled;
+}
+
+task<void> fails() {
+    throw std::runtime_error("boom");
+    co_return;
+}
+
+task<int> awaits_future(thread_pool& tp) {
+    int v = co_await tp.add_with_result([] { return 5; });
+    co_return v + 1;
+}
+
+SCENARIO("coroutines on executors", "[coroutine][thread_pool][serial_executor][executor]"){
+    GIVEN("a thread_pool and a serial_executor on it"){
+        thread_pool tp(2);
+        serial_executor se(&tp);
+
+        WHEN("a task hops between executors and waits on their timers"){
+            using namespace std::chrono;
+            bool hopped = false;
+            auto start = steady_clock::now();
+            task_future<int> result = spawn(tp, waits_on_executors(tp, se, &tp, std::this_thread::get_id(), hopped));
+            int value = result.get();
+            auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start).count();
+            THEN("it resumes on the executors after each deadline and returns its value"){
+                REQUIRE(hopped);
+                REQUIRE(value == 42);
+                REQUIRE(elapsed >= 60);
+            }
+        }
+        WHEN("a task throws"){
+            task_future<void> result = spawn(se, fails());
+            THEN("the spawned future rethrows"){
+                REQUIRE_THROWS_AS(result.get(), std::runtime_error);
+            }
+        }
+        WHEN("a task awaits a task_future"){
+            task_future<int> result = spawn(tp, awaits_future(tp));
+            THEN("it gets the future's value"){
+                REQUIRE(result.get() == 6);
+            }
+        }
     }
 }
-
+#endif
 
 SCENARIO("serial_executor", "[serial_executor][executor]"){
     GIVEN("a serial_executor"){
@@ -148,6 +1160,255 @@ SCENARIO("serial_executor", "[serial_executor][executor]"){
                 REQUIRE(task3_passed);
             }
         }
+        WHEN("the last copy is captured by one of its own closures"){
+            std::atomic<int> ran{0};
+            utils::semaphore go(1);
+            thread_pool tp(1);
+            {
+                serial_executor se(&tp);
+                se.add([&] { go.wait(); });
+                serial_executor copy(se);
+                se.add([copy, &ran] { ++ran; });
+                se.add([&] { ++ran; });
+            }
+            go.notify();
+            tp.shutdown();
+
+            THEN("the strand finishes its queue and goes with its last closure"){
+                REQUIRE(ran == 2);
+            }
+        }
+    }
+}
+
+SCENARIO("serial_executor keeps per-producer order", "[serial_executor][executor]"){
+    GIVEN("a serial_executor over a thread_pool"){
+        WHEN("several threads add tasks concurrently"){
+            const int producers = 4;
+            const int per_producer = 2000;
+            std::vector<int> last_seen(producers, -1);
+            std::atomic<int> running{0};
+            std::atomic<bool> overlapped{false};
+            std::atomic<bool> reordered{false};
+            std::atomic<int> completed{0};
+            {
+                thread_pool tp(4);
+                serial_executor se(&tp);
+
+                std::vector<std::thread> threads;
+                for (int p = 0; p < producers; ++p) {
+                    threads.emplace_back([&, p] {
+                        for (int i = 0; i < per_producer; ++i) {
+                            se.add([&, p, i] {
+                                if (running.fetch_add(1) != 0) {
+                                    overlapped = true;
+                                }
+                                // Plain vector access is safe only because the strand never overlaps tasks
+                                if (last_seen[p] != i - 1) {
+                                    reordered = true;
+                                }
+                                last_seen[p] = i;
+                                running.fetch_sub(1);
+                                ++completed;
+                            });
+                        }
+                    });
+                }
+                for (auto& t : threads) {
+                    t.join();
+                }
+            }
+
+            THEN("all must finish"){
+                REQUIRE(completed == producers * per_producer);
+            }
+            THEN("tasks never overlap"){
+                REQUIRE(!overlapped);
+            }
+            THEN("each producer's tasks run in submission order"){
+                REQUIRE(!reordered);
+            }
+        }
+    }
+}
+
+SCENARIO("strand", "[strand][executor]"){
+    GIVEN("many strands on one thread_pool"){
+        WHEN("producers add numbered closures to every strand"){
+            const int strands = 1000;
+            const int producers = 4;
+            const int per_producer = 20;
+            std::vector<std::vector<int>> seen(strands);
+            bool idle_before = false;
+            bool idle_after = false;
+            {
+                thread_pool tp(4);
+                std::vector<strand> s(strands);
+                idle_before = s[0].idle();
+                std::vector<std::thread> threads;
+                for (int p = 0; p < producers; ++p) {
+                    threads.emplace_back([&, p] {
+                        for (int i = 0; i < per_producer; ++i) {
+                            for (int k = 0; k < strands; ++k) {
+                                std::vector<int>& out = seen[k];
+                                int value = p * per_producer + i;
+                                s[k].add(&tp, [&out, value] { out.push_back(value); });
+                            }
+                        }
+                    });
+                }
+                for (auto& t : threads) {
+                    t.join();
+                }
+                for (auto& one : s) {
+                    while (!one.idle()) {
+                        std::this_thread::yield();
+                    }
+                }
+                idle_after = s[strands - 1].idle();
+            }
+
+            THEN("an idle strand is one word and every strand keeps each producer's order"){
+                REQUIRE(sizeof(strand) == sizeof(void*));
+                REQUIRE(idle_before);
+                REQUIRE(idle_after);
+                bool ordered = true;
+                for (auto const& out : seen) {
+                    ordered = ordered && out.size() == static_cast<size_t>(producers * per_producer);
+                    std::vector<int> last(producers, -1);
+                    for (int v : out) {
+                        ordered = ordered && v > last[v / per_producer];
+                        last[v / per_producer] = v;
+                    }
+                }
+                REQUIRE(ordered);
+            }
+        }
+        WHEN("a strand_executor is used as an executor"){
+            bool nested_inline = false;
+            bool claimed_inline = false;
+            int result = 0;
+            {
+                thread_pool tp(2);
+                strand s;
+                strand_executor se(s, &tp);
+                abstract_executor ae(se);
+                utils::semaphore done(1);
+                tp.add([&] {
+                    bool ran = false;
+                    se.dispatch([&] { ran = true; });
+                    claimed_inline = ran;
+                    ae.add([&] {
+                        bool inner = false;
+                        se.dispatch([&] { inner = true; });
+                        nested_inline = inner;
+                        done.notify();
+                    });
+                });
+                done.wait();
+                result = se.add_with_result([] { return 3; }).get();
+                while (!s.idle()) {
+                    std::this_thread::yield();
+                }
+            }
+
+            THEN("dispatch runs inline on the strand and futures work"){
+                REQUIRE(claimed_inline);
+                REQUIRE(nested_inline);
+                REQUIRE(result == 3);
+            }
+        }
+    }
+}
+
+SCENARIO("partitioned_serial_executor", "[partitioned_serial_executor][executor]"){
+    GIVEN("a partitioned_serial_executor on a thread_pool"){
+        WHEN("producers add closures for many keys"){
+            const int keys = 100;
+            const int producers = 4;
+            const int per_producer = 50;
+            std::vector<std::vector<int>> seen(keys);
+            size_t shards = 0;
+            bool same_shard = false;
+            {
+                thread_pool tp(4);
+                partitioned_serial_executor pse(&tp, 50);
+                shards = pse.shard_count();
+                same_shard = pse.shard_of(std::string("account-7")) == pse.shard_of(std::string("account-7"));
+                std::vector<std::thread> threads;
+                for (int p = 0; p < producers; ++p) {
+                    threads.emplace_back([&, p] {
+                        for (int i = 0; i < per_producer; ++i) {
+                            for (int k = 0; k < keys; ++k) {
+                                std::vector<int>& out = seen[k];
+                                int value = p * per_producer + i;
+                                pse.add(k, [&out, value] { out.push_back(value); });
+                            }
+                        }
+                    });
+                }
+                for (auto& t : threads) {
+                    t.join();
+                }
+            }
+
+            THEN("the table is fixed and every key keeps each producer's order"){
+                REQUIRE(shards == 64);
+                REQUIRE(same_shard);
+                bool ordered = true;
+                for (auto const& out : seen) {
+                    ordered = ordered && out.size() == static_cast<size_t>(producers * per_producer);
+                    std::vector<int> last(producers, -1);
+                    for (int v : out) {
+                        ordered = ordered && v > last[v / per_producer];
+                        last[v / per_producer] = v;
+                    }
+                }
+                REQUIRE(ordered);
+            }
+        }
+        WHEN("one key is blocked"){
+            std::vector<size_t> depths;
+            executor_metrics blocked;
+            size_t hot = 0;
+            size_t other = 0;
+            {
+                thread_pool tp(2);
+                partitioned_serial_executor pse(&tp, 16);
+                utils::semaphore started(1);
+                utils::semaphore release(1);
+                hot = pse.shard_of(42);
+                pse.add(42, [&] {
+                    started.notify();
+                    release.wait();
+                });
+                started.wait();
+                for (int i = 0; i < 10; ++i) {
+                    pse.add(42, [] {});
+                }
+                other = pse.shard_of(43);
+                utils::semaphore other_done(1);
+                if (other != hot) {
+                    pse.add(43, [&] { other_done.notify(); });
+                } else {
+                    other_done.notify();
+                }
+                other_done.wait();
+                while (pse.queue_depth(other) != 0 && other != hot) {
+                    std::this_thread::yield();
+                }
+                depths = pse.queue_depths();
+                blocked = pse.metrics();
+                release.notify();
+            }
+
+            THEN("its shard reports the backlog while other keys proceed"){
+                REQUIRE(depths.size() == 16);
+                REQUIRE(depths[hot] == 11);
+                REQUIRE(blocked.running == 1);
+                REQUIRE(blocked.queued == 10);
+            }
+        }
     }
 }
 
@@ -186,6 +1447,103 @@ SCENARIO("abstract_executor", "[abstract_executor][executor]"){
     }
 }
 
+namespace {
+// C++11 lambdas cannot capture by move, so move-only state is carried by a functor
+struct owning_task {
+    std::unique_ptr<int> value;
+    std::atomic<int>* sum;
+    void operator()() { *sum += *value; }
+};
+
+struct large_task {
+    char padding[256];
+    std::atomic<int>* sum;
+    void operator()() { *sum += padding[0] + padding[255]; }
+};
+}
+
+SCENARIO("unique_task carries move-only closures", "[unique_task][executor]"){
+    GIVEN("closures owning a unique_ptr"){
+        WHEN("they are added to every kind of executor"){
+            std::atomic<int> sum{0};
+            {
+                thread_pool tp;
+                serial_executor se(&tp);
+                abstract_executor ae(tp);
+                abstract_executor_ref ar = &tp;
+
+                tp.add(owning_task{ std::unique_ptr<int>(new int(1)), &sum });
+                se.add(owning_task{ std::unique_ptr<int>(new int(2)), &sum });
+                ae.add(owning_task{ std::unique_ptr<int>(new int(3)), &sum });
+                ar.add(owning_task{ std::unique_ptr<int>(new int(4)), &sum });
+
+                large_task big;
+                big.padding[0] = 5;
+                big.padding[255] = 5;
+                big.sum = &sum;
+                ae.add(big);
+            }
+
+            THEN("each runs exactly once"){
+                REQUIRE(sum == 20);
+            }
+        }
+    }
+    GIVEN("a unique_task"){
+        WHEN("it is moved"){
+            int calls = 0;
+            unique_task first([&] { ++calls; });
+            unique_task second(std::move(first));
+            second();
+
+            THEN("the target moves with it"){
+                REQUIRE(!first);
+                REQUIRE(!!second);
+                REQUIRE(calls == 1);
+            }
+        }
+    }
+}
+
+SCENARIO("abstract_executor copies", "[abstract_executor][executor]"){
+    GIVEN("abstract_executors over small executors"){
+        static_assert(detail::fits_executor_storage<thread_pool>::value, "thread_pool must be stored inline");
+        static_assert(detail::fits_executor_storage<serial_executor>::value, "serial_executor must be stored inline");
+
+        WHEN("they are copied, moved and assigned"){
+            std::atomic<int> completed{0};
+            {
+                thread_pool tp;
+                serial_executor se(&tp);
+
+                abstract_executor original(tp);
+                abstract_executor copy(original);
+                abstract_executor moved(std::move(copy));
+                abstract_executor assigned(se);
+                assigned = moved;
+                abstract_executor by_ref(std::ref(system_executor::get_system_executor()));
+                abstract_executor_ref se_ref = &se;
+                abstract_executor from_ref(se_ref);
+
+                utils::semaphore s(1);
+                original.add([&] { ++completed; });
+                moved.add([&] { ++completed; });
+                assigned.add([&] { ++completed; });
+                from_ref.add([&] { ++completed; });
+                by_ref.add([&] {
+                    ++completed;
+                    s.notify();
+                });
+                s.wait();
+            }
+
+            THEN("all must finish"){
+                REQUIRE(completed == 5);
+            }
+        }
+    }
+}
+
 SCENARIO("system_executor", "[system_executor][executor]"){
     GIVEN("a system_executor"){
         WHEN("1 task added"){
@@ -219,14 +1577,24 @@ SCENARIO("thread_per_task_executor", "[thread_per_task_executor][executor]"){
                 thread_per_task_executor& tpt = thread_per_task_executor::get_thread_per_task_executor();
 
                 utils::semaphore s(2);
+                std::atomic<int> started{0};
 
+                // Both tasks have to be running at once, otherwise the second may reuse the first one's thread
                 tpt.add([&] {
                     id1 = std::this_thread::get_id();
+                    ++started;
+                    while (started < 2) {
+                        std::this_thread::yield();
+                    }
                     ++completed;
                     s.notify();
                 });
                 tpt.add([&] {
                     id2 = std::this_thread::get_id();
+                    ++started;
+                    while (started < 2) {
+                        std::this_thread::yield();
+                    }
                     ++completed;
                     s.notify();
                 });
@@ -244,6 +1612,99 @@ SCENARIO("thread_per_task_executor", "[thread_per_task_executor][executor]"){
     }
 }
 
+SCENARIO("thread_per_task_executor reuses and reaps threads", "[thread_per_task_executor][executor]"){
+    GIVEN("a thread_per_task_executor with a short keep-alive"){
+        thread_per_task_options options;
+        options.keep_alive = std::chrono::milliseconds(300);
+        options.stack_size = 256 * 1024;
+
+        WHEN("tasks run one after another"){
+            std::vector<std::thread::id> ids;
+            size_t alive = 1;
+            {
+                thread_per_task_executor tpt(options);
+                for (int i = 0; i < 5; ++i) {
+                    utils::semaphore s(1);
+                    tpt.add([&] {
+                        ids.push_back(std::this_thread::get_id());
+                        s.notify();
+                    });
+                    s.wait();
+                    // Let the thread go idle before the next add
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+                while (tpt.thread_count() != 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                alive = tpt.thread_count();
+            }
+
+            THEN("one thread runs them all and exits after the keep-alive"){
+                REQUIRE(ids.size() == 5);
+                REQUIRE(std::count(ids.begin(), ids.end(), ids[0]) == 5);
+                REQUIRE(alive == 0);
+            }
+        }
+        WHEN("more tasks are added than max_threads"){
+            options.max_threads = 2;
+            utils::semaphore release(1);
+            std::atomic<int> started{0};
+            std::atomic<int> completed{0};
+            size_t threads = 0;
+            executor_metrics m;
+            {
+                thread_per_task_executor tpt(options);
+                for (int i = 0; i < 10; ++i) {
+                    tpt.add([&] {
+                        ++started;
+                        release.wait();
+                        ++completed;
+                    });
+                }
+                while (started < 2) {
+                    std::this_thread::yield();
+                }
+                threads = tpt.thread_count();
+                m = tpt.metrics();
+                release.notify();
+            }
+
+            THEN("the rest wait in the overflow queue"){
+                REQUIRE(threads == 2);
+                REQUIRE(m.running == 2);
+                REQUIRE(m.queued == 8);
+                REQUIRE(completed == 10);
+            }
+        }
+#if !defined(_WIN32)
+        WHEN("no thread can be started"){
+            // Below PTHREAD_STACK_MIN, so every pthread_create fails
+            options.stack_size = 1;
+            std::atomic<int> ran{0};
+            bool thrown = false;
+            executor_metrics m;
+            {
+                thread_per_task_executor tpt(options);
+                try {
+                    tpt.add([&] { ++ran; });
+                } catch (std::system_error const&) {
+                    thrown = true;
+                }
+                m = tpt.metrics();
+            }
+
+            THEN("add throws and leaves nothing behind for the destructor to wait on"){
+                REQUIRE(thrown);
+                REQUIRE(ran == 0);
+                REQUIRE(m.queued == 0);
+                REQUIRE(m.running == 0);
+                REQUIRE(m.threads == 0);
+            }
+        }
+#endif
+    }
+}
+
 SCENARIO("thread_pool in relative time", "[time][thread_pool][executor]"){
     GIVEN("a thread_pool"){
         WHEN("one timed task"){
@@ -314,3 +1775,589 @@ SCENARIO("thread_pool in absolute time", "[time][thread_pool][executor]"){
         }
     }
 }
+
+SCENARIO("thread_pool with steady_clock deadlines", "[time][thread_pool][executor]"){
+    GIVEN("a thread_pool"){
+        WHEN("tasks are timed on steady_clock with sub-millisecond offsets"){
+            using namespace std::chrono;
+            typedef steady_clock clock;
+
+            std::atomic<int> completed{0};
+            std::atomic<int> early{0};
+            auto deadline1 = clock::now() + microseconds(1500);
+            auto deadline2 = clock::now() + nanoseconds(2300000);
+            {
+                thread_pool tp;
+
+                tp.add_at(deadline1, [&] {
+                    early += clock::now() < deadline1;
+                    ++completed;
+                });
+                tp.add_at(deadline2, [&] {
+                    early += clock::now() < deadline2;
+                    ++completed;
+                });
+                tp.add_after(microseconds(700), [&] { ++completed; });
+            }
+
+            THEN("all must finish, none early"){
+                REQUIRE(completed == 3);
+                REQUIRE(early == 0);
+            }
+        }
+    }
+}
+
+SCENARIO("timer_wheel expires every timer on its tick", "[time][timer_wheel]"){
+    GIVEN("a timer_wheel"){
+        using details::timer_node;
+        using details::timer_list;
+        using details::timer_wheel;
+
+        WHEN("timers are spread across every level"){
+            const uint64_t start = 12345;
+            timer_wheel wheel(start);
+            std::vector<uint64_t> ticks;
+            for (uint64_t delta = 1; delta < (uint64_t(1) << 40); delta = delta * 3 + 1) {
+                ticks.push_back(start + delta);
+            }
+            std::vector<std::unique_ptr<timer_node>> nodes;
+            timer_list due;
+            for (uint64_t tick : ticks) {
+                nodes.emplace_back(new timer_node(nullptr, 0, tick, nullptr));
+                wheel.insert(nodes.back().get(), due);
+            }
+            timer_node cancelled(nullptr, 0, start + 1000, nullptr);
+            wheel.insert(&cancelled, due);
+            wheel.remove(&cancelled);
+
+            bool early = false;
+            bool late = false;
+            size_t fired = 0;
+            while (wheel.size() > 0) {
+                uint64_t next = wheel.next_tick();
+                timer_list expired;
+                wheel.advance(next, expired);
+                for (timer_node* n = expired.head; n; n = n->due_next) {
+                    early = early || n->tick > wheel.now();
+                    late = late || n->tick < wheel.now();
+                    ++fired;
+                }
+            }
+
+            THEN("each fires exactly once, on time"){
+                REQUIRE(due.head == nullptr);
+                REQUIRE(fired == ticks.size());
+                REQUIRE(!early);
+                REQUIRE(!late);
+            }
+        }
+    }
+}
+
+SCENARIO("thread_pool with many timers", "[time][thread_pool][executor]"){
+    GIVEN("two thread_pools sharing the timer thread"){
+        WHEN("thousands of timed tasks are added"){
+            using namespace std::chrono;
+            typedef steady_clock clock;
+
+            const int count = 5000;
+            std::atomic<int> completed{0};
+            std::atomic<int> early{0};
+            {
+                thread_pool tp1;
+                thread_pool tp2(2);
+                for (int i = 0; i < count; ++i) {
+                    auto delay = milliseconds(i % 200);
+                    auto due = clock::now() + delay;
+                    (i % 2 ? tp1 : tp2).add_after(delay, [&, due] {
+                        if (clock::now() < due) {
+                            ++early;
+                        }
+                        ++completed;
+                    });
+                }
+            }
+
+            THEN("all must finish, none early"){
+                REQUIRE(completed == count);
+                REQUIRE(early == 0);
+            }
+        }
+    }
+}
+
+SCENARIO("thread_pool timer handles", "[time][thread_pool][executor]"){
+    GIVEN("a thread_pool"){
+        using namespace std::chrono;
+
+        WHEN("timers an hour away are cancelled"){
+            std::atomic<int> ran{0};
+            std::weak_ptr<int> captured;
+            bool cancelled = false;
+            bool again = false;
+            size_t pending = 0;
+            auto started = steady_clock::now();
+            {
+                thread_pool tp;
+                std::vector<timer_handle> handles;
+                for (int i = 0; i < 1000; ++i) {
+                    handles.push_back(tp.add_after(hours(1), [&] { ++ran; }));
+                }
+                auto state = std::make_shared<int>(0);
+                captured = state;
+                timer_handle handle = tp.add_after(hours(1), [&ran, state] { ++ran; });
+                state.reset();
+                cancelled = handle.cancel();
+                again = handle.cancel();
+                for (auto& h : handles) {
+                    h.cancel();
+                }
+                pending = tp.metrics().timers_pending;
+            }
+
+            THEN("their tasks are destroyed at once and the pool does not wait for them"){
+                REQUIRE(cancelled);
+                REQUIRE(!again);
+                REQUIRE(captured.expired());
+                REQUIRE(pending == 0);
+                REQUIRE(ran == 0);
+                REQUIRE(steady_clock::now() - started < seconds(10));
+            }
+        }
+        WHEN("a timer is rescheduled sooner and later"){
+            std::atomic<int> sooner{0};
+            std::atomic<int> later{0};
+            utils::semaphore s(1);
+            thread_pool tp;
+            timer_handle soon = tp.add_after(hours(1), [&] {
+                ++sooner;
+                s.notify();
+            });
+            timer_handle copy = soon;
+            bool moved_in = copy.reschedule(milliseconds(10));
+            s.wait();
+            timer_handle late = tp.add_after(milliseconds(10), [&] { ++later; });
+            bool moved_out = late.reschedule(steady_clock::now() + hours(1));
+            std::this_thread::sleep_for(milliseconds(50));
+            bool still_pending = late.pending();
+            bool cancelled_late = late.cancel();
+
+            THEN("each fires once at its new time, if at all"){
+                REQUIRE(moved_in);
+                REQUIRE(sooner == 1);
+                REQUIRE(!soon.reschedule(milliseconds(10)));
+                REQUIRE(!soon.cancel());
+                REQUIRE(moved_out);
+                REQUIRE(still_pending);
+                REQUIRE(cancelled_late);
+                REQUIRE(later == 0);
+                REQUIRE(!timer_handle().cancel());
+            }
+        }
+    }
+}
+
+SCENARIO("slab_heap recycles task records across threads", "[allocator]"){
+    GIVEN("records allocated on one thread"){
+        using details::slab_heap;
+
+        WHEN("another thread frees them"){
+            const size_t count = 2 * slab_heap::batch_limit;
+            size_t reused = 0;
+            // A new thread starts with an empty cache, and no record in the library is this big
+            std::thread producer([&] {
+                std::vector<void*> first;
+                for (size_t i = 0; i < count; ++i) {
+                    first.push_back(slab_heap::allocate(200));
+                }
+                std::thread consumer([&] {
+                    for (void* p : first) {
+                        slab_heap::deallocate(p);
+                    }
+                });
+                consumer.join();
+                std::vector<void*> second;
+                for (size_t i = 0; i < count; ++i) {
+                    second.push_back(slab_heap::allocate(200));
+                    reused += std::find(first.begin(), first.end(), second.back()) != first.end();
+                }
+                for (void* p : second) {
+                    slab_heap::deallocate(p);
+                }
+            });
+            producer.join();
+
+            THEN("they come back to the allocating thread"){
+#if EXTR_SLAB_ALLOCATOR
+                REQUIRE(reused == count);
+#endif
+            }
+        }
+        WHEN("the allocating thread has exited"){
+            std::vector<void*> orphans;
+            std::thread producer([&] {
+                for (size_t i = 0; i < 100; ++i) {
+                    orphans.push_back(slab_heap::allocate(i % 2 ? 40 : 100));
+                }
+                orphans.push_back(slab_heap::allocate(4096));
+            });
+            producer.join();
+            for (void* p : orphans) {
+                static_cast<char*>(p)[0] = 1;
+                slab_heap::deallocate(p);
+            }
+            std::atomic<int> completed{0};
+            {
+                thread_pool tp(2);
+                for (int i = 0; i < 1000; ++i) {
+                    tp.add([&] { ++completed; });
+                }
+            }
+
+            THEN("its records can still be freed and its heap is reused"){
+                REQUIRE(completed == 1000);
+            }
+        }
+    }
+}
+
+SCENARIO("rate_limited_executor spaces closures out", "[rate][thread_pool][executor]"){
+    GIVEN("a thread_pool(2) limited to 100 closures per second with a burst of 5"){
+        WHEN("15 closures are added at once"){
+            std::vector<std::chrono::steady_clock::duration> started(15);
+            std::atomic<int> ran{0};
+            size_t backlog = 0;
+            utils::semaphore done(15);
+            thread_pool tp(2);
+            auto begin = std::chrono::steady_clock::now();
+            {
+                rate_limited_executor rl(&tp, 100, 5);
+                for (size_t i = 0; i < started.size(); ++i) {
+                    rl.add([&, i] {
+                        started[i] = std::chrono::steady_clock::now() - begin;
+                        ++ran;
+                        done.notify();
+                    });
+                }
+                backlog = rl.backlog();
+                done.wait();
+            }
+
+            THEN("the burst starts at once and the rest one interval apart"){
+                REQUIRE(ran == 15);
+                REQUIRE(backlog == 10);
+                for (size_t i = 5; i < started.size(); ++i) {
+                    REQUIRE(started[i] >= std::chrono::milliseconds(10 * (i - 4)) - std::chrono::milliseconds(1));
+                }
+            }
+        }
+        WHEN("the limiter goes away with closures still deferred"){
+            std::atomic<int> ran{0};
+            size_t queued = 0;
+            thread_pool tp(2);
+            {
+                rate_limited_executor rl(&tp, 100, 1);
+                for (int i = 0; i < 5; ++i) {
+                    rl.add([&] { ++ran; });
+                }
+                queued = rl.metrics().queued;
+            }
+            tp.shutdown();
+
+            THEN("they are still handed on"){
+                REQUIRE(queued == 4);
+                REQUIRE(ran == 5);
+            }
+        }
+    }
+    GIVEN("a full thread_pool(1) that runs overflow in the caller"){
+        thread_pool_options options;
+        options.threads = 1;
+        options.capacity = 1;
+        options.overflow = overflow_policy::run_in_caller;
+
+        WHEN("a deferred closure falls due"){
+            std::atomic<int> ran{0};
+            std::atomic<bool> on_worker{false};
+            utils::semaphore gate(1);
+            utils::semaphore blocked(1);
+            thread_pool tp(options);
+            tp.add([&] {
+                blocked.notify();
+                gate.wait();
+            });
+            blocked.wait();
+            tp.add([&] { ++ran; });
+            {
+                rate_limited_executor rl(&tp, 1000, 1);
+                rl.add([&] { ++ran; });
+                rl.add([&] {
+                    on_worker = tp.running_in_this_thread();
+                    ++ran;
+                });
+                while (rl.backlog() != 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            gate.notify();
+            tp.shutdown();
+
+            THEN("it is queued past the bound instead of running on the timer thread"){
+                REQUIRE(ran == 3);
+                REQUIRE(on_worker);
+            }
+        }
+    }
+}
+
+SCENARIO("task trace export", "[trace][thread_pool][serial_executor][executor]"){
+    GIVEN("a named thread_pool and a serial_executor on it"){
+#if EXTR_TRACE
+        WHEN("tasks, a strand and a timer run while tracing"){
+            std::string json;
+            {
+                utils::semaphore done(11);
+                thread_pool tp(2);
+                tp.set_trace_name("io \"pool\"");
+                serial_executor se(&tp);
+                se.set_trace_name("strand");
+                tracing::clear();
+                tracing::start();
+                for (int i = 0; i < 5; ++i) {
+                    tp.add([&] { done.notify(); });
+                    se.add([&] { done.notify(); });
+                }
+                tp.add_after(std::chrono::milliseconds(5), [&] { done.notify(); });
+                done.wait();
+                tp.shutdown();
+                tracing::stop();
+                std::ostringstream out;
+                tracing::write_chrome_json(out);
+                json = out.str();
+            }
+            auto count = [&](std::string const& what) {
+                size_t n = 0;
+                for (size_t at = json.find(what); at != std::string::npos; at = json.find(what, at + 1)) {
+                    ++n;
+                }
+                return n;
+            };
+
+            THEN("the JSON names both executors and joins every submit to its run"){
+                REQUIRE(json.find("{\"traceEvents\":[") == 0);
+                REQUIRE(count("\"name\":\"io \\\"pool\\\"\"") == 1);
+                REQUIRE(count("\"name\":\"strand\"") == 1);
+                // 5 pool tasks, 5 strand closures, their drain jobs on the pool and the timer
+                REQUIRE(count("\"ph\":\"s\"") >= 12);
+                REQUIRE(count("\"ph\":\"f\"") == count("\"ph\":\"s\""));
+                REQUIRE(count("\"ph\":\"B\"") == count("\"ph\":\"E\""));
+                REQUIRE(count("\"ph\":\"t\"") == 1);
+            }
+        }
+        WHEN("a named executor is destroyed before the trace is written"){
+            tracing::clear();
+            tracing::start();
+            {
+                utils::semaphore done(1);
+                thread_pool tp(1);
+                tp.set_trace_name("gone");
+                tp.add([&] { done.notify(); });
+                done.wait();
+            }
+            tracing::stop();
+            std::ostringstream out;
+            tracing::write_chrome_json(out);
+
+            THEN("its name was dropped with it"){
+                REQUIRE(out.str().find("\"gone\"") == std::string::npos);
+                REQUIRE(out.str().find("\"executor 1\"") != std::string::npos);
+            }
+        }
+#else
+        WHEN("tracing is compiled out"){
+            tracing::start();
+            bool active = tracing::active();
+            std::ostringstream out;
+            tracing::write_chrome_json(out);
+            tracing::stop();
+
+            THEN("task records carry nothing and the trace is empty"){
+                REQUIRE(std::is_empty<details::task_trace>::value);
+                REQUIRE(!active);
+                REQUIRE(out.str() == "{\"traceEvents\":[],\"displayTimeUnit\":\"ns\"}\n");
+            }
+        }
+#endif
+    }
+}
+
+SCENARIO("task_group waits by helping", "[task_group][thread_pool][executor]"){
+    GIVEN("a thread_pool(1)"){
+        WHEN("a task forks nested groups and waits for them on the only worker"){
+            std::atomic<int> leaves{0};
+            std::atomic<int> complete{0};
+            utils::semaphore done(1);
+            thread_pool tp(1);
+            tp.add([&] {
+                task_group outer(tp);
+                for (int i = 0; i < 4; ++i) {
+                    outer.run([&] {
+                        std::atomic<int> mine{0};
+                        task_group inner(tp);
+                        for (int j = 0; j < 8; ++j) {
+                            inner.run([&] {
+                                ++mine;
+                                ++leaves;
+                            });
+                        }
+                        inner.wait();
+                        // Each wait returns only once its own group is done
+                        complete += mine == 8;
+                    });
+                }
+                outer.wait();
+                done.notify();
+            });
+            done.wait();
+
+            THEN("every closure ran without another thread"){
+                REQUIRE(leaves == 32);
+                REQUIRE(complete == 4);
+            }
+        }
+        WHEN("a strand's closure waits and helps with an unrelated task"){
+            std::atomic<bool> in_strand{false};
+            std::atomic<bool> overlapped{false};
+            std::atomic<bool> looked_held{false};
+            std::atomic<int> ran{0};
+            thread_pool tp(1);
+            strand st;
+            st.add(&tp, [&] {
+                in_strand = true;
+                task_group group(tp);
+                group.run([&] {
+                    looked_held = st.running_in_this_thread();
+                    st.dispatch(&tp, [&] {
+                        overlapped = in_strand.load();
+                        ++ran;
+                    });
+                });
+                group.wait();
+                in_strand = false;
+            });
+            tp.shutdown();
+
+            THEN("the task does not run as part of the strand"){
+                REQUIRE(!looked_held);
+                REQUIRE(!overlapped);
+                REQUIRE(ran == 1);
+            }
+        }
+    }
+    GIVEN("a thread_pool with two workers and no stand-ins"){
+        thread_pool_options options;
+        options.threads = 2;
+        options.max_threads = 2;
+
+        WHEN("a member running on the other worker adds work after the waiter ran out"){
+            std::atomic<bool> elsewhere{false};
+            std::atomic<int> ran{0};
+            utils::semaphore done(1);
+            thread_pool tp(options);
+            tp.add([&] {
+                std::thread::id waiter = std::this_thread::get_id();
+                task_group group(tp);
+                group.run([&] {
+                    elsewhere = std::this_thread::get_id() != waiter;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                    utils::semaphore helped(1);
+                    group.run([&] {
+                        ++ran;
+                        helped.notify();
+                    });
+                    // Only the waiter is free to run it
+                    helped.wait();
+                    ++ran;
+                });
+                // Leaves the member to the other worker
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                group.wait();
+                done.notify();
+            });
+            done.wait();
+            tp.shutdown();
+
+            THEN("the waiter goes back to helping"){
+                REQUIRE(elsewhere);
+                REQUIRE(ran == 2);
+            }
+        }
+    }
+    GIVEN("a thread_pool(2) and a group waited on from outside"){
+        WHEN("closures throw"){
+            std::atomic<int> ran{0};
+            bool caught = false;
+            size_t pending = 1;
+            thread_pool tp(2);
+            task_group group(tp);
+            for (int i = 0; i < 100; ++i) {
+                group.run([&ran, i] {
+                    ++ran;
+                    if (i % 10 == 0) {
+                        throw std::runtime_error("failed");
+                    }
+                });
+            }
+            try {
+                group.wait();
+            } catch (std::runtime_error const&) {
+                caught = true;
+            }
+            pending = group.pending();
+            group.run([&] { ++ran; });
+            group.wait();
+
+            THEN("wait() rethrows one of them once all have finished"){
+                REQUIRE(caught);
+                REQUIRE(pending == 0);
+                REQUIRE(ran == 101);
+            }
+        }
+        WHEN("the pool is shut down with members still queued"){
+            std::atomic<int> ran{0};
+            bool broken = false;
+            utils::semaphore gate(1);
+            utils::semaphore blocked(2);
+            thread_pool tp(2);
+            task_group group(tp);
+            for (int i = 0; i < 2; ++i) {
+                tp.add([&] {
+                    blocked.notify();
+                    gate.wait();
+                });
+            }
+            blocked.wait();
+            for (int i = 0; i < 10; ++i) {
+                group.run([&] { ++ran; });
+            }
+            std::thread releaser([&] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                gate.notify();
+            });
+            tp.shutdown_now();
+            releaser.join();
+            try {
+                group.wait();
+            } catch (std::future_error const& e) {
+                broken = e.code() == std::future_errc::broken_promise;
+            }
+
+            THEN("the discarded members count as broken and wait() returns"){
+                REQUIRE(ran == 0);
+                REQUIRE(broken);
+                REQUIRE(group.pending() == 0);
+            }
+        }
+    }
+}